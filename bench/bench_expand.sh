@@ -0,0 +1,59 @@
+#!/bin/sh
+. "$BENCHDIR/common.sh"
+
+# ${Lk} expands ${L0} 2^k times.
+expand_bench() {
+	awk -v l0="$1" 'BEGIN {
+		print "CC = cc"
+		print "CFLAGS = -O2 -pipe"
+		print "SRCS = main.c util.c lib/io.c"
+		print "EXT = .o"
+		print "L0 = " l0
+		for (i = 1; i <= 18; ++i)
+			printf "L%d = ${L%d}${L%d}\n", i, i - 1, i - 1
+	}' > Mkfile
+	for k in 15 16 17 18; do
+		measure $((1 << k)) -V "L$k"
+	done
+}
+
+# ${.IMPSRC} (empty here) makes every level depend on the target, so
+# that none of the expansions can be remembered.
+begin "N expansions of a recipe-like macro"
+expand_bench '${CC} -c ${CFLAGS} -Wall -Wextra -Iinclude -o $${out} $${src}${.IMPSRC} ; '
+
+begin "N expansions of a macro with modifiers"
+expand_bench '${SRCS:M*.c:T:R:J-}${EXT}${.IMPSRC}'
+
+# N references to a macro that expands 127 macros in a tree of depth 7.
+begin "N references to a macro that does not depend on the target"
+awk 'BEGIN {
+	for (i = 1; i < 64; ++i)
+		printf "T%d = ${T%d}${T%d}\n", i, 2 * i, 2 * i + 1
+	for (i = 64; i < 128; ++i)
+		printf "T%d = %c\n", i, 97 + i % 26
+}' > Mkfile.head
+for n in 25000 50000 100000 200000; do
+	cp Mkfile.head Mkfile
+	awk -v n=$n 'BEGIN {
+		for (i = 0; i < n; ++i)
+			print ".if \"${T1}\" == \"\"\n.endif"
+		print "all:"
+	}' >> Mkfile
+	measure $n
+done
+
+# SRCS holds 1000 words; each reference filters and rewrites all of them.
+begin "N references to a chain of modifiers"
+for n in 1000 2000 4000 8000; do
+	awk -v n=$n 'BEGIN {
+		printf "SRCS ="
+		for (i = 0; i < 1000; ++i)
+			printf " src/dir%d/file%d.%s", i % 10, i, i % 4 ? "c" : "h"
+		print ""
+		for (i = 0; i < n; ++i)
+			print ".if \"${SRCS:M*.c:R:T:=.o}\" == \"\"\n.endif"
+		print "all:"
+	}' > Mkfile
+	measure $n
+done
@@ -0,0 +1,38 @@
+#!/bin/sh
+. "$BENCHDIR/common.sh"
+
+# A wide graph rather than a chain: building a chain recurses once per
+# link, which would run out of stack before it runs out of targets.
+begin "N targets in one directory, all needed by the goal"
+for n in 10000 20000 40000 80000; do
+	awk -v n=$n 'BEGIN {
+		printf "all:"
+		for (i = 0; i < n; ++i)
+			printf " t%d", i
+		print ""
+		for (i = 0; i < n; ++i)
+			printf "t%d:\n", i
+	}' > Mkfile
+	measure $n
+done
+
+# N objects, each newer than its source and one of 100 headers: nothing to do.
+begin "a no-op build of N targets"
+for n in 62500 125000 250000 500000; do
+	awk -v n=$n 'BEGIN {
+		printf "all:"
+		for (i = 0; i < n; ++i)
+			printf " o%d", i
+		print ""
+		for (i = 0; i < n; ++i)
+			printf "o%d: s%d.c h%d.h\n\tcp s%d.c $@\n", i, i, i % 100, i
+	}' > Mkfile
+	awk -v n=$n 'BEGIN {
+		for (i = 0; i < n; ++i)
+			print "s" i ".c"
+		for (i = 0; i < 100; ++i)
+			print "h" i ".h"
+	}' | xargs touch -d '2020-01-01 00:00:00'
+	awk -v n=$n 'BEGIN { for (i = 0; i < n; ++i) print "o" i }' | xargs touch
+	measure $n
+done
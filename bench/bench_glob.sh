@@ -0,0 +1,31 @@
+#!/bin/sh
+. "$BENCHDIR/common.sh"
+
+# SRCS holds 50000 words; N words are matched by N / 50000 references.
+# A pattern with brackets is passed to fnmatch(), for comparison.
+glob_bench() {
+	for n in 2000000 4000000 8000000 16000000; do
+		awk -v n=$n -v mod="$1" 'BEGIN {
+			printf "SRCS ="
+			for (i = 0; i < 50000; ++i)
+				printf " %sfile%d.%s", i % 3 ? "" : "t_", i, i % 4 ? "c" : "h"
+			print ""
+			for (i = 0; i < n; i += 50000)
+				printf ".if \"${SRCS:%s}\" == \"\"\n.endif\n", mod
+			print "all:"
+		}' > Mkfile
+		measure $n
+	done
+}
+
+begin "N words matched against :M*.c"
+glob_bench 'M*.c'
+
+begin "N words matched against :M*.[c] with fnmatch()"
+glob_bench 'M*.[c]'
+
+begin "N words matched against :Nt_*"
+glob_bench 'Nt_*'
+
+begin "N words matched against :Nt[_]* with fnmatch()"
+glob_bench 'Nt[_]*'
@@ -0,0 +1,62 @@
+#!/bin/sh
+. "$BENCHDIR/common.sh"
+
+# N objects with 8 prerequisites each, out of 1000 headers, all up to date.
+begin "N targets with 8 prerequisites each"
+for n in 10000 20000 40000 80000; do
+	awk -v n=$n 'BEGIN {
+		printf "all:"
+		for (i = 0; i < n; ++i)
+			printf " o%d", i
+		print ""
+		for (i = 0; i < n; ++i) {
+			printf "o%d: src/s%d.c", i, i
+			for (j = 1; j < 8; ++j)
+				printf " inc/h%d.h", (i * 7 + j * 131) % 1000
+			print ""
+		}
+		for (i = 0; i < 1000; ++i)
+			printf "inc/h%d.h:\n", i
+		print "src/s0.c:"
+		print "\t@:"
+	}' > Mkfile
+	measure $n -V MAKE
+done
+
+# N targets, each with a source in one of 100 subdirectories.
+begin "N targets with a prerequisite in a subdirectory"
+for n in 10000 20000 40000 80000; do
+	awk -v n=$n 'BEGIN {
+		printf ".SUBDIRS:"
+		for (d = 0; d < 100; ++d)
+			printf " d%d", d
+		print ""
+		printf "all:"
+		for (i = 0; i < n; ++i)
+			printf " o%d", i
+		print ""
+		for (i = 0; i < n; ++i)
+			printf "o%d: d%d/s%d.c\n", i, i % 100, i
+	}' > Mkfile
+	awk 'BEGIN { for (d = 0; d < 100; ++d) print "d" d }' | xargs mkdir -p
+	awk 'BEGIN { for (d = 0; d < 100; ++d) print "d" d "/Mkfile" }' | xargs touch
+	awk -v n=$n 'BEGIN { for (i = 0; i < n; ++i) print "d" (i % 100) "/s" i ".c" }' | xargs touch
+	measure $n
+done
+
+# One goal in a subdirectory, below a Mkfile with N rules it does not need.
+begin "a leaf goal below N rules with 8 prerequisites each"
+for n in 25000 50000 100000 200000; do
+	awk -v n=$n 'BEGIN {
+		print ".SUBDIRS: leaf"
+		for (i = 0; i < n; ++i) {
+			printf "o%d: src/s%d.c", i, i
+			for (j = 1; j < 8; ++j)
+				printf " inc/h%d.h", (i * 7 + j * 131) % 1000
+			printf "\n\tcc -c src/s%d.c\n", i
+		}
+	}' > Mkfile
+	mkdir -p leaf
+	printf 'goal:\n\t@:\n' > leaf/Mkfile
+	measure $n -C leaf goal
+done
@@ -0,0 +1,28 @@
+#!/bin/sh
+. "$BENCHDIR/common.sh"
+
+# N conditionals, 8 directories deep, that refer to 1000 macros defined
+# and exported at the top, and to one that is not defined at all.
+begin "N references to exported macros"
+mkdir -p a/b/c/d/e/f/g
+awk 'BEGIN {
+	for (i = 0; i < 1000; ++i)
+		printf "M%d = %d\n", i, i
+	printf ".EXPORTS:"
+	for (i = 0; i < 1000; ++i)
+		printf " M%d", i
+	printf "\n.SUBDIRS: a\nall: a/all\n"
+}' > Mkfile
+d=a
+for c in b c d e f g; do
+	printf '.SUBDIRS: %s\nall: %s/all\n' $c $c > $d/Mkfile
+	d=$d/$c
+done
+for n in 25000 50000 100000 200000; do
+	awk -v n=$n 'BEGIN {
+		for (i = 0; i < n; i += 5)
+			printf ".if \"${M%d}${M%d}${M%d}${M%d}${UNDEF}\" == \"\"\n.endif\n", i % 1000, (i * 7) % 1000, (i + 1) % 1000, 999
+		printf "all:\n\t@:\n"
+	}' > $d/Mkfile
+	measure $n
+done
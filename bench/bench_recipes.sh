@@ -0,0 +1,46 @@
+#!/bin/sh
+. "$BENCHDIR/common.sh"
+
+# N targets that share a recipe line.  SHELL is true(1), so that the
+# expansion of the line is not drowned out by the shell.
+begin "N recipe lines"
+for n in 500 1000 2000 4000; do
+	awk -v n=$n 'BEGIN {
+		print "SHELL = true"
+		print "CC = cc"
+		print "CFLAGS = -O2 -pipe -Wall -Wextra"
+		print "SRCS = main.c util.c lib/io.c lib/str.c"
+		for (i = 0; i < n; ++i)
+			t = t " t" i
+		print "all:" t
+		print t ":"
+		print "\t@${CC} ${CFLAGS:N-W*} -c -o ${.TARGET}.o ${SRCS:M*.c:T:R:=.c}"
+	}' > Mkfile
+	measure $n
+done
+
+# N objects made by an inference rule whose line is full of automatic
+# variables.
+begin "N recipe lines with \$@ \$< \$^ \$*"
+for n in 500 1000 2000 4000; do
+	awk -v n=$n 'BEGIN {
+		print "SHELL = true"
+		for (i = 0; i < n; ++i)
+			t = t " s" i ".o"
+		print "all:" t
+		for (i = 0; i < n; ++i)
+			printf "s%d.o: h%d.h h%d.h\n", i, i % 10, (i + 1) % 10
+		print ".c.o:"
+		printf "\t@:"
+		for (j = 0; j < 128; ++j)
+			printf " $@ $< $^ $*"
+		print ""
+	}' > Mkfile
+	awk -v n=$n 'BEGIN {
+		for (i = 0; i < n; ++i)
+			print "s" i ".c"
+		for (i = 0; i < 10; ++i)
+			print "h" i ".h"
+	}' | xargs touch
+	measure $n
+done
@@ -0,0 +1,47 @@
+# shellcheck shell=sh
+# Common helpers for the bmk benchmarks, sourced by every bench_*.sh.
+
+WORK=$(mktemp -d 2>/dev/null || mktemp -d -t bmk)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 99
+
+BASE=
+
+# Count the allocations of $MK, if the counter can be built and preloaded.
+PRELOAD=
+if ${CC:-cc} -shared -fPIC -o "$WORK/malloc_count.so" "$BENCHDIR/malloc_count.c" 2>/dev/null \
+    && MALLOC_COUNT="$WORK/.allocs" LD_PRELOAD="$WORK/malloc_count.so" "$MK" -f /dev/null -V MAKE >/dev/null 2>&1 \
+    && [ -s "$WORK/.allocs" ]; then
+	PRELOAD="$WORK/malloc_count.so"
+fi
+
+# Print a section header.
+begin() {
+	printf '\n== %s ==\n' "$1"
+	printf '%8s %10s %10s %6s %12s %11s\n' N seconds us/item ratio allocs/item bytes/item
+	BASE=
+}
+
+# measure N [args...] -- run $MK in the work dir and report its CPU time.
+measure() {
+	n=$1
+	shift
+	rm -f "$WORK/.failed" "$WORK/.allocs"
+	t=$( ( MALLOC_COUNT="$WORK/.allocs" LD_PRELOAD="$PRELOAD" "$MK" "$@" >/dev/null 2>"$WORK/.err" \
+	    || : > "$WORK/.failed"; times ) | awk '
+		function sec(s) { sub(/s$/, "", s); split(s, a, "m"); return a[1] * 60 + a[2] }
+		NR == 2 { printf "%.3f\n", sec($1) + sec($2) }')
+	if [ -f "$WORK/.failed" ]; then
+		echo "measure: mk failed for N=$n:" >&2
+		cat "$WORK/.err" >&2
+		exit 1
+	fi
+	per=$(awk -v t="$t" -v n="$n" 'BEGIN { printf "%.2f\n", t * 1e6 / n }')
+	[ -n "$BASE" ] || [ "$t" = 0.000 ] || BASE=$per
+	allocs='- -'
+	[ -s "$WORK/.allocs" ] && allocs=$(awk -v n="$n" '{ printf "%.2f %.0f\n", $1 / n, $2 * 1024 / n }' "$WORK/.allocs")
+	awk -v n="$n" -v t="$t" -v per="$per" -v base="$BASE" -v allocs="$allocs" 'BEGIN {
+		split(allocs, a, " ")
+		printf "%8d %10.3f %10.2f %6.2f %12s %11s\n", n, t, per, (base > 0 ? per / base : 1), a[1], a[2]
+	}'
+}
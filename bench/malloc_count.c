@@ -0,0 +1,72 @@
+/*
+ * Counts the calls to malloc(), calloc() and realloc() of a process, for
+ * the benchmarks.  Preloaded with LD_PRELOAD (glibc only); the count and
+ * the peak resident set size in kB are written to the file named by
+ * $MALLOC_COUNT when the process exits.
+ * Neither variable is passed on to the commands run by the process.
+ */
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+extern void *__libc_malloc ();
+extern void *__libc_calloc ();
+extern void *__libc_realloc ();
+
+static unsigned long count;
+static pid_t owner;
+static char *file;
+
+void *
+malloc (n)
+size_t n;
+{
+	++count;
+	return __libc_malloc (n);
+}
+
+void *
+calloc (n, m)
+size_t n, m;
+{
+	++count;
+	return __libc_calloc (n, m);
+}
+
+void *
+realloc (p, n)
+void *p;
+size_t n;
+{
+	++count;
+	return __libc_realloc (p, n);
+}
+
+static void __attribute__ ((constructor))
+mc_init ()
+{
+	char *s;
+
+	owner = getpid ();
+	if ((s = getenv ("MALLOC_COUNT")) != NULL)
+		file = strdup (s);
+	unsetenv ("MALLOC_COUNT");
+	unsetenv ("LD_PRELOAD");
+}
+
+static void __attribute__ ((destructor))
+mc_fini ()
+{
+	struct rusage ru;
+	FILE *f;
+
+	if (file == NULL || getpid () != owner || (f = fopen (file, "w")) == NULL)
+		return;
+	getrusage (RUSAGE_SELF, &ru);
+	fprintf (f, "%lu %ld\n", count, ru.ru_maxrss);
+	fclose (f);
+}
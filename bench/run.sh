@@ -0,0 +1,39 @@
+#!/bin/sh
+# Benchmark runner for bmk.
+#
+# Runs every bench/bench_*.sh and prints the CPU time mk needed for growing
+# inputs.  The ratio column is the time per item relative to the smallest
+# input: it stays close to 1.0 as long as mk scales linearly.  The last
+# columns are the calls to malloc(), calloc() and realloc() and the peak
+# resident memory, per item; they are only filled in where
+# bench/malloc_count.c can be preloaded (glibc).
+#
+# Usage:
+#   sh bench/run.sh            # use ./mk
+#   MK=./mk sh bench/run.sh    # pick the binary
+
+set -u
+
+BENCHDIR=$(CDPATH= cd -- "$(dirname -- "$0")" && pwd)
+ROOT=$(dirname -- "$BENCHDIR")
+
+if [ -z "${MK:-}" ]; then
+	if [ -x "$ROOT/mk" ]; then
+		MK="$ROOT/mk"
+	else
+		echo "run.sh: no 'mk' binary found, build it with: make" >&2
+		exit 2
+	fi
+fi
+
+# The benchmarks run in temporary directories.
+case "$MK" in
+*/*)	case "$MK" in /*) ;; *) MK="$(pwd)/$MK" ;; esac ;;
+esac
+
+export MK BENCHDIR
+
+for f in "$BENCHDIR"/bench_*.sh; do
+	[ -f "$f" ] || continue
+	sh "$f" || exit 1
+done
@@ -47,10 +47,10 @@ syn match bmkTarget           "^[~A-Za-z0-9_./$(){}%*@-][A-Za-z0-9_./\t $(){}%*@
 	\ skipnl nextgroup=bmkCommands,bmkCommandError
 
 syn region bmkSpecTarget	transparent matchgroup=bmkSpecTarget
-	\ start="^\.\(DEFAULT\|SUFFIXES\|SUBDIRS\|FOREIGN\|EXPORTS\)\>\s*:\{1,2}[^:=]"rs=e-1
+	\ start="^\.\(DEFAULT\|SUFFIXES\|SUBDIRS\|FOREIGN\|EXPORTS\|RESTAT\|DEPFILE\|NOFOLLOW\)\>\s*:\{1,2}[^:=]"rs=e-1
 	\ end="[^\\]$" keepend
 	\ contains=bmkIdent,bmkSpecTarget,bmkNextLine,bmkComment skipnl nextGroup=bmkCommands
-syn match bmkSpecTarget	"^\.\(DEFAULT\|SUFFIXES\|SUBDIRS\|FOREIGN\|EXPORTS\)\>\s*::\=\s*$"
+syn match bmkSpecTarget	"^\.\(DEFAULT\|SUFFIXES\|SUBDIRS\|FOREIGN\|EXPORTS\|RESTAT\|DEPFILE\|NOFOLLOW\)\>\s*::\=\s*$"
 	\ contains=bmkIdent,bmkComment
 	\ skipnl nextgroup=bmkCommands,bmkCommandError
 
@@ -0,0 +1,84 @@
+/* Configuration */
+#define SHELL "sh"
+#define MAKEFILE "Mkfile"
+
+/* System Extensions */
+
+#define _ALL_SOURCE 1		/* Enable extensions on AIX, Interix, z/OS */
+#define _DARWIN_C_SOURCE 1	/* Enable general extensions on MacOS */
+#define __EXTENSIONS__ 1	/* Enable general extensions on Solaris */
+#define _GNU_SOURCE 1		/* Enable GNU extensions on systems that have them */
+#define _BSD_SOURCE 1		/* Enable BSD functions */
+#define _NETBSD_SOURCE 1	/* Enable NetBSD compatibility extensions on Minix */
+#define _OPENBSD_SOURCE 1	/* Enable OpenBSD compatibility extensions on NetBSD */
+
+/* Headers */
+#define HAVE_ERR_H 1
+#define HAVE_FNMATCH_H 1
+#define HAVE_INTTYPES_H 1
+#define HAVE_LIBGEN_H 1
+#define HAVE_LIMITS_H 1
+#define HAVE_MEMORY_H 1
+#define HAVE_POLL_H 1
+#define HAVE_STDBOOL_H 1
+#define HAVE_STDINT_H 1
+#define HAVE_STDIO_H 1
+#define HAVE_STDLIB_H 1
+#define HAVE_STRING_H 1
+#define HAVE_STRINGS_H 1
+#define HAVE_SYS_INOTIFY_H 1
+#define HAVE_SYS_MMAN_H 1
+#define HAVE_SYS_SOCKET_H 1
+#define HAVE_SYS_STAT_H 1
+#define HAVE_SYS_TIME_H 1
+#define HAVE_SYS_TIMEB_H 1
+#define HAVE_SYS_TYPES_H 1
+#define HAVE_SYS_UN_H 1
+#define HAVE_SYS_WAIT_H 1
+#define HAVE_TIME_H 1
+#define HAVE_UNISTD_H 1
+
+/* sys/queue.h - test for a complete OpenBSD-compatible implementation */
+#undef HAVE_SYS_QUEUE_H
+
+/* Functions */
+#define HAVE_BASENAME 1
+#define HAVE_CLOCK_GETTIME 1
+#define HAVE_DIRNAME 1
+#define HAVE_FMEMOPEN 1
+#define HAVE_FNMATCH 1
+#define HAVE_FORK 1
+#define HAVE_FTIME 1
+#define HAVE_GETCWD 1
+#define HAVE_GETTIMEOFDAY 1
+#define HAVE_INOTIFY_INIT 1
+#define HAVE_LSTAT 1
+#define HAVE_MEMMOVE 1
+#define HAVE_MMAP 1
+#define HAVE_POLL 1
+#define HAVE_REALLOCARRAY 1
+#define HAVE_REALPATH 1
+#define HAVE_SENDMSG 1
+#define HAVE_SOCKET 1
+#define HAVE_STRDUP 1
+#define HAVE_STRERROR 1
+#define HAVE_STRSEP 1
+#define HAVE_STRTOL 1
+#define HAVE_WAITPID 1
+
+/* Types */
+#undef HAVE_UNION_WAIT
+#define HAVE_TIMESPEC 1
+#define HAVE_STAT_MTIM 1
+#undef HAVE_STAT_MTIMESPEC
+#define HAVE_STATX 1
+#define HAVE_PTHREAD 1
+
+/* Special Tests */
+#define NEED_TIME_H 1
+#define HAVE_DESIGNATED_INITIALIZERS 1
+#define WORKS_STRSEP 1
+#undef HAVE_SYS_ERRLIST
+#define HAVE_VOID_PTR 1
+#define HAVE_VOID_FUNC 1
+#define HAVE__BOOL 1
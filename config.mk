@@ -0,0 +1,9 @@
+CC = cc
+CPP = cc -E
+CFLAGS =  -ansi -O2 -Wall -Wextra -Wno-return-type -Wno-missing-parameter-type
+CPPFLAGS =  -DHAVE_CONFIG_H -DBMK_VERSION=\"0.4\" -DBMK_EMAIL=\"benni@stuerz.xyz\"
+LDFLAGS = 
+
+PREFIX = /usr/local
+BINDIR = ${PREFIX}/bin
+MANDIR = ${PREFIX}/man
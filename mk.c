@@ -26,6 +26,22 @@
 #if HAVE_FTIME && HAVE_SYS_TIMEB_H
 # include <sys/timeb.h>
 #endif
+#if HAVE_MMAP && HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+#if HAVE_INOTIFY_INIT && HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
+#if HAVE_POLL && HAVE_POLL_H
+# include <poll.h>
+#endif
+#if HAVE_SYS_SOCKET_H && HAVE_SYS_UN_H
+# include <sys/socket.h>
+# include <sys/un.h>
+#endif
+#if HAVE_PTHREAD
+# include <pthread.h>
+#endif
 #include <assert.h>
 #if HAVE_UNISTD_H
 # include <unistd.h>
@@ -52,6 +68,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <ctype.h>
+#include <signal.h>
 #include <fcntl.h>
 #if NEED_TIME_H
 # include <time.h>
@@ -84,11 +101,12 @@ typedef int mk_wait_t;
 
 extern int errno;
 
-static const char *cpath, *objdir = NULL;
-static int verbose = 0, cline = 0;
-static bool conterr = false;
+static const char *objdir = NULL;
+static int verbose = 0;
+static bool conterr = false, watching = false;
 static const struct timespec time_zero;
 static FILE *timings_file = NULL;
+static char *state_path = NULL;
 
 #if HAVE_DESIGNATED_DECLARATORS
 # define FIELD(name, value) .name = value
@@ -114,6 +132,7 @@ static struct macro m_shell = {
 	FIELD (value, SHELL),
 	FIELD (help, NULL),
 	FIELD (lazy, false),
+	FIELD (prog, NULL),
 }, m_make = {
 	FIELD (next, {&m_shell}),
 	FIELD (enext, {NULL}),
@@ -122,6 +141,7 @@ static struct macro m_shell = {
 	FIELD (value, NULL),
 	FIELD (help, NULL),
 	FIELD (lazy, false),
+	FIELD (prog, NULL),
 }, m_dmake = {
 	FIELD (next, {&m_make}),
 	FIELD (enext, {NULL}),
@@ -130,6 +150,7 @@ static struct macro m_shell = {
 	FIELD (value, NULL),
 	FIELD (help, NULL),
 	FIELD (lazy, false),
+	FIELD (prog, NULL),
 }, m_makeflags = {
 	FIELD (next, {&m_dmake}),
 	FIELD (enext, {NULL}),
@@ -138,6 +159,7 @@ static struct macro m_shell = {
 	FIELD (value, NULL),
 	FIELD (help, NULL),
 	FIELD (lazy, false),
+	FIELD (prog, NULL),
 }, m_dmakeflags = {
 	FIELD (next, {&m_makeflags}),
 	FIELD (enext, {NULL}),
@@ -146,6 +168,7 @@ static struct macro m_shell = {
 	FIELD (value, NULL),
 	FIELD (help, NULL),
 	FIELD (lazy, false),
+	FIELD (prog, NULL),
 };
 
 /*
@@ -154,15 +177,227 @@ static struct macro m_shell = {
  */
 static struct macro *globals = &m_dmakeflags;
 
+/* ARENAS */
+
+/*
+ * Temporaries of macro expansion (macro values about to be modified,
+ * expanded arguments of modifiers, words, the recipe line and its label)
+ * are bump-allocated from `scratch`.  They are all released at once, when
+ * the outermost user of the arena leaves it; if the arena needed more
+ * than one chunk, it is replaced by a single chunk large enough for all of
+ * them, so that a steady stream of expansions does not call malloc().
+ * A macro reference releases its own temporaries with arena_release().
+ */
+#define ARENA_CHUNK (64 * 1024)
+
+union arena_align {
+	void	*p;
+	long	 l;
+	double	 d;
+};
+
+#define ARENA_ROUND(n) (((n) + sizeof (union arena_align) - 1) & ~(sizeof (union arena_align) - 1))
+
+struct achunk {
+	struct achunk	*prev;
+	size_t		 len, cap;
+	union arena_align data[1];
+};
+
+struct arena {
+	struct achunk	*cur, *spare;
+	size_t		 size;		/* of all chunks in use */
+	int		 users;
+};
+
+struct amark {
+	struct achunk	*c;
+	size_t		 len;
+};
+
+/*
+ * Like the pools, the intern tables and the parser, `scratch` is used only
+ * by the main thread, so it has no lock.  The read-ahead threads must not
+ * expand macros, nor intern names or paths.
+ */
+static struct arena scratch;
+
+void
+arena_enter (a)
+struct arena *a;
+{
+	++a->users;
+}
+
+void
+arena_leave (a)
+struct arena *a;
+{
+	struct achunk *c;
+	size_t size;
+
+	assert (a->users > 0);
+	if (--a->users > 0 || a->cur == NULL)
+		return;
+
+	free (a->spare);
+	a->spare = NULL;
+
+	if (a->cur->prev == NULL) {
+		a->cur->len = 0;
+		return;
+	}
+
+	size = a->size;
+	while ((c = a->cur) != NULL) {
+		a->cur = c->prev;
+		free (c);
+	}
+	a->size = 0;
+	a->cur = NULL;
+
+	/* make the next chunk big enough for everything */
+	c = malloc (sizeof (struct achunk) + size);
+	if (c == NULL)
+		err (1, "malloc()");
+	c->prev = NULL;
+	c->len = 0;
+	c->cap = size;
+	a->cur = c;
+	a->size = size;
+}
+
+void_t *
+arena_alloc (a, n)
+struct arena *a;
+size_t n;
+{
+	struct achunk *c;
+	size_t cap;
+	char *p;
+
+	n = ARENA_ROUND (n);
+	c = a->cur;
+	if (c == NULL || c->len + n > c->cap) {
+		cap = c != NULL ? c->cap * 2 : ARENA_CHUNK;
+		if (cap < n)
+			cap = n;
+		if (a->spare != NULL && a->spare->cap >= cap) {
+			c = a->spare;
+			cap = c->cap;
+			a->spare = NULL;
+		} else {
+			c = malloc (sizeof (struct achunk) + cap);
+			if (c == NULL)
+				err (1, "malloc()");
+		}
+		c->prev = a->cur;
+		c->len = 0;
+		c->cap = cap;
+		a->cur = c;
+		a->size += cap;
+	}
+
+	p = (char *)c->data + c->len;
+	c->len += n;
+	return p;
+}
+
+void
+arena_mark (a, m)
+struct arena *a;
+struct amark *m;
+{
+	m->c = a->cur;
+	m->len = a->cur != NULL ? a->cur->len : 0;
+}
+
+/* free everything allocated since arena_mark() */
+void
+arena_release (a, m)
+struct arena *a;
+const struct amark *m;
+{
+	struct achunk *c;
+
+	while ((c = a->cur) != m->c) {
+		a->cur = c->prev;
+		a->size -= c->cap;
+
+		/* keep the largest chunk, for the next time */
+		if (a->spare == NULL || a->spare->cap < c->cap) {
+			free (a->spare);
+			a->spare = c;
+		} else {
+			free (c);
+		}
+	}
+	if (c != NULL)
+		c->len = m->len;
+}
+
+/* resize `p`, the last allocation, in place if it fits */
+void_t *
+arena_grow (a, p, old, n)
+struct arena *a;
+void_t *p;
+size_t old, n;
+{
+	struct achunk *c = a->cur;
+	void_t *q;
+
+	old = ARENA_ROUND (old);
+	if (c != NULL && (char *)p + old == (char *)c->data + c->len
+	    && c->len - old + ARENA_ROUND (n) <= c->cap) {
+		c->len = c->len - old + ARENA_ROUND (n);
+		return p;
+	}
+
+	q = arena_alloc (a, n);
+	memcpy (q, p, old < n ? old : n);
+	return q;
+}
+
+char *
+arena_strdup (a, s)
+struct arena *a;
+const char *s;
+{
+	size_t n = strlen (s) + 1;
+
+	return memcpy (arena_alloc (a, n), s, n);
+}
+
+/*
+ * The nodes of the parsed graph (files, interned paths, macros and
+ * subdirectories) are never freed.  Each type is bump-allocated from a
+ * pool of its own, which saves the bookkeeping of malloc() for every node
+ * and keeps the nodes of a type next to each other.  The prerequisites
+ * of rules that were only scanned (see lazy_rule()) are kept in
+ * `lazy_pool`.  Nodes are only made on the main thread, so the pools have
+ * no lock.
+ */
+static struct arena file_pool, path_pool, macro_pool, scope_pool, lazy_pool;
+
+#define pool_newa(a, n, T) ((T *)arena_zalloc ((a), (n) * sizeof (T)))
+#define pool_new(a, T) (pool_newa ((a), 1, T))
+
+void_t *
+arena_zalloc (a, n)
+struct arena *a;
+size_t n;
+{
+	return memset (arena_alloc (a, n), 0, n);
+}
+
 /* STRING BUFFER */
 
 typedef struct string {
 	char *ptr;
 	size_t len, cap;
+	struct arena *arena;	/* if not NULL, `ptr` lives there */
 } str_t;
 
-static str_t tmpstr;
-
 void
 str_new (s)
 str_t *s;
@@ -170,6 +405,18 @@ str_t *s;
 	s->len = 0;
 	s->cap = 10;
 	s->ptr = newa (s->cap + 1, char);
+	s->arena = NULL;
+}
+
+/* a string in the scratch arena, see arena_enter() */
+void
+str_scratch (s)
+str_t *s;
+{
+	s->len = 0;
+	s->cap = 30;
+	s->arena = &scratch;
+	s->ptr = arena_alloc (&scratch, s->cap + 1);
 }
 
 void
@@ -177,12 +424,19 @@ str_reserve (s, n)
 str_t *s;
 size_t n;
 {
+	size_t old;
+
 	if (s->cap == 0) {
 		s->cap = n;
-		s->ptr = newa (s->cap + 1, char);
+		s->ptr = s->arena != NULL ? arena_alloc (s->arena, s->cap + 1) : newa (s->cap + 1, char);
 	} else if ((s->len + n) > s->cap) {
+		old = s->cap;
 		for (s->cap *= 2; (s->len + n) > s->cap; s->cap *= 2);
-		s->ptr = renew (s->ptr, s->cap + 1, char);
+		if (s->arena != NULL) {
+			s->ptr = arena_grow (s->arena, s->ptr, old + 1, s->cap + 1);
+		} else {
+			s->ptr = renew (s->ptr, s->cap + 1, char);
+		}
 	}
 }
 
@@ -190,7 +444,8 @@ void
 str_free (s)
 str_t *s;
 {
-	free (s->ptr);
+	if (s->arena == NULL)
+		free (s->ptr);
 	memset (s, 0, sizeof (*s));
 }
 
@@ -283,7 +538,12 @@ str_t *s;
 {
 	char *t;
 	s->ptr[s->len] = '\0';
-	t = renew (s->ptr, s->len + 1, char);
+	if (s->arena != NULL) {
+		t = newa (s->len + 1, char);
+		memcpy (t, s->ptr, s->len + 1);
+	} else {
+		t = renew (s->ptr, s->len + 1, char);
+	}
 	memset (s, 0, sizeof (*s));
 	return t;
 }
@@ -324,6 +584,130 @@ int c;
 	return isupper (c) ? c - 'A' + 'a' : c;
 }
 
+/*
+ * Patterns of :M and :N are compiled before they are matched against every
+ * word.  A pattern made of literal text and `*` is split into its literal
+ * segments: the first and last are compared against the ends of the word,
+ * the ones in between are searched for from left to right, which is enough
+ * when only `*` is special.  Anything else (`?`, `[...]`) goes to fnmatch().
+ * The segments are kept in the scratch arena.
+ */
+struct gseg {
+	const char	*s;
+	size_t		 len;
+};
+
+struct glob {
+	const char	*pat;		/* passed to fnmatch(), if not NULL */
+	char		*buf;		/* unescaped text of the segments */
+	struct gseg	*segs;
+	size_t		 nsegs;
+	bool		 star, lstar, rstar;	/* any `*`, leading, trailing */
+};
+
+void
+glob_compile (g, pat)
+struct glob *g;
+const char *pat;
+{
+	const char *p;
+	char *t;
+
+	memset (g, 0, sizeof (*g));
+	for (p = pat; *p != '\0'; ++p) {
+		if (*p == '?' || *p == '[' || (*p == '\\' && p[1] == '\0')) {
+			g->pat = pat;
+			return;
+		}
+		if (*p == '\\')
+			++p;
+	}
+
+	g->buf = t = arena_alloc (&scratch, strlen (pat) + 1);
+	g->segs = arena_alloc (&scratch, (strlen (pat) / 2 + 1) * sizeof (struct gseg));
+	g->lstar = *pat == '*';
+	for (p = pat; *p != '\0'; ) {
+		if (*p == '*') {
+			g->star = true;
+			g->rstar = true;
+			++p;
+			continue;
+		}
+
+		g->rstar = false;
+		g->segs[g->nsegs].s = t;
+		for (; *p != '\0' && *p != '*'; ++p) {
+			if (*p == '\\')
+				++p;
+			*t++ = *p;
+		}
+		g->segs[g->nsegs].len = t - g->segs[g->nsegs].s;
+		++g->nsegs;
+	}
+}
+
+/* find the first occurence of `seg` in the `n` bytes at `s` */
+const char *
+glob_find (s, n, seg)
+const char *s;
+size_t n;
+const struct gseg *seg;
+{
+	const char *end, *t;
+
+	if (seg->len > n)
+		return NULL;
+
+	end = s + n - seg->len + 1;
+	for (t = s; (t = memchr (t, seg->s[0], end - t)) != NULL; ++t) {
+		if (memcmp (t, seg->s, seg->len) == 0)
+			return t;
+	}
+	return NULL;
+}
+
+/* match the word `w` of length `n` against `g` */
+bool
+glob_match (g, w, n)
+const struct glob *g;
+const char *w;
+size_t n;
+{
+	const struct gseg *seg, *end;
+	const char *t;
+
+	if (g->pat != NULL)
+		return fnmatch (g->pat, w, 0) == 0;
+
+	seg = g->segs;
+	end = g->segs + g->nsegs;
+	if (!g->star)
+		return g->nsegs == 0 ? n == 0 : n == seg->len && memcmp (w, seg->s, n) == 0;
+
+	if (!g->lstar) {
+		if (n < seg->len || memcmp (w, seg->s, seg->len) != 0)
+			return false;
+		w += seg->len;
+		n -= seg->len;
+		++seg;
+	}
+
+	if (!g->rstar) {
+		--end;
+		if (n < end->len || memcmp (w + n - end->len, end->s, end->len) != 0)
+			return false;
+		n -= end->len;
+	}
+
+	for (; seg < end; ++seg) {
+		if ((t = glob_find (w, n, seg)) == NULL)
+			return false;
+		n -= t + seg->len - w;
+		w = t + seg->len;
+	}
+	return true;
+}
+
 char *
 ltrim (s)
 const char *s;
@@ -369,11 +753,121 @@ const char *s, *prefix;
 	return memcmp (s, prefix, len_p) == 0;
 }
 
+/* FNV-1a, 32 bits */
+#define FNV_INIT	2166136261UL
+#define FNV_PRIME	16777619UL
+
+unsigned long
+fnv_update (h, p, n)
+unsigned long h;
+const char *p;
+size_t n;
+{
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+		h = ((h ^ (unsigned char)p[i]) * FNV_PRIME) & 0xffffffffUL;
+
+	return h;
+}
+
+unsigned long
+strhash (s)
+const char *s;
+{
+	return fnv_update (FNV_INIT, s, strlen (s));
+}
+
+/*
+ * Names of files, subdirectories, path components and macros are
+ * interned: each distinct name is stored only once, and never freed, so
+ * that names found with intern_find() can be compared by pointer.  The
+ * table has no lock: only the main thread interns or looks up names.
+ */
+struct istr {
+	struct istr	*next;
+	unsigned long	 hash;
+};
+
+static struct istr **istr_tab = NULL;
+static size_t istr_cap = 0, istr_len = 0;
+
+#define istr_str(x) ((char *)((x) + 1))
+
+/* the hash of the interned string `s` */
+#define intern_hash(s) (((const struct istr *)(s) - 1)->hash)
+
+struct istr *
+istr_lookup (s, h)
+const char *s;
+unsigned long h;
+{
+	struct istr *x;
+
+	if (istr_tab == NULL)
+		return NULL;
+
+	for (x = istr_tab[h & (istr_cap - 1)]; x != NULL; x = x->next) {
+		if (x->hash == h && strcmp (istr_str (x), s) == 0)
+			return x;
+	}
+	return NULL;
+}
+
+/* the interned copy of `s`, or NULL if there is none */
+char *
+intern_find (s)
+const char *s;
+{
+	struct istr *x;
+
+	x = istr_lookup (s, strhash (s));
+	return x != NULL ? istr_str (x) : NULL;
+}
+
+/* the interned copy of `s`, which must neither be modified nor freed */
+char *
+intern (s)
+const char *s;
+{
+	struct istr *x, *next, **tab;
+	unsigned long h;
+	size_t i, len;
+
+	h = strhash (s);
+	x = istr_lookup (s, h);
+	if (x != NULL)
+		return istr_str (x);
+
+	if (istr_len >= istr_cap) {
+		i = istr_cap;
+		istr_cap = istr_cap ? istr_cap * 2 : 4096;
+		tab = newa (istr_cap, struct istr *);
+		while (i-- > 0) {
+			for (x = istr_tab[i]; x != NULL; x = next) {
+				next = x->next;
+				x->next = tab[x->hash & (istr_cap - 1)];
+				tab[x->hash & (istr_cap - 1)] = x;
+			}
+		}
+		free (istr_tab);
+		istr_tab = tab;
+	}
+
+	len = strlen (s);
+	x = (struct istr *)newa (sizeof (struct istr) + len + 1, char);
+	x->hash = h;
+	memcpy (istr_str (x), s, len + 1);
+	x->next = istr_tab[h & (istr_cap - 1)];
+	istr_tab[h & (istr_cap - 1)] = x;
+	++istr_len;
+	return istr_str (x);
+}
+
 /* PATH LOGIC */
 
 static const struct path path_null = { FIELD (type, PATH_NULL), FIELD (name, NULL) };
 static const struct path path_super = { FIELD (type, PATH_SUPER), FIELD (name, NULL) };
-static struct path tmppath = { FIELD (type, PATH_NAME), FIELD (name, NULL) };
 
 /* return the number of path components (excl. PATH_NULL). */
 size_t
@@ -387,49 +881,51 @@ const struct path *p;
 	return i;
 }
 
-struct path *
-path_cpy (old, old_len, new_len)
-const struct path *old;
-size_t old_len, new_len;
-{
-	struct path *p;
-
-	p = newa (new_len + 1, struct path);
-	memcpy (p, old, old_len * sizeof (struct path));
-	p[new_len].type = PATH_NULL;
-
-	return p;
-}
-
+/* `old` with `comp` added; both are interned, and so is the result */
 struct path *
 path_cat (old, comp)
 const struct path *old, *comp;
 {
-	struct path *p;
+	extern struct path *path_intern ();
+	struct path *p, *q;
 	size_t len;
 
 	len = path_len (old);
 
+	arena_enter (&scratch);
+	p = arena_alloc (&scratch, (len + 1) * sizeof (struct path));
+	memcpy (p, old, len * sizeof (struct path));
 	switch (comp->type) {
 	case PATH_NULL:
-		p = path_cpy (old, len, len);
 		break;
 	case PATH_SUPER:
 		if (len > 0 && old[len - 1].type != PATH_SUPER) {
 			--len;
-			p = path_cpy (old, len, len);
 			break;
 		}
 		/* fallthrough */
 	case PATH_NAME:
-		p = path_cpy (old, len, len + 1);
-		p[len] = *comp;
+		p[len++] = *comp;
 		break;
 	default:
 		abort ();
 	}
+	q = path_intern (p, len);
+	arena_leave (&scratch);
 
-	return p;
+	return q;
+}
+
+struct path *
+path_cat_name (dir, name)
+const struct path *dir;
+const char *name;
+{
+	struct path comp;
+
+	comp.type = PATH_NAME;
+	comp.name = intern (name);
+	return path_cat (dir, &comp);
 }
 
 void
@@ -461,71 +957,188 @@ const struct path *p;
 	str_pop (s);
 }
 
+/*
+ * Every interned path is preceded by the strings made from it, which are
+ * made the first time they are asked for.  A path that is only the tail
+ * of an interned one (like `path + 1`) has none.
+ */
+struct ipath {
+	char			*str;	/* see path_str() */
+	char			*base;	/* see path_basename() */
+};
+#define path_info(p) ((struct ipath *)(p) - 1)
+
+/* the string form of the interned path `p`; it must not be freed */
 const char *
-path_to_str (p)
+path_str (p)
 const struct path *p;
 {
-	str_reset (&tmpstr);
-	path_write (&tmpstr, p);
-	return str_get (&tmpstr);
+	struct ipath *ip = path_info (p);
+	str_t s;
+
+	if (ip->str == NULL) {
+		str_new (&s);
+		path_write (&s, p);
+		ip->str = str_release (&s);
+	}
+
+	return ip->str;
 }
 
-char *
+/*
+ * The name of the directory `p` refers to; it must not be freed.  In watch
+ * and daemon mode, a directory may be renamed or re-linked between builds,
+ * so the name is looked up again, and only valid until the next call.
+ */
+const char *
 path_basename (p)
 const struct path *p;
 {
-	char *s, *t;
+	struct ipath *ip = path_info (p);
+	char *s;
 
-	/* TODO: maybe allocate the buffer beforehand */
-	s = realpath (path_to_str (p), NULL);
-	t = strdup (basename (s));
+	if (ip->base != NULL) {
+		if (!watching)
+			return ip->base;
+		free (ip->base);
+	}
+
+	if ((s = realpath (path_str (p), NULL)) == NULL)
+		err (1, "realpath('%s')", path_str (p));
+	ip->base = strdup (basename (s));
 	free (s);
 
-	return t;
+	return ip->base;
 }
 
-const char *
-path_cat_str (dir, file)
+void
+path_join_into (out, dir, file)
+str_t *out;
+const struct path *dir;
+const char *file;
+{
+	str_puts (out, path_str (dir));
+	str_putc (out, '/');
+	str_puts (out, file);
+}
+
+char *
+path_join (dir, file)
 const struct path *dir;
 const char *file;
 {
-	str_reset (&tmpstr);
-	path_write (&tmpstr, dir);
-	str_putc (&tmpstr, '/');
-	str_puts (&tmpstr, file);
-	return str_get (&tmpstr);
+	str_t s;
+
+	str_new (&s);
+	path_join_into (&s, dir, file);
+	return str_release (&s);
+}
+
+/*
+ * Paths are interned, like names: there is one copy of every path, in
+ * `path_pool`, and many deps and scopes point to it.  They must not be
+ * modified, or freed.  Like the names, they are only interned on the main
+ * thread, so `ptab` has no lock.
+ */
+static struct path **ptab;
+static size_t pcap, npaths;
+
+unsigned long
+path_hash (p, n)
+const struct path *p;
+size_t n;
+{
+	unsigned long h = FNV_INIT;
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+		h = ((h ^ (p[i].type == PATH_NAME ? intern_hash (p[i].name) : 0x2e2e)) * FNV_PRIME) & 0xffffffffUL;
+	return h;
+}
+
+/* the interned copy of the `n` components at `p` */
+struct path *
+path_intern (p, n)
+const struct path *p;
+size_t n;
+{
+	struct path **tab, *q;
+	struct ipath *ip;
+	size_t i, j, cap;
+
+	/* keep the table at most half full */
+	if ((npaths + 1) * 2 > pcap) {
+		cap = pcap ? pcap * 2 : 256;
+		tab = newa (cap, struct path *);
+		for (i = 0; i < pcap; ++i) {
+			if (ptab[i] == NULL)
+				continue;
+			j = path_hash (ptab[i], path_len (ptab[i])) & (cap - 1);
+			while (tab[j] != NULL)
+				j = (j + 1) & (cap - 1);
+			tab[j] = ptab[i];
+		}
+		free (ptab);
+		ptab = tab;
+		pcap = cap;
+	}
+
+	i = path_hash (p, n) & (pcap - 1);
+	for (; (q = ptab[i]) != NULL; i = (i + 1) & (pcap - 1)) {
+		for (j = 0; j < n && q[j].type == p[j].type; ++j) {
+			if (p[j].type == PATH_NAME && q[j].name != p[j].name)
+				break;
+		}
+		if (j == n && q[n].type == PATH_NULL)
+			return q;
+	}
+
+	ip = arena_zalloc (&path_pool, sizeof (struct ipath) + (n + 1) * sizeof (struct path));
+	q = (struct path *)(ip + 1);
+	memcpy (q, p, n * sizeof (struct path));
+	q[n].type = PATH_NULL;
+	ptab[i] = q;
+	++npaths;
+	return q;
 }
 
 struct path *
 parse_path (s)
 char *s;
 {
-	size_t len = 0, cap = 4;
-	struct path *p;
+	size_t len = 0, cap = 1;
+	struct path *p, *q;
 	const char *t;
 
-	p = newa (cap + 1, struct path);
+	for (t = s; (t = strchr (t, '/')) != NULL; ++t)
+		++cap;
 
+	arena_enter (&scratch);
+	p = arena_alloc (&scratch, cap * sizeof (struct path));
 	while ((t = strsep (&s, "/")) != NULL) {
 		if (*t == '\0' || strcmp (t, ".") == 0)
 			continue;
 
-		if (len == cap) {
-			cap *= 2;
-			p = renew (p, cap + 1, struct path);
-		}
-
 		if (strcmp (t, "..") == 0) {
 			p[len].type = PATH_SUPER;
+			p[len].name = NULL;
 		} else {
 			p[len].type = PATH_NAME;
-			p[len].name = strdup (t);
+			p[len].name = intern (t);
 		}
 		++len;
 	}
-	p[len].type = PATH_NULL;
+	q = path_intern (p, len);
+	arena_leave (&scratch);
 
-	return p;
+	return q;
+}
+
+/* the interned empty path, "." */
+struct path *
+path_dot ()
+{
+	return path_intern (&path_null, (size_t)0);
 }
 
 void
@@ -543,13 +1156,15 @@ const struct scope *sc;
 	str_puts (out, sc->name);
 }
 
-const char *
-sc_path_str (sc)
+char *
+sc_path (sc)
 const struct scope *sc;
 {
-	str_reset (&tmpstr);
-	sc_path_into (&tmpstr, sc);
-	return str_get (&tmpstr);
+	str_t s;
+
+	str_new (&s);
+	sc_path_into (&s, sc);
+	return str_release (&s);
 }
 
 void
@@ -575,57 +1190,49 @@ struct filetime {
 
 #if HAVE_STAT_MTIM
 # define stat_get_mtime(mt, st) mt = st.st_mtim
+#elif HAVE_STAT_MTIMESPEC
+# define stat_get_mtime(mt, st) mt = st.st_mtimespec
 #else
 # define stat_get_mtime(mt, st) mt.tv_sec = st.st_mtime, mt.tv_nsec = 0
 #endif
 
+/*
+ * Get the mtime of `path`, with nanoseconds where the system has them.
+ * If `follow` is false, the mtime of a symlink itself is returned.
+ */
 int
-get_mtime (out, sc, dir, name)
-struct filetime *out;
-const struct scope *sc;
-const struct path *dir;
-const char *name;
+mk_stat (path, follow, t)
+const char *path;
+bool follow;
+struct timespec *t;
 {
 	struct stat st;
-	const char *path;
-
-	if (verbose >= 2)
-		printf ("get_mtime('%s'): ", name);
-
-	path = path_cat_str (dir, name);
-
-	if (lstat (path, &st) == 0) {
-		stat_get_mtime (out->t, st);
-		out->obj = false;
-		if (verbose >= 2)
-			printf ("found\n");
-		return 0;
-	}
-
-	if (objdir == NULL)
-		goto enoent;
+	int ec;
+#if HAVE_STATX
+	static bool no_statx = false;
+	struct statx stx;
+
+	if (!no_statx) {
+		ec = statx (AT_FDCWD, path, follow ? 0 : AT_SYMLINK_NOFOLLOW, STATX_MTIME | STATX_TYPE, &stx);
+		if (ec == 0 && (stx.stx_mask & STATX_MTIME)) {
+			t->tv_sec = stx.stx_mtime.tv_sec;
+			t->tv_nsec = stx.stx_mtime.tv_nsec;
+			return 0;
+		}
 
-	str_reset (&tmpstr);
-	write_objdir (&tmpstr, sc);
-	str_putc (&tmpstr, '/');
-	str_puts (&tmpstr, name);
-	path = str_get (&tmpstr);
+		if (ec != 0 && errno != ENOSYS && errno != EPERM)
+			return ec;
 
-	if (lstat (path, &st) == 0) {
-		stat_get_mtime (out->t, st);
-		out->obj = true;
-		if (verbose >= 2)
-			printf ("found in obj\n");
-		return 0;
+		/* an old kernel, a seccomp filter, or a filesystem without mtimes */
+		if (ec != 0)
+			no_statx = true;
 	}
+#endif
 
-enoent:
-	out->t = time_zero;
-	out->obj = false;
-	if (verbose >= 2)
-		printf ("not found\n");
-	return -1;
-
+	ec = follow ? stat (path, &st) : lstat (path, &st);
+	if (ec == 0)
+		stat_get_mtime (*t, st);
+	return ec;
 }
 
 struct timespec
@@ -672,6 +1279,19 @@ const struct timespec *a, *b;
 	return 0;
 }
 
+/* whether `a` and `b` describe the same, unchanged file */
+bool
+same_file (a, b)
+const struct stat *a, *b;
+{
+	struct timespec t1, t2;
+
+	stat_get_mtime (t1, (*a));
+	stat_get_mtime (t2, (*b));
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino
+	    && a->st_size == b->st_size && tv_cmp (&t1, &t2) == 0;
+}
+
 struct timespec
 tv_sub (a, b)
 const struct timespec *a, *b;
@@ -708,6 +1328,26 @@ struct scope *sc;
 }
 #endif
 
+/* return the attributes given to `name` in the directory of `sc` */
+int
+name_attrs (sc, name)
+const struct scope *sc;
+const char *name;
+{
+	struct attr *a;
+	int flags = 0;
+
+	if (sc->type != SC_DIR)
+		return 0;
+
+	SLIST_FOREACH (a, &sc_dir ((struct scope *)sc)->attrs, next) {
+		if (strcmp (a->name, name) == 0)
+			flags |= a->flags;
+	}
+
+	return flags;
+}
+
 /* MKDIR */
 
 void
@@ -750,3071 +1390,7971 @@ void
 sc_mkdir_p (sc)
 const struct scope *sc;
 {
+	str_t path;
+
 	if (objdir == NULL)
 		return;
 
-	str_reset (&tmpstr);
-	str_puts (&tmpstr, objdir);
-	str_putc (&tmpstr, '/');
-	sc_path_into (&tmpstr, sc);
+	str_new (&path);
+	str_puts (&path, objdir);
+	str_putc (&path, '/');
+	sc_path_into (&path, sc);
 
-	mkdir_p (str_get (&tmpstr));
+	mkdir_p (str_get (&path));
+	str_free (&path);
 }
 
-/* MACORS MISC */
-
-/* is macro name */
-bool
-ismname (ch)
-int ch;
-{
-	return isalnum (ch) || ch == '_' || ch == '.';
-}
-
-/* SEARCHING */
+/* BUILD STATE */
 
-struct macro *
-find_emacro (sc, name)
-struct scope *sc;
-const char *name;
-{
-	struct macro *m;
+/*
+ * The build state is a small binary database that persists facts about
+ * targets between runs.  It lives in `.mkstate` at the top of the tree (or
+ * in the objdir, if one is used), is loaded on first use and only written
+ * back if anything changed.
+ *
+ * All integers are stored as little-endian 32-bit words, so the file can be
+ * moved between hosts of different byte order and word size.
+ */
 
-	if (sc == NULL)
-		return NULL;
+#define STATE_MAGIC	"MKST"
+#define STATE_VERSION	2
+#define STATE_NBUCKETS	1024
 
-	SLIST_FOREACH (m, &sc_dir (sc)->emacros, enext) {
-		if (strcmp (m->name, name) == 0)
-			return m;
-	}
+#define SE_RESTAT	0x01
+#define SE_DEPFILE	0x02
 
-	return find_emacro (sc->parent, name);
-}
+static struct sentry *state_tab[STATE_NBUCKETS];
+static bool state_loaded = false, state_dirty = false;
 
-struct macro *
-find_macro (sc, name)
-struct scope *sc;
-const char *name;
+/* hash the contents of a file, mapping it into memory if possible */
+int
+hash_file (path, hash, size)
+const char *path;
+unsigned long *hash, *size;
 {
-	struct macro *m;
+	struct stat st;
+	unsigned long h = FNV_INIT, n = 0;
+	char buf[8192];
+	ssize_t len;
+	int fd;
+#if HAVE_MMAP && HAVE_SYS_MMAN_H
+	void_t *p;
+#endif
 
-	SLIST_FOREACH (m, &sc_dir (sc)->macros, next) {
-		if (strcmp (m->name, name) == 0)
-			return m;
+	fd = open (path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+#if HAVE_MMAP && HAVE_SYS_MMAN_H
+	if (fstat (fd, &st) == 0 && (st.st_mode & S_IFMT) == S_IFREG && st.st_size > 0) {
+		p = mmap (NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED) {
+			*hash = fnv_update (h, (const char *)p, (size_t)st.st_size);
+			*size = (unsigned long)st.st_size;
+			munmap (p, (size_t)st.st_size);
+			close (fd);
+			return 0;
+		}
 	}
+#endif
 
-	m = find_emacro (sc->parent, name);
-	if (m != NULL)
-		return m;
-
-	for (m = globals; m != NULL; m = SLIST_NEXT (m, next)) {
-		if (strcmp (m->name, name) == 0)
-			return m;
+	while ((len = read (fd, buf, sizeof (buf))) > 0) {
+		h = fnv_update (h, buf, (size_t)len);
+		n += len;
 	}
+	close (fd);
 
-	return NULL;
+	if (len < 0)
+		return -1;
+
+	*hash = h;
+	*size = n;
+	return 0;
 }
 
-struct template *
-find_template (sc, name)
-struct scope *sc;
-const char *name;
+/* read everything that is left in `fd` into memory */
+char *
+read_fd (fd, len)
+int fd;
+size_t *len;
 {
-	struct template *tm;
-
-	SLIST_FOREACH (tm, &sc_dir (sc)->templates, next) {
-		if (strcmp (tm->name, name) == 0)
-			return tm;
+	str_t buf;
+	ssize_t n;
+
+	str_new (&buf);
+	do {
+		str_reserve (&buf, 8192);
+		n = read (fd, buf.ptr + buf.len, buf.cap - buf.len);
+		if (n > 0)
+			buf.len += n;
+	} while (n > 0);
+
+	if (n < 0) {
+		str_free (&buf);
+		return NULL;
 	}
 
-	return sc->parent != NULL ? find_template (sc->parent, name) : NULL;
+	*len = buf.len;
+	return str_release (&buf);
 }
 
-struct file *
-find_file (dir, name)
-struct directory *dir;
-const char *name;
+/* read an entire file into memory */
+char *
+read_file (path, len)
+const char *path;
+size_t *len;
 {
-	struct file *f;
+	char *buf;
+	int fd;
 
-	/*
-	 * Walk backwards (tail-to-head) so that the most recently added
-	 * definition of a target wins, matching the old behaviour.
-	 * TAILQ_FOREACH_REVERSE requires the head type name.
-	 */
-	TAILQ_FOREACH_REVERSE (f, &dir->files, file_list, link) {
-		if (strcmp (name, f->name) == 0)
-			return f;
-	}
+	fd = open (path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
 
-	return NULL;
+	buf = read_fd (fd, len);
+	close (fd);
+	return buf;
 }
 
-struct scope *
-find_subdir (sc, name)
-struct scope *sc;
-const char *name;
+void
+put_u32 (file, x)
+FILE *file;
+unsigned long x;
 {
-	struct scope *sub;
+	putc ((int)(x & 0xff), file);
+	putc ((int)((x >> 8) & 0xff), file);
+	putc ((int)((x >> 16) & 0xff), file);
+	putc ((int)((x >> 24) & 0xff), file);
+}
 
-	SLIST_FOREACH (sub, &sc_dir (sc)->subdirs, next) {
-		if (strcmp (sub->name, name) == 0)
-			return sub;
-	}
-	return NULL;
+void
+put_str (file, s)
+FILE *file;
+const char *s;
+{
+	size_t len;
+
+	len = strlen (s);
+	put_u32 (file, (unsigned long)len);
+	fwrite (s, 1, len, file);
 }
 
-/* MACRO EXPANSION */
+void
+put_time (file, t)
+FILE *file;
+const struct timespec *t;
+{
+	put_u32 (file, (unsigned long)t->tv_sec & 0xffffffffUL);
+	put_u32 (file, t->tv_sec > 0 ? (unsigned long)((t->tv_sec >> 16) >> 16) & 0xffffffffUL : 0);
+	put_u32 (file, (unsigned long)t->tv_nsec);
+}
 
-#define MAX_EXPAND_DEPTH 64
-struct expand_ctx {
-	char		*target;
-	struct scope	*scope;
-	struct dep	*deps;
-	struct dep	*infdeps;
-	int		 free_target;
-	int		 depth;
+/* a cursor into a loaded state file */
+struct sbuf {
+	const unsigned char	*p, *end;
 };
 
-static struct expand_ctx ctx_null = {
-	FIELD (target, NULL),
-	FIELD (sc, NULL),
-	FIELD (deps, NULL),
-	FIELD (infdeps, NULL),
-	FIELD (free_target, 0),
-	FIELD (depth, 0),
-};
+int
+sb_u32 (b, x)
+struct sbuf *b;
+unsigned long *x;
+{
+	if (b->end - b->p < 4)
+		return -1;
+
+	*x = (unsigned long)b->p[0]
+		| ((unsigned long)b->p[1] << 8)
+		| ((unsigned long)b->p[2] << 16)
+		| ((unsigned long)b->p[3] << 24);
+	b->p += 4;
+	return 0;
+}
 
-void
-ectx_init (ctx, sc, target, deps, infdeps)
-struct expand_ctx	*ctx;
-struct scope		*sc;
-char			*target;
-struct dep		*deps, *infdeps;
+char *
+sb_str (b)
+struct sbuf *b;
 {
-	ctx->target = target;
-	ctx->scope = sc;
-	ctx->deps = deps;
-	ctx->infdeps = infdeps;
-	ctx->free_target = 0;
-	ctx->depth = 0;
+	unsigned long len;
+	char *s;
+
+	if (sb_u32 (b, &len) != 0 || (unsigned long)(b->end - b->p) < len)
+		return NULL;
+
+	s = newa (len + 1, char);
+	memcpy (s, b->p, len);
+	s[len] = '\0';
+	b->p += len;
+	return s;
 }
 
-struct expand_ctx *
-ectx_null ()
+int
+sb_time (b, t)
+struct sbuf *b;
+struct timespec *t;
 {
-	ctx_null.depth = 0;
-	return &ctx_null;
+	unsigned long lo, hi, ns;
+
+	if (sb_u32 (b, &lo) != 0 || sb_u32 (b, &hi) != 0 || sb_u32 (b, &ns) != 0)
+		return -1;
+
+	t->tv_sec = (time_t)lo;
+	if (hi != 0)
+		t->tv_sec |= ((time_t)hi << 16) << 16;
+	t->tv_nsec = (long)ns;
+	return 0;
 }
 
-void
-ectx_file (ctx, sc, f)
-struct expand_ctx *ctx;
-struct scope *sc;
-struct file *f;
+/*
+ * Strings referenced by state records (eg. the deps read from a depfile)
+ * are interned, so that each distinct name is stored once, both in memory
+ * and in the string table of the state file.
+ */
+struct sstr {
+	struct sstr	*next;
+	char		*s;
+	long		 idx;	/* index in the string table, while saving */
+};
+
+static struct sstr *sstr_tab[STATE_NBUCKETS];
+
+struct sstr *
+state_intern (s)
+const char *s;
 {
-	str_t tmp;
+	struct sstr *x;
+	unsigned long h;
 
-	if (objdir != NULL) {
-		str_new (&tmp);
-		write_objdir (&tmp, sc);
-		str_putc (&tmp, '/');
-		str_puts (&tmp, f->name);
-		ctx->target = str_release (&tmp);
-		ctx->free_target = 1;
-	} else {
-		ctx->target = f->name;
-		ctx->free_target = 0;
+	h = strhash (s) % STATE_NBUCKETS;
+	for (x = sstr_tab[h]; x != NULL; x = x->next) {
+		if (strcmp (x->s, s) == 0)
+			return x;
 	}
 
-	ctx->scope = sc;
-	ctx->deps  = TAILQ_FIRST (&f->deps);
-	ctx->infdeps = f->inf != NULL ? TAILQ_FIRST (&f->inf->deps) : NULL;
-	ctx->depth = 0;
+	x = new (struct sstr);
+	x->s = strdup (s);
+	x->idx = -1;
+	x->next = sstr_tab[h];
+	sstr_tab[h] = x;
+	return x;
 }
 
-void
-ectx_free (ctx)
-struct expand_ctx *ctx;
+struct sentry *
+state_insert (key)
+char *key;
 {
-	if (ctx->free_target)
-		free (ctx->target);
+	struct sentry *e;
+	unsigned long h;
+
+	h = strhash (key) % STATE_NBUCKETS;
+	e = new (struct sentry);
+	e->key = key;
+	e->restat = false;
+	e->depfile = false;
+	e->deps = NULL;
+	e->ndeps = 0;
+	e->next = state_tab[h];
+	state_tab[h] = e;
+	return e;
 }
 
 void
-replace_into (out, s, old, new_str)
-str_t *out;
-const char *s, *old, *new_str;
+state_load ()
 {
-	size_t len_s, len_old;
-
-	len_s = strlen (s);
-	len_old = strlen (old);
+	struct sentry *e;
+	struct sstr **strs = NULL;
+	struct sbuf b;
+	unsigned long version, nstrs = 0, n, i, j, flags, x;
+	size_t len;
+	char *data, *str;
 
-	if (len_s < len_old || memcmp (s + len_s - len_old, old, len_old) != 0) {
-		str_puts (out, s);
+	state_loaded = true;
+	if (state_path == NULL || (data = read_file (state_path, &len)) == NULL)
 		return;
-	}
 
-	str_write (out, s, len_s - len_old);
-	str_puts (out, new_str);
-}
+	b.p = (const unsigned char *)data;
+	b.end = b.p + len;
+
+	if (len < 4 || memcmp (data, STATE_MAGIC, 4) != 0)
+		goto bad;
+	b.p += 4;
+
+	if (sb_u32 (&b, &version) != 0 || version != STATE_VERSION)
+		goto bad;
+
+	/* string table */
+	if (sb_u32 (&b, &nstrs) != 0 || nstrs > len)
+		goto bad;
+	strs = newa (nstrs + 1, struct sstr *);
+	for (i = 0; i < nstrs; ++i) {
+		if ((str = sb_str (&b)) == NULL)
+			goto bad;
+		strs[i] = state_intern (str);
+		free (str);
+	}
 
-void
-replace_all_into (out, s, old, new_str)
-str_t *out;
-char *s;
-const char *old, *new_str;
-{
-	char *t;
-	int x = 0;
+	/* records */
+	if (sb_u32 (&b, &n) != 0)
+		goto bad;
 
-	while ((t = strsep (&s, " \t")) != NULL) {
-		if (*t == '\0')
-			continue;
+	for (i = 0; i < n; ++i) {
+		if ((str = sb_str (&b)) == NULL || sb_u32 (&b, &flags) != 0)
+			goto bad;
+
+		e = state_insert (str);
+		if (flags & SE_RESTAT) {
+			if (sb_u32 (&b, &e->hash) != 0 || sb_u32 (&b, &e->size) != 0
+			    || sb_time (&b, &e->mt) != 0 || sb_time (&b, &e->lt) != 0)
+				goto bad;
+			e->restat = true;
+		}
 
-		replace_into (out, t, old, new_str);
-		str_putc (out, ' ');
-		x = 1;
+		if (flags & SE_DEPFILE) {
+			if (sb_u32 (&b, &x) != 0 || x > len / 4)
+				goto bad;
+			e->depfile = true;
+			e->ndeps = x;
+			e->deps = newa (x + 1, char *);
+			for (j = 0; j < e->ndeps; ++j) {
+				if (sb_u32 (&b, &x) != 0 || x >= nstrs)
+					goto bad;
+				e->deps[j] = strs[x]->s;
+			}
+		}
 	}
 
-	if (x)
-		str_pop (out);
+	free (strs);
+	free (data);
+	return;
+
+bad:
+	/* the state is only a cache, so just start over */
+	warnx ("%s: ignoring corrupt build state", state_path);
+	memset (state_tab, 0, sizeof (state_tab));
+	free (strs);
+	free (data);
 }
 
 void
-pr_export (out, sc, prefix, m, ctx)
-str_t *out;
-const struct scope *sc;
-const struct path *prefix;
-const struct macro *m;
-struct expand_ctx *ctx;
+state_save ()
 {
-	extern void expand_macro_into ();
+	struct sentry *e;
+	struct sstr *x;
+	unsigned long n;
+	FILE *file;
+	str_t tmp;
+	size_t i, j;
 
-	str_puts (out, m->name);
-	str_puts (out, "='");
-	expand_macro_into (out, sc, prefix, m, m->name, ctx);
-	str_putc (out, '\'');
-}
+	if (!state_dirty || state_path == NULL)
+		return;
 
-void
-dep_write (out, sc, dep)
-str_t *out;
-const struct scope *sc;
-const struct dep *dep;
-{
-	if (dep->obj && objdir != NULL) {
-		write_objdir (out, sc);
-		str_putc (out, '/');
+	str_new (&tmp);
+	str_puts (&tmp, state_path);
+	str_puts (&tmp, ".tmp");
+
+	file = fopen (str_get (&tmp), "wb");
+	if (file == NULL) {
+		warn ("fopen('%s')", str_get (&tmp));
+		str_free (&tmp);
+		return;
 	}
-	path_write (out, dep->path);
-}
 
-void
-expand_special_into (out, sc, prefix, name, ctx)
-str_t *out;
-struct scope *sc;
-const struct path *prefix;
-const char *name;
-struct expand_ctx *ctx;
-{
-	struct scope *sub;
-	struct macro *m;
-	struct dep *dep;
-	int i, j;
+	fwrite (STATE_MAGIC, 1, 4, file);
+	put_u32 (file, (unsigned long)STATE_VERSION);
 
-	/* TODO: .SUBDIRS, .EXPORTS */
-	assert (ctx != NULL);
+	/* only write the strings that are still referenced */
+	for (i = 0; i < STATE_NBUCKETS; ++i) {
+		for (x = sstr_tab[i]; x != NULL; x = x->next)
+			x->idx = -1;
+	}
 
-	if (strcmp (name, ".SUBDIRS") == 0) {
-		if (sc->type != SC_DIR) {
-		invsc:
-			errx (1, "%s: invalid scope type", sc_path_str (sc));
+	for (i = 0; i < STATE_NBUCKETS; ++i) {
+		for (e = state_tab[i]; e != NULL; e = e->next) {
+			for (j = 0; e->depfile && j < e->ndeps; ++j)
+				state_intern (e->deps[j])->idx = 0;
 		}
+	}
 
-		sub = SLIST_FIRST (&sc_dir (sc)->subdirs);
-		if (sub == NULL)
-			return;
-
-		str_puts (out, sub->name);
-		for (sub = SLIST_NEXT (sub, next); sub != NULL; sub = SLIST_NEXT (sub, next)) {
-			str_putc (out, ' ');
-			str_puts (out, sub->name);
+	n = 0;
+	for (i = 0; i < STATE_NBUCKETS; ++i) {
+		for (x = sstr_tab[i]; x != NULL; x = x->next) {
+			if (x->idx >= 0)
+				x->idx = (long)n++;
 		}
-	} else if (strcmp (name, ".EXPORTS") == 0) {
-		if (sc->type != SC_DIR)
-			goto invsc;
-
-		m = SLIST_FIRST (&sc_dir (sc)->emacros);
-		if (m == NULL)
-			return;
+	}
 
-		pr_export (out, sc, prefix, m, ctx);
-		for (m = SLIST_NEXT (m, enext); m != NULL; m = SLIST_NEXT (m, enext)) {
-			str_putc (out, ' ');
-			pr_export (out, sc, prefix, m, ctx);
+	put_u32 (file, n);
+	for (i = 0; i < STATE_NBUCKETS; ++i) {
+		for (x = sstr_tab[i]; x != NULL; x = x->next) {
+			if (x->idx >= 0)
+				put_str (file, x->s);
 		}
+	}
 
-	} else if (strcmp (name, ".OBJDIR") == 0) {
-		write_objdir (out, sc);
-	} else if (strcmp (name, ".TARGET") == 0) {
-		if (ctx->target == NULL)
-			errx (1, "%s: cannot use $@ or ${.TARGET} here", sc_path_str (sc));
-		str_puts (out, ctx->target);
-	} else if (strcmp (name, ".SCOPE") == 0) {
-		sc_path_into (out, ctx->scope);
-	} else if (strcmp (name, ".IMPSRC") == 0) {
-		/*if (ctx->dep0 == NULL)
-			errx (1, "%s: cannot use $< or ${.IMPSRC} here", sc_path_str (sc));*/
-
-		dep = ctx->deps;
-		if (dep == NULL)
-			dep = ctx->infdeps;
+	n = 0;
+	for (i = 0; i < STATE_NBUCKETS; ++i) {
+		for (e = state_tab[i]; e != NULL; e = e->next)
+			++n;
+	}
+	put_u32 (file, n);
+
+	for (i = 0; i < STATE_NBUCKETS; ++i) {
+		for (e = state_tab[i]; e != NULL; e = e->next) {
+			put_str (file, e->key);
+			put_u32 (file, (e->restat ? SE_RESTAT : 0) | (e->depfile ? SE_DEPFILE : 0));
+			if (e->restat) {
+				put_u32 (file, e->hash);
+				put_u32 (file, e->size);
+				put_time (file, &e->mt);
+				put_time (file, &e->lt);
+			}
+			if (e->depfile) {
+				put_u32 (file, (unsigned long)e->ndeps);
+				for (j = 0; j < e->ndeps; ++j)
+					put_u32 (file, (unsigned long)state_intern (e->deps[j])->idx);
+			}
+		}
+	}
 
-		if (dep == NULL)
-			return;
+	if (ferror (file) | fclose (file)) {
+		warnx ("%s: failed to write build state", str_get (&tmp));
+	} else if (rename (str_get (&tmp), state_path) != 0) {
+		warn ("rename('%s')", state_path);
+	}
 
-		dep_write (out, sc, dep);
-	} else if (strcmp (name, ".ALLSRC") == 0) {
-		if (ctx->target == NULL)
-			errx (1, "%s: cannot use $^ or ${.ALLSRC} here", sc_path_str (sc));
+	str_free (&tmp);
+	state_dirty = false;
+}
 
-		for (dep = ctx->deps; dep != NULL; dep = TAILQ_NEXT (dep, link)) {
-			str_putc (out, ' ');
-			dep_write (out, sc, dep);
-		}
-		for (dep = ctx->infdeps; dep != NULL; dep = TAILQ_NEXT (dep, link)) {
-			str_putc (out, ' ');
-			dep_write (out, sc, dep);
-		}
-	} else if (strcmp (name, ".TOPDIR") == 0) {
-		str_putc (out, '.');
-		for (sub = sc->parent; sub != NULL; sub = sub->parent)
-			str_puts (out, "/..");
-	} else if (strcmp (name, ".MAKEFILES") == 0) {
-		for (i = 0, sub = sc; sub != NULL; ++i, sub = sub->parent) {
-			for (j = 0; j < i; ++j)
-				str_puts (out, "../");
-			str_puts (out, sub->makefile);
-			str_putc (out, ' ');
+/* find the state record of `name` in `sc`, optionally creating it */
+struct sentry *
+state_find (sc, name, create)
+const struct scope *sc;
+const char *name;
+bool create;
+{
+	struct sentry *e;
+	str_t key;
+	unsigned long h;
+
+	if (!state_loaded)
+		state_load ();
+
+	str_new (&key);
+	sc_path_into (&key, sc);
+	str_putc (&key, '/');
+	str_puts (&key, name);
+
+	h = strhash (str_get (&key)) % STATE_NBUCKETS;
+	for (e = state_tab[h]; e != NULL; e = e->next) {
+		if (strcmp (e->key, str_get (&key)) == 0) {
+			str_free (&key);
+			return e;
 		}
-		str_pop (out);
 	}
+
+	if (!create) {
+		str_free (&key);
+		return NULL;
+	}
+
+	state_dirty = true;
+	return state_insert (str_release (&key));
 }
 
-/* per-word modifier helpers for subst2() */
+/* STAT CACHE */
 
-struct sw_F_arg {
-	struct scope *sc;
-	const struct path *prefix;
+/*
+ * A cache of stat() results.  In a normal run, only the deps read from
+ * depfiles go through it, since the same headers come up a lot.  In watch
+ * mode, every stat() does, and it doubles as the list of watched files.
+ */
+struct scache {
+	struct scache	*next;
+	char		*path;
+	const char	*base;		/* basename of path */
+	struct wdir	*wdir;		/* watched directory (optional) */
+	struct timespec	 t;
+	int		 rc;
+	bool		 follow;
+	bool		 mkfile;	/* a makefile, re-exec when it changes */
 };
 
-/* :F - prefix each word with ${.OBJDIR}/<scope>/ when it lives in objdir */
-int
-sw_F (dst, w, arg)
-	str_t *dst;
-	char *w;
-	void_t *arg;
+static struct scache *scache_tab[STATE_NBUCKETS];
+static bool stat_refresh = false, serve_mode = false;
+
+struct scache *
+scache_get (path, follow)
+const char *path;
+bool follow;
 {
-	struct sw_F_arg *a;
-	struct filetime ft;
+	struct scache *c;
+	unsigned long h;
+	const char *s;
 
-	a = (struct sw_F_arg *)arg;
-	if (get_mtime (&ft, a->sc, a->prefix, w) == 0 && ft.obj) {
-		write_objdir (dst, a->sc);
-		str_putc (dst, '/');
+	h = strhash (path) % STATE_NBUCKETS;
+	for (c = scache_tab[h]; c != NULL; c = c->next) {
+		if (c->follow == follow && strcmp (c->path, path) == 0) {
+			if (stat_refresh)
+				goto update;
+			return c;
+		}
 	}
-	str_puts (dst, w);
-	return 1;
+
+	c = new (struct scache);
+	c->path = strdup (path);
+	s = strrchr (c->path, '/');
+	c->base = s != NULL ? s + 1 : c->path;
+	c->wdir = NULL;
+	c->follow = follow;
+	c->mkfile = false;
+	c->next = scache_tab[h];
+	scache_tab[h] = c;
+
+update:
+	c->rc = mk_stat (path, follow, &c->t);
+	if (c->rc != 0)
+		c->t = time_zero;
+	return c;
 }
 
-/* :E - keep the suffix, drop the rest */
 int
-sw_E (dst, w, arg)
-	str_t *dst;
-	char *w;
-	void_t *arg;
+cached_mtime (path, follow, t)
+const char *path;
+bool follow;
+struct timespec *t;
 {
-	char *u;
+	struct scache *c;
 
-	(void) arg;
-	u = strrchr (w, '.');
-	if (u == NULL || strchr (u, '/') != NULL)
-		return 0;
-	str_puts (dst, u);
-	return 1;
+	c = scache_get (path, follow);
+	*t = c->t;
+	return c->rc;
 }
 
-/* :R - drop the suffix */
+/* stat `path`, through the cache in watch mode */
 int
-sw_R (dst, w, arg)
-	str_t *dst;
-	char *w;
-	void_t *arg;
+stat_mtime (path, follow, t)
+const char *path;
+bool follow;
+struct timespec *t;
 {
-	char *u;
-
-	(void) arg;
-	u = strrchr (w, '.');
-	if (u != NULL && strchr (u, '/') == NULL)
-		*u = '\0';
-	str_puts (dst, w);
-	return 1;
+	return watching ? cached_mtime (path, follow, t) : mk_stat (path, follow, t);
 }
 
-/* :H - dirname() */
-int
-sw_H (dst, w, arg)
-	str_t *dst;
-	char *w;
-	void_t *arg;
+/* remember a makefile that was read, so that watch mode can notice changes */
+void
+stat_mkfile (path)
+const char *path;
 {
-	(void) arg;
-	str_puts (dst, dirname (w));
-	return 1;
+	if (!watching)
+		return;
+	scache_get (path, true)->mkfile = true;
 }
 
-/* :T - basename() */
 int
-sw_T (dst, w, arg)
-	str_t *dst;
-	char *w;
-	void_t *arg;
+get_mtime (out, sc, dir, name)
+struct filetime *out;
+const struct scope *sc;
+const struct path *dir;
+const char *name;
 {
-	(void) arg;
-	str_puts (dst, basename (w));
-	return 1;
+	bool follow;
+	str_t path;
+
+	if (verbose >= 2)
+		printf ("get_mtime('%s'): ", name);
+
+	follow = (name_attrs (sc, name) & ATTR_NOFOLLOW) == 0;
+	arena_enter (&scratch);
+	str_scratch (&path);
+	path_join_into (&path, dir, name);
+
+	if (stat_mtime (str_get (&path), follow, &out->t) == 0) {
+		out->obj = false;
+		if (verbose >= 2)
+			printf ("found\n");
+		arena_leave (&scratch);
+		return 0;
+	}
+
+	if (objdir == NULL)
+		goto enoent;
+
+	str_reset (&path);
+	write_objdir (&path, sc);
+	str_putc (&path, '/');
+	str_puts (&path, name);
+
+	if (stat_mtime (str_get (&path), follow, &out->t) == 0) {
+		out->obj = true;
+		if (verbose >= 2)
+			printf ("found in obj\n");
+		arena_leave (&scratch);
+		return 0;
+	}
+
+enoent:
+	out->t = time_zero;
+	out->obj = false;
+	if (verbose >= 2)
+		printf ("not found\n");
+	arena_leave (&scratch);
+	return -1;
+
 }
 
-/* :M - keep words matching the fnmatch() pattern in `arg` */
-int
-sw_M (dst, w, arg)
-	str_t *dst;
-	char *w;
-	void_t *arg;
+/* MACORS MISC */
+
+/* is macro name */
+bool
+ismname (ch)
+int ch;
 {
-	if (fnmatch ((char *)arg, w, 0) != 0)
-		return 0;
-	str_puts (dst, w);
-	return 1;
+	return isalnum (ch) || ch == '_' || ch == '.';
 }
 
-/* :N - drop words matching the fnmatch() pattern in `arg` */
-int
-sw_N (dst, w, arg)
-	str_t *dst;
-	char *w;
-	void_t *arg;
+/* SEARCHING */
+
+/* the slot of the interned `name` in `t`, or NULL */
+struct mslot *
+mt_get (t, name)
+const struct mtab *t;
+const char *name;
 {
-	if (fnmatch ((char *)arg, w, 0) == 0)
-		return 0;
-	str_puts (dst, w);
-	return 1;
+	struct mslot *s;
+	size_t i;
+
+	if (t->cap == 0)
+		return NULL;
+
+	i = intern_hash (name) & (t->cap - 1);
+	for (s = &t->tab[i]; s->name != NULL; s = &t->tab[i]) {
+		if (s->name == name)
+			return s;
+		i = (i + 1) & (t->cap - 1);
+	}
+
+	return NULL;
 }
 
-/* identity transform - used by :J, where `sep` does the joining */
-int
-sw_id (dst, w, arg)
-	str_t *dst;
-	char *w;
-	void_t *arg;
+/* the slot of the interned `name` in `t`, added empty if it is not there */
+struct mslot *
+mt_put (t, name)
+struct mtab *t;
+const char *name;
 {
-	(void) arg;
-	str_puts (dst, w);
-	return 1;
+	struct mslot *s, *tab;
+	size_t i, j, cap;
+
+	/* keep the table at most half full */
+	if ((t->n + 1) * 2 > t->cap) {
+		cap = t->cap ? t->cap * 2 : 16;
+		tab = newa (cap, struct mslot);
+		for (i = 0; i < t->cap; ++i) {
+			if (t->tab[i].name == NULL)
+				continue;
+			j = intern_hash (t->tab[i].name) & (cap - 1);
+			while (tab[j].name != NULL)
+				j = (j + 1) & (cap - 1);
+			tab[j] = t->tab[i];
+		}
+		free (t->tab);
+		t->tab = tab;
+		t->cap = cap;
+	}
+
+	i = intern_hash (name) & (t->cap - 1);
+	for (s = &t->tab[i]; s->name != NULL; s = &t->tab[i]) {
+		if (s->name == name)
+			return s;
+		i = (i + 1) & (t->cap - 1);
+	}
+
+	s->name = name;
+	s->m = NULL;
+	s->gen = 0;
+	++t->n;
+	return s;
 }
 
-/*
- * Split `v` into whitespace-separated words; pass each non-empty word to
- * fn(dst, word, arg).  Words fn accepts (non-zero return) are joined into the
- * result by `sep`.  Frees `v` and returns a freshly allocated string.
- */
-char *
-subst_words (v, sep, fn, arg)
-	char *v;
-	const char *sep;
-	int (*fn) ();
-	void_t *arg;
+/* `name` must be interned */
+struct macro *
+find_emacro (sc, name)
+struct scope *sc;
+const char *name;
 {
-	str_t out, tmp;
-	char *t, *w;
-	int first = 1;
+	struct mslot *s;
 
-	str_new (&out);
-	str_new (&tmp);
-	for (t = v; (w = strsep (&t, " \t")) != NULL; ) {
-		if (*w == '\0')
-			continue;
-		str_reset (&tmp);
-		if ((*fn) (&tmp, w, arg)) {
-			if (!first)
-				str_puts (&out, sep);
-			str_write (&out, tmp.ptr, tmp.len);
-			first = 0;
-		}
+	for (; sc != NULL; sc = sc->parent) {
+		if ((s = mt_get (&sc_dir (sc)->etab, name)) != NULL)
+			return s->m;
 	}
-	str_free (&tmp);
-	free (v);
-	return str_release (&out);
+
+	return NULL;
 }
 
-/* ${name}		just the value of macro called `name`
- * ${name:old=new}	replace `old` with `new`, must be the last modifier
- * ${name:-default}	expand to `default`, if ${name} is empty
- * ${name:+replace}	expand to `replace`, if ${name} is not empty
- * ${name:U}		replace each word with its upper case equivalent
- * ${name:L}		replace each word with its lower case equivalent
- * ${name:F}		try searching for files in either ${.OBJDIR} or source directory
- * ${name:E}		replace each word with its suffix
- * ${name:R}		replace each word with everything but its suffix
- * ${name:H}		replace each word with its dirname() equvialent
- * ${name:T}		replace each word with its basename() equvialent
- * ${name:m1:m2...}	multiple modifiers can be combined
- * ${name:Mpattern}	select only words that match pattern
- * ${name:Npattern}	opposite of :Mpattern
- * ${name:Jstring}	join words by string
+/*
+ * Lookups are cached per directory.  A cached result stays valid until a
+ * macro is defined or exported in the same directory: the exports of the
+ * parents cannot change anymore, because subdirectories are only parsed
+ * once their parents were.
  */
-void
-subst2 (out, sc, prefix, s, ctx)
-str_t *out;
+struct macro *
+find_imacro (sc, name)
 struct scope *sc;
-const struct path *prefix;
-const char **s;
-struct expand_ctx *ctx;
+const char *name;
 {
-	extern char *expand_macro ();
-	extern void expand_macro_into ();
-	extern void subst ();
+	struct directory *d = sc_dir (sc);
+	struct mslot *s, *c;
 	struct macro *m;
-	const char *orig = *s;
-	char *t, *v;
-	int (*lu)();
-	str_t name, old_str, new_str;
 
-	++ctx->depth;
-	if (ctx->depth >= MAX_EXPAND_DEPTH)
-		errx (1, "%s: reached maximum expansion depth", path_to_str (prefix));
+	/* a gen of 0 marks a fresh slot */
+	c = mt_put (&d->mcache, name);
+	if (c->gen == d->mgen + 1)
+		return c->m;
 
-	/* parse macro name */
-	str_new (&name);
-	while (**s != '\0') {
-		if (ismname (**s)) {
-			str_putc (&name, **s);
-			++*s;
-		} else if (**s == '$') {
-			++*s;
-			subst (&name, sc, prefix, s, ctx);
-		} else {
-			break;
+	if ((s = mt_get (&d->mtab, name)) != NULL) {
+		m = s->m;
+	} else if ((m = find_emacro (sc->parent, name)) == NULL) {
+		for (m = globals; m != NULL; m = SLIST_NEXT (m, next)) {
+			if (m->name == name)
+				break;
 		}
 	}
 
-	m = find_macro (sc, str_get (&name));
-	if (**s == '}') {
-		++*s;
-		expand_macro_into (out, sc, prefix, m, str_get (&name), ctx);
-		str_free (&name);
-		return;
-	}
+	c->m = m;
+	c->gen = d->mgen + 1;
+	return m;
+}
 
-	v = expand_macro (sc, prefix, m, str_get (&name), ctx);
-	str_free (&name);
+struct macro *
+find_macro (sc, name)
+struct scope *sc;
+const char *name;
+{
+	/* a name that was never interned is not the name of any macro */
+	if ((name = intern_find (name)) == NULL)
+		return NULL;
 
-	str_new (&old_str);
+	return find_imacro (sc, name);
+}
 
-	while (**s == ':') {
-		++*s;
+struct template *
+find_template (sc, name)
+struct scope *sc;
+const char *name;
+{
+	struct template *tm;
 
-		/* parse modifier, TODO: move this into a function */
-		for (str_reset (&old_str); **s != '\0' && **s != '}' && **s != ':' && **s != '='; ) {
-			switch (**s) {
-			case '$':
-				++*s;
-				subst (&old_str, sc, prefix, s, ctx);
-				break;
-			case '\\':
-				++*s;
-				/* fallthrough */
-			default:
-				str_putc (&old_str, **s);
-				++*s;
-				break;
-			}
-		}
+	SLIST_FOREACH (tm, &sc_dir (sc)->templates, next) {
+		if (strcmp (tm->name, name) == 0)
+			return tm;
+	}
 
-		if (**s == '=') {
-			++*s;
+	return sc->parent != NULL ? find_template (sc->parent, name) : NULL;
+}
 
-			/* TODO: move this into a function */
-			for (str_new (&new_str); **s != '\0' && **s != '}'; ) {
-				switch (**s) {
-				case '$':
-					++*s;
-					subst (&new_str, sc, prefix, s, ctx);
-					break;
-				case '\\':
-					++*s;
-					/* fallthrough */
-				default:
-					str_putc (&new_str, **s);
-					++*s;
-					break;
-				}
-			}
+/* return the attributes (`.RESTAT:`, ...) of `f` */
+int
+file_attrs (sc, f)
+struct scope *sc;
+const struct file *f;
+{
+	struct scope *p;
+	struct attr *a;
+	size_t len;
+	int flags;
 
-			replace_all_into (out, v, str_get (&old_str), str_get (&new_str));
-			str_free (&new_str);
-			goto ret;
-		} else if (str_get (&old_str)[0] == '+') {
-			if (*v != '\0') {
-				free (v);
-				v = strdup (str_get (&old_str) + 1);
-			}
-		} else if (str_get (&old_str)[0] == '-') {
-			if (*v == '\0') {
-				free (v);
-				v = strdup (str_get (&old_str) + 1);
-			}
-		} else if (strcmp (str_get (&old_str), "U") == 0) {
-			lu = mk_toupper;
-			goto do_LU;
-		} else if (strcmp (str_get (&old_str), "L") == 0) {
-			lu = mk_tolower;
-		do_LU:
-			str_new (&new_str);
-
-			for (t = v; *t != '\0'; ++t)
-				str_putc (&new_str, (*lu) (*t));
-
-			free (v);
-			v = str_release (&new_str);
-		} else if (strcmp (str_get (&old_str), "F") == 0) {
-			struct sw_F_arg a;
-			a.sc = sc;
-			a.prefix = prefix;
-			v = subst_words (v, " ", sw_F, &a);
-		} else if (strcmp (str_get (&old_str), "E") == 0) {
-			v = subst_words (v, " ", sw_E, NULL);
-		} else if (strcmp (str_get (&old_str), "R") == 0) {
-			v = subst_words (v, " ", sw_R, NULL);
-		} else if (strcmp (str_get (&old_str), "H") == 0) {
-			v = subst_words (v, " ", sw_H, NULL);
-		} else if (strcmp (str_get (&old_str), "T") == 0) {
-			v = subst_words (v, " ", sw_T, NULL);
-		} else if (str_get (&old_str)[0] == 'M') {
-			v = subst_words (v, " ", sw_M, (void_t *) (str_get (&old_str) + 1));
-		} else if (str_get (&old_str)[0] == 'N') {
-			v = subst_words (v, " ", sw_N, (void_t *) (str_get (&old_str) + 1));
-		} else if (str_get (&old_str)[0] == 'J') {
-			v = subst_words (v, str_get (&old_str) + 1, sw_id, NULL);
-		} else {
-			errx (1, "%s: invalid modifier: ':%s' in '${%s'", sc_path_str (sc), str_get (&old_str), orig);
+	flags = name_attrs (sc, f->name);
+
+	if (f->inf == NULL)
+		return flags;
+
+	/* inference rules are inherited, so are their attributes */
+	len = strlen (f->inf->from);
+	for (p = sc; p != NULL; p = p->parent) {
+		SLIST_FOREACH (a, &sc_dir (p)->attrs, next) {
+			if (strncmp (a->name, f->inf->from, len) == 0 && strcmp (a->name + len, f->inf->to) == 0)
+				flags |= a->flags;
 		}
 	}
 
-	str_puts (out, v);
-
-ret:
-	if (**s != '}')
-		goto invalid;
-	++*s;
-	str_free (&old_str);
-	free (v);
-	--ctx->depth;
-	return;
-invalid:
-	errx (1, "%s: invalid macro expansion: '${%s', s = '%s'", sc_path_str (sc), orig, *s);
+	return flags;
 }
 
-void
-subst (out, sc, prefix, s, ctx)
-str_t *out;
-struct scope *sc;
-const struct path *prefix;
-const char **s;
-struct expand_ctx *ctx;
+/* find the file `name`, whose prerequisites may not have been parsed */
+struct file *
+find_file_lazy (dir, name)
+struct directory *dir;
+const char *name;
 {
-	char buf[3];
-	const char *t;
-	int ch;
+	struct fslot *s;
+	size_t i;
 
-	ch = **s;
-	++*s;
-	switch (ch) {
-	case '$':
-		str_putc (out, '$');
-		break;
-	case '.':
-		expand_special_into (out, sc, prefix, ".TOPDIR", ctx);
-		break;
-	case '@':
-		expand_special_into (out, sc, prefix, ".TARGET", ctx);
-		break;
-	case '<':
-		expand_special_into (out, sc, prefix, ".IMPSRC", ctx);
-		break;
-	case '^':
-		expand_special_into (out, sc, prefix, ".ALLSRC", ctx);
-		break;
-	case '*':
-		t = ".IMPSRC:T}";
-		subst2 (out, sc, prefix, &t, ctx);
-		break;
-	case '&':
-		t = ".SCOPE:T}";
-		subst2 (out, sc, prefix, &t, ctx);
-		break;
-	case '{':
-		subst2 (out, sc, prefix, s, ctx);
-		break;
-	case '(':
-		errx (1, "%s: syntax error: $(...) syntax is reserved for future use, please use ${...} instead.", sc_path_str (sc));
-	default:
-		if (isalpha (ch)) {
-			buf[0] = ch;
-			buf[1] = '}';
-			buf[2] = '\0';
-			t = buf;
-			subst2 (out, sc, prefix, &t, ctx);
-			break;
-		}
-		errx (1, "%s: syntax error: invalid escape sequence: $%c%s", sc_path_str (sc), ch, *s);
+	if (dir->fcap == 0 || (name = intern_find (name)) == NULL)
+		return NULL;
+
+	/*
+	 * The index holds the most recently added definition of a target.
+	 * It keeps the names next to the files, so that a lookup touches
+	 * only the file that it finds.
+	 */
+	i = intern_hash (name) & (dir->fcap - 1);
+	while ((s = &dir->ftab[i])->name != NULL) {
+		if (s->name == name)
+			return s->file;
+		i = (i + 1) & (dir->fcap - 1);
 	}
+
+	return NULL;
 }
 
-void
-expand_into (out, sc, prefix, s, ctx)
-str_t *out;
-struct scope *sc;
-const struct path *prefix;
-const char *s;
-struct expand_ctx *ctx;
+struct file *
+find_file (dir, name)
+struct directory *dir;
+const char *name;
 {
-	while (*s != '\0') {
-		if (*s != '$') {
-			str_putc (out, *s++);
-			continue;
-		}
-		++s;
-		subst (out, sc, prefix, &s, ctx);
-	}
+	extern void file_force ();
+	struct file *f;
+
+	f = find_file_lazy (dir, name);
+	if (f != NULL && f->lazy != NULL)
+		file_force (f);
+	return f;
 }
 
-void
-expand_macro_into (out, sc, prefix, m, name, ctx)
-str_t *out;
+struct scope *
+find_subdir (sc, name)
 struct scope *sc;
-const struct path *prefix;
-const struct macro *m;
 const char *name;
-struct expand_ctx *ctx;
 {
-	if (m == NULL) {
-		expand_special_into (out, sc, prefix, name, ctx);
-		return;
-	}
+	struct scope *sub;
 
-	if (m->prepend != NULL) {
-		expand_macro_into (out, sc, prefix, m->prepend, m->prepend->name, ctx);
-		str_putc (out, ' ');
+	if ((name = intern_find (name)) == NULL)
+		return NULL;
+
+	SLIST_FOREACH (sub, &sc_dir (sc)->subdirs, next) {
+		if (sub->name == name)
+			return sub;
 	}
+	return NULL;
+}
 
-	if (m->value == NULL)
-		return;
+/* MACRO EXPANSION */
 
-	if (m->lazy) {
-		expand_into (out, sc, prefix, m->value, ctx);
-	} else {
-		str_puts (out, m->value);
-	}
+#define MAX_EXPAND_DEPTH 64
+struct expand_ctx {
+	char		*target;
+	struct scope	*scope;
+	const struct dep_list *deps;
+	const struct dep_list *infdeps;
+	int		 free_target;
+	int		 depth;
+	bool		 tainted;	/* the target or a file was looked at */
+};
+
+/* where in a makefile the parser is; every do_parse() has its own */
+struct parse_ctx {
+	const char	*path;
+	int		 line;
+};
+
+void
+ectx_init (ctx, sc, target, deps, infdeps)
+struct expand_ctx	*ctx;
+struct scope		*sc;
+char			*target;
+const struct dep_list	*deps, *infdeps;
+{
+	ctx->target = target;
+	ctx->scope = sc;
+	ctx->deps = deps;
+	ctx->infdeps = infdeps;
+	ctx->free_target = 0;
+	ctx->depth = 0;
+	ctx->tainted = false;
 }
 
-char *
-expand_macro (sc, prefix, m, name, ctx)
-struct scope *sc;
-const struct path *prefix;
-const struct macro *m;
-const char *name;
+void
+ectx_file (ctx, sc, f)
 struct expand_ctx *ctx;
+struct scope *sc;
+struct file *f;
 {
 	str_t tmp;
 
-	str_new (&tmp);
-	expand_macro_into (&tmp, sc, prefix, m, name, ctx);
-	return str_release (&tmp);
+	if (objdir != NULL) {
+		str_new (&tmp);
+		write_objdir (&tmp, sc);
+		str_putc (&tmp, '/');
+		str_puts (&tmp, f->name);
+		ctx->target = str_release (&tmp);
+		ctx->free_target = 1;
+	} else {
+		ctx->target = f->name;
+		ctx->free_target = 0;
+	}
+
+	ctx->scope = sc;
+	ctx->deps  = &f->deps;
+	ctx->infdeps = f->inf != NULL ? &f->inf->deps : NULL;
+	ctx->depth = 0;
+	ctx->tainted = false;
 }
 
-char *
-expand (sc, prefix, s, ctx)
-struct scope *sc;
+void
+ectx_free (ctx)
+struct expand_ctx *ctx;
+{
+	if (ctx->free_target)
+		free (ctx->target);
+}
+
+void
+pr_export (out, sc, prefix, m, ctx)
+str_t *out;
+const struct scope *sc;
 const struct path *prefix;
-const char *s;
+struct macro *m;
 struct expand_ctx *ctx;
 {
-	str_t out;
+	extern void expand_macro_into ();
 
-	if (ctx == NULL)
-		ctx = ectx_null ();
+	str_puts (out, m->name);
+	str_puts (out, "='");
+	expand_macro_into (out, sc, prefix, m, m->name, ctx);
+	str_putc (out, '\'');
+}
 
-	str_new (&out);
-	expand_into (&out, sc, prefix, s, ctx);
-	str_trim (&out);
-	return str_release (&out);
+void
+dep_write (out, sc, dep)
+str_t *out;
+const struct scope *sc;
+const struct dep *dep;
+{
+	if (dep->obj && objdir != NULL) {
+		write_objdir (out, sc);
+		str_putc (out, '/');
+	}
+	str_puts (out, path_str (dep->path));
 }
 
-/* COMMAND EXECUTION */
+/* the special macros, which are computed rather than defined */
+enum special {
+	SP_NONE,
+	SP_SUBDIRS,
+	SP_EXPORTS,
+	SP_OBJDIR,
+	SP_TARGET,		/* $@ */
+	SP_SCOPE,		/* $& is its tail */
+	SP_IMPSRC,		/* $<, $* is its tail */
+	SP_ALLSRC,		/* $^ */
+	SP_TOPDIR,		/* $. */
+	SP_MAKEFILES
+};
 
-char *
-get_shell (sc, dir, ctx)
-struct scope		*sc;
-const struct path	*dir;
-struct expand_ctx	*ctx;
-{
-	struct macro	*m;
-	char		*v;
+const char *special_names[] = {
+	NULL,
+	".SUBDIRS",
+	".EXPORTS",
+	".OBJDIR",
+	".TARGET",
+	".SCOPE",
+	".IMPSRC",
+	".ALLSRC",
+	".TOPDIR",
+	".MAKEFILES",
+};
 
-	m = find_macro (sc, "SHELL");
-	if (m == NULL) {
-		warnx ("BUG: ${SHELL} not found");
-		m = &m_shell;
-	}
+/* the special called `name`, if any */
+enum special
+special_find (name)
+const char *name;
+{
+	int i;
 
-	v = expand_macro (sc, dir, m, "SHELL", ctx);
+	if (name[0] != '.')
+		return SP_NONE;
 
-	return v;
+	for (i = SP_NONE + 1; i <= SP_MAKEFILES; ++i) {
+		if (strcmp (name, special_names[i]) == 0)
+			return i;
+	}
+	return SP_NONE;
 }
 
-char *
-evalcom (sc, dir, cmd)
-struct scope		*sc;
-const struct path	*dir;
-const char		*cmd;
+void
+expand_special_into (out, sc, prefix, sp, ctx)
+str_t *out;
+struct scope *sc;
+const struct path *prefix;
+enum special sp;
+struct expand_ctx *ctx;
 {
-	char *shell, *args[4];
-	ssize_t i, n;
-	str_t data;
-	pid_t pid;
-	mk_wait_t ws;
-	int pipefd[2];
-	char buf[64 + 1];
+	struct scope *sub;
+	struct macro *m;
+	const struct dep *dep;
+	size_t k;
+	int i, j;
 
-	shell = get_shell (sc, dir, NULL);
+	/* TODO: .SUBDIRS, .EXPORTS */
+	assert (ctx != NULL);
 
-	args[0] = shell;
-	args[1] = "-c";
-	args[2] = expand (sc, dir, cmd, NULL);
-	args[3] = NULL;
+	switch (sp) {
+	case SP_NONE:
+		break;
+	case SP_SUBDIRS:
+		if (sc->type != SC_DIR) {
+		invsc:
+			errx (1, "%s: invalid scope type", sc_path (sc));
+		}
 
-	if (pipe (pipefd) != 0)
-		err (1, "pipe()");
+		sub = SLIST_FIRST (&sc_dir (sc)->subdirs);
+		if (sub == NULL)
+			return;
 
-	pid = fork ();
-	if (pid == -1)
-		err (1, "fork()");
+		str_puts (out, sub->name);
+		for (sub = SLIST_NEXT (sub, next); sub != NULL; sub = SLIST_NEXT (sub, next)) {
+			str_putc (out, ' ');
+			str_puts (out, sub->name);
+		}
+		break;
+	case SP_EXPORTS:
+		if (sc->type != SC_DIR)
+			goto invsc;
 
-	if (pid == 0) {
-		close (STDOUT_FILENO);
-		close (pipefd[0]);
-		if (dup (pipefd[1]) != STDOUT_FILENO)
-			err (1, "failed to dup");
-		close (STDIN_FILENO);
-		if (open ("/dev/null", O_RDONLY) != STDIN_FILENO)
-			err (1, "failed to open /dev/null");
-		close (pipefd[1]);
+		m = SLIST_FIRST (&sc_dir (sc)->emacros);
+		if (m == NULL)
+			return;
 
-		if (chdir (path_to_str (dir)) != 0)
-			err (1, "failed to chdir");
+		pr_export (out, sc, prefix, m, ctx);
+		for (m = SLIST_NEXT (m, enext); m != NULL; m = SLIST_NEXT (m, enext)) {
+			str_putc (out, ' ');
+			pr_export (out, sc, prefix, m, ctx);
+		}
+		break;
+	case SP_OBJDIR:
+		write_objdir (out, sc);
+		break;
+	case SP_TARGET:
+		ctx->tainted = true;
+		if (ctx->target == NULL)
+			errx (1, "%s: cannot use $@ or ${.TARGET} here", sc_path (sc));
+		str_puts (out, ctx->target);
+		break;
+	case SP_SCOPE:
+		ctx->tainted = true;
+		sc_path_into (out, ctx->scope);
+		break;
+	case SP_IMPSRC:
+		ctx->tainted = true;
+		/*if (ctx->dep0 == NULL)
+			errx (1, "%s: cannot use $< or ${.IMPSRC} here", sc_path (sc));*/
 
-		execvp (shell, args);
-		err (1, "failed to launch shell");
-	} else {
-		close (pipefd[1]);
+		dep = NULL;
+		if (ctx->deps != NULL && dl_len (ctx->deps) > 0)
+			dep = dl_get (ctx->deps, 0);
+		else if (ctx->infdeps != NULL && dl_len (ctx->infdeps) > 0)
+			dep = dl_get (ctx->infdeps, 0);
 
-		str_new (&data);
+		if (dep != NULL)
+			dep_write (out, sc, dep);
+		break;
+	case SP_ALLSRC:
+		ctx->tainted = true;
+		if (ctx->target == NULL)
+			errx (1, "%s: cannot use $^ or ${.ALLSRC} here", sc_path (sc));
 
-		while ((n = read (pipefd[0], buf, sizeof (buf) - 1)) > 0) {
-			for (i = 0; i < n; ++i)
-				str_putc (&data, buf[i]);
+		if (ctx->deps != NULL) {
+			DL_FOREACH (dep, k, ctx->deps) {
+				str_putc (out, ' ');
+				dep_write (out, sc, dep);
+			}
 		}
-		close (pipefd[0]);
-		if (waitpid (pid, &ws, 0) != pid)
-			err (1, "wait()");
-		free (shell);
-		free (args[2]);
-		if (!WIFEXITED (ws) || WEXITSTATUS (ws) != 0)
-			errx (1, "%s: command failed: %s", cpath, cmd);
-		str_chomp (&data);
-		return str_release (&data);
+		if (ctx->infdeps != NULL) {
+			DL_FOREACH (dep, k, ctx->infdeps) {
+				str_putc (out, ' ');
+				dep_write (out, sc, dep);
+			}
+		}
+		break;
+	case SP_TOPDIR:
+		str_putc (out, '.');
+		for (sub = sc->parent; sub != NULL; sub = sub->parent)
+			str_puts (out, "/..");
+		break;
+	case SP_MAKEFILES:
+		for (i = 0, sub = sc; sub != NULL; ++i, sub = sub->parent) {
+			for (j = 0; j < i; ++j)
+				str_puts (out, "../");
+			str_puts (out, sub->makefile);
+			str_putc (out, ' ');
+		}
+		str_pop (out);
+		break;
 	}
 }
 
-int
-runcom (sc, prefix, cmd, ctx, rule)
-struct scope *sc;
-const struct path *prefix;
-const char *cmd, *rule;
-struct expand_ctx *ctx;
-{
-	char *shell, *ecmd, *args[5];
-	struct timespec t_before, t_after, t_elapsed;
-	str_t fullrule;
-	pid_t pid;
-	mk_wait_t ws;
-	int i = 0, q = 0, ign = 0, rc;
+/*
+ * Lazy macro values and recipe lines are compiled into a `struct eprog`
+ * the first time they are expanded, so that later expansions do not have
+ * to parse them again.  A program is a list of operations: literal text,
+ * specials like $@, and references to macros, whose names are interned
+ * (or, if they contain a `$`, compiled themselves) and whose modifiers are
+ * already decoded.  A syntax error is compiled as well, and reported only
+ * when the program gets to it, just like when the text was expanded
+ * directly.
+ */
+enum eop_kind {
+	EOP_TEXT,		/* `text` */
+	EOP_SPECIAL,		/* $@ $< $^ $. */
+	EOP_REF,		/* ${name:mods...} */
+	EOP_ERROR		/* a syntax error, `text` says which */
+};
 
-	if (*cmd == '@') {
-		q = 1;
-		++cmd;
-	} else if (*cmd == '-') {
-		ign = 1;
-		++cmd;
-	} else if (verbose < 0) {
-		q = 1;
-	}
+enum emod_kind {
+	EMOD_SUBST,		/* :old=new */
+	EMOD_PLUS,		/* :+replace */
+	EMOD_MINUS,		/* :-default */
+	EMOD_U,
+	EMOD_L,
+	EMOD_F,
+	EMOD_E,
+	EMOD_R,
+	EMOD_H,
+	EMOD_T,
+	EMOD_M,			/* :Mpattern */
+	EMOD_N,			/* :Npattern */
+	EMOD_J,			/* :Jstring */
+	EMOD_DYN,		/* decoded after expanding `arg` */
+	EMOD_ERROR		/* a syntax error, `arg.lit` says which */
+};
 
-	/* build full rule path: prefix/rule (mirrors the echo label) */
-	str_new (&fullrule);
-	if (prefix[0].type != PATH_NULL) {
-		path_write (&fullrule, prefix);
-		if (rule != NULL)
-			str_putc (&fullrule, '/');
-	}
-	if (rule != NULL)
-		str_puts (&fullrule, rule);
+/* the argument of a modifier: either constant, or to be expanded */
+struct earg {
+	char		*lit;
+	struct eprog	*prog;
+};
 
-	shell = get_shell (sc, prefix, ctx);
-	ecmd = expand (sc, prefix, cmd, ctx);
+struct emod {
+	enum emod_kind	 kind;
+	struct earg	 arg;		/* what follows the letter, or `old` */
+	struct earg	 rep;		/* the `new` of :old=new */
+};
 
-	if (!q) {
-		printf ("[%s] $ %s\n",
-			str_get (&fullrule),
-			verbose ? ecmd : cmd
-		);
-	}
+struct eop {
+	enum eop_kind	 kind;
+	char		*text;		/* text, special or interned macro name */
+	size_t		 len;		/* of `text`, for EOP_TEXT */
+	enum special	 sp;		/* the special `text` names, if any */
+	struct eprog	*name;		/* EOP_REF: the name, if not constant */
+	struct emod	*mods;		/* EOP_REF: the modifiers */
+	int		 nmods;
+	char		*src;		/* EOP_REF: the source, if needed for errors */
+};
 
-	t_before = now ();
-	pid = fork ();
-	if (pid < 0)
-		err (1, "fork()");
+struct eprog {
+	struct eop	*ops;
+	int		 n, cap;
+	bool		 ctx;		/* refers to the target, see ep_ctx() */
+};
 
-	args[i++] = shell;
-	args[i++] = ign ? "-c" : "-ec";
-	args[i++] = ecmd;
-	args[i] = NULL;
+struct eop *
+ep_op (p, kind)
+struct eprog *p;
+enum eop_kind kind;
+{
+	struct eop *op;
 
-	if (pid == 0) {
-		str_free (&fullrule);
-		close (STDIN_FILENO);
-		if (open ("/dev/null", O_RDONLY) != STDIN_FILENO)
-			warn ("%d: open('/dev/null')", STDIN_FILENO);
+	if (p->n == p->cap) {
+		p->cap = p->cap ? p->cap * 2 : 4;
+		p->ops = renew (p->ops, p->cap, struct eop);
+	}
 
-		if (chdir (path_to_str (prefix)) != 0)
-			err (126, "chdir()");
+	op = &p->ops[p->n++];
+	memset (op, 0, sizeof (*op));
+	op->kind = kind;
+	return op;
+}
 
-		execvp (shell, args);
-		err (127, "exec('%s')", ecmd);
-	} else {
-		free (shell);
-		if (waitpid (pid, &ws, 0) != pid) {
-			str_free (&fullrule);
-			free (ecmd);
-			warn ("wait()");
-			return 254;
-		}
+/* turn the pending literal text in `lit` into an operation */
+void
+ep_flush (p, lit)
+struct eprog *p;
+str_t *lit;
+{
+	struct eop *op;
 
-		t_after = now ();
-		t_elapsed = tv_sub (&t_after, &t_before);
+	if (lit->len == 0)
+		return;
 
-		if (timings_file != NULL) {
-			fprintf (timings_file, "%s,%ld,%ld,%s\n",
-				str_get (&fullrule),
-				(long)t_elapsed.tv_sec,
-				t_elapsed.tv_nsec,
-				ecmd
-			);
-		}
+	op = ep_op (p, EOP_TEXT);
+	op->len = lit->len;
+	op->text = str_release (lit);
+}
 
-		str_free (&fullrule);
-		free (ecmd);
+bool
+ep_error (p, msg)
+struct eprog *p;
+const char *msg;
+{
+	ep_op (p, EOP_ERROR)->text = strdup (msg);
+	return false;
+}
 
-		if (!WIFEXITED (ws)) {
-			warnx ("%d: process didn't exit", (int)pid);
-			return 255;
-		}
+struct emod *
+ep_mod (op, kind)
+struct eop *op;
+enum emod_kind kind;
+{
+	struct emod *md;
 
-		rc = ign ? 0 : WEXITSTATUS (ws);
-		return rc;
-	}
+	op->mods = renew (op->mods, op->nmods + 1, struct emod);
+	md = &op->mods[op->nmods++];
+	memset (md, 0, sizeof (*md));
+	md->kind = kind;
+	return md;
 }
 
-/* EXPRESSION PARSER */
-
-bool
-is_truthy (s)
+/* the kind of the modifier `s` (without the colon) */
+enum emod_kind
+emod_decode (s)
 const char *s;
 {
-	char *endp;
-	long x;
-
-	if (*s == '\0')
-		return 0;
+	switch (s[0]) {
+	case '+':
+		return EMOD_PLUS;
+	case '-':
+		return EMOD_MINUS;
+	case 'M':
+		return EMOD_M;
+	case 'N':
+		return EMOD_N;
+	case 'J':
+		return EMOD_J;
+	}
 
-	x = strtol (s, &endp, 0);
+	if (s[0] == '\0' || s[1] != '\0')
+		return EMOD_ERROR;
+
+	switch (s[0]) {
+	case 'U':
+		return EMOD_U;
+	case 'L':
+		return EMOD_L;
+	case 'F':
+		return EMOD_F;
+	case 'E':
+		return EMOD_E;
+	case 'R':
+		return EMOD_R;
+	case 'H':
+		return EMOD_H;
+	case 'T':
+		return EMOD_T;
+	}
 
-	return *endp != '\0' || x != 0;
+	return EMOD_ERROR;
 }
 
 void
-e_command (s, cmd, arg)
-const char **s;
-const char *cmd;
-str_t *arg;
+ep_free (p)
+struct eprog *p;
 {
-	const char *orig = *s;
-
-	*s += strlen (cmd);
-	skip_ws (s);
-	if (**s != '(')
-		errx (1, "%s:%d: expected '(' after 'defined': %s", cpath, cline, orig);
+	extern void ea_free ();
+	struct eop *op;
+	int i, j;
 
-	str_new (arg);
-	for (++*s; **s != ')'; ++*s)
-		str_putc (arg, **s);
-	++*s;
+	if (p == NULL)
+		return;
 
-	str_trim (arg);
+	for (i = 0; i < p->n; ++i) {
+		op = &p->ops[i];
+		if (op->kind != EOP_REF && op->kind != EOP_SPECIAL)
+			free (op->text);
+		ep_free (op->name);
+		for (j = 0; j < op->nmods; ++j) {
+			ea_free (&op->mods[j].arg);
+			ea_free (&op->mods[j].rep);
+		}
+		free (op->mods);
+		free (op->src);
+	}
+	free (p->ops);
+	free (p);
 }
 
 void
-e_atom (sc, prefix, s, val)
-struct scope *sc;
-const struct path *prefix;
-const char **s;
-str_t *val;
+ea_free (a)
+struct earg *a;
 {
-	extern bool e_or ();
-	str_t arg;
-	char *result;
-	int x;
-
-	skip_ws (s);
-
-	if (**s == '(') {
-		++*s;
-		x = e_or (sc, prefix, s);
-		skip_ws (s);
-		if (**s != ')')
-			errx (1, "%s:%d: expected ')'", cpath, cline);
-		++*s;
-		str_putc (val, x ? '1' : '0');
-	} else if (**s == '"') {
-		++*s;
+	free (a->lit);
+	ep_free (a->prog);
+}
 
-		while (**s != '"') {
-			if (**s == '$') {
-				++*s;
-				subst (val, sc, prefix, s, ectx_null ());
-			} else {
-				str_putc (val, **s);
+/*
+ * Compile the text at `*s` into `p`, up to the end or the first of the
+ * characters in `stop`.  With `esc`, a backslash quotes the next character.
+ * Returns false after a syntax error.
+ */
+bool
+ep_compile_text (p, s, stop, esc)
+struct eprog *p;
+const char **s;
+const char *stop;
+bool esc;
+{
+	extern bool ep_compile_ref ();
+	str_t lit;
+
+	memset (&lit, 0, sizeof (lit));
+	while (**s != '\0' && strchr (stop, **s) == NULL) {
+		if (**s == '$' && (*s)[1] == '$') {
+			str_putc (&lit, '$');
+			*s += 2;
+		} else if (**s == '$') {
+			++*s;
+			ep_flush (p, &lit);
+			if (!ep_compile_ref (p, s))
+				return false;
+		} else {
+			if (esc && **s == '\\' && (*s)[1] != '\0')
 				++*s;
-			}
-		}
-		++*s;
-	} else if (starts_with (*s, "defined")) {
-		e_command (s, "defined", &arg);
-		x = find_macro (sc, str_get (&arg)) != NULL;
-	comm:
-		str_putc (val, x ? '1' : '0');
-		str_free (&arg);
-	} else if (starts_with (*s, "target")) {
-		e_command (s, "target", &arg);
-		x = find_file (sc_dir (sc), str_get (&arg)) != NULL;
-		goto comm;
-	} else if (**s == '`') {
-		str_new (&arg);
-		for (++*s; **s != '`'; ++*s) {
-			if (**s == '\0')
-				errx (1, "%s:%d: unterminated backtick expression",
-				    cpath, cline);
-			str_putc (&arg, **s);
+			str_putc (&lit, **s);
+			++*s;
 		}
-		++*s;
-		result = evalcom (sc, prefix, str_get (&arg));
-		str_puts (val, result);
-		str_free (&arg);
-		free (result);
-	} else {
-		errx (1, "%s:%d: invalid expression: '%s'", cpath, cline, *s);
 	}
+
+	ep_flush (p, &lit);
+	return true;
 }
 
-void
-e_unary (sc, prefix, s, val)
-struct scope *sc;
-const struct path *prefix;
+/* compile the argument of a modifier, see ep_compile_text() */
+bool
+ea_compile (a, s, stop)
+struct earg *a;
 const char **s;
-str_t *val;
+const char *stop;
 {
-	skip_ws (s);
-	if (**s != '!') {
-		e_atom (sc, prefix, s, val);
-		return;
+	struct eprog *p;
+	bool ok;
+
+	p = new (struct eprog);
+	ok = ep_compile_text (p, s, stop, true);
+	if (p->n == 0) {
+		a->lit = strdup ("");
+	} else if (p->n == 1 && p->ops[0].kind == EOP_TEXT) {
+		a->lit = p->ops[0].text;
+		p->ops[0].text = NULL;
+	} else {
+		a->prog = p;
+		return ok;
 	}
-	++*s;
 
-	e_unary (sc, prefix, s, val);
+	ep_free (p);
+	return ok;
+}
 
-	if (is_truthy (str_get (val))) {
-		str_reset (val);
-		str_putc (val, '0');
-	} else {
-		str_reset (val);
-		str_putc (val, '1');
+/* decode the modifier `md`, whose argument was just compiled */
+bool
+ep_decode (op, md, orig)
+struct eop *op;
+struct emod *md;
+const char *orig;
+{
+	struct eop *first;
+	str_t msg;
+	char *t;
+
+	if (md->arg.prog == NULL) {
+		md->kind = emod_decode (md->arg.lit);
+		if (md->kind == EMOD_ERROR) {
+			str_new (&msg);
+			str_puts (&msg, "invalid modifier: ':");
+			str_puts (&msg, md->arg.lit);
+			str_puts (&msg, "' in '${");
+			str_puts (&msg, orig);
+			str_putc (&msg, '\'');
+			free (md->arg.lit);
+			md->arg.lit = str_release (&msg);
+			return false;
+		}
+
+		/* keep only the argument after the letter */
+		if (strchr ("+-MNJ", md->arg.lit[0]) != NULL) {
+			t = md->arg.lit;
+			md->arg.lit = strdup (t + 1);
+			free (t);
+		}
+		return true;
 	}
-}
 
-enum compare_type {
-	COMP_EQ,
-	COMP_NE,
-	COMP_LT,
-	COMP_LE,
-	COMP_GT,
-	COMP_GE,
-};
+	/* eg. ${X:M${PATTERN}}, the letter is still known */
+	first = &md->arg.prog->ops[0];
+	if (first->kind == EOP_TEXT && strchr ("+-MNJ", first->text[0]) != NULL) {
+		md->kind = emod_decode (first->text);
+		memmove (first->text, first->text + 1, first->len--);
+		if (first->len == 0) {
+			free (first->text);
+			memmove (first, first + 1, --md->arg.prog->n * sizeof (*first));
+		}
+		return true;
+	}
+
+	md->kind = EMOD_DYN;
+	if (op->src == NULL)
+		op->src = strdup (orig);
+	return true;
+}
 
+/* ${name}		just the value of macro called `name`
+ * ${name:old=new}	replace `old` with `new`, must be the last modifier
+ * ${name:-default}	expand to `default`, if ${name} is empty
+ * ${name:+replace}	expand to `replace`, if ${name} is not empty
+ * ${name:U}		replace each word with its upper case equivalent
+ * ${name:L}		replace each word with its lower case equivalent
+ * ${name:F}		try searching for files in either ${.OBJDIR} or source directory
+ * ${name:E}		replace each word with its suffix
+ * ${name:R}		replace each word with everything but its suffix
+ * ${name:H}		replace each word with its dirname() equvialent
+ * ${name:T}		replace each word with its basename() equvialent
+ * ${name:m1:m2...}	multiple modifiers can be combined
+ * ${name:Mpattern}	select only words that match pattern
+ * ${name:Npattern}	opposite of :Mpattern
+ * ${name:Jstring}	join words by string
+ */
 bool
-e_comp (sc, prefix, s)
-struct scope *sc;
-const struct path *prefix;
+ep_compile_braced (p, s)
+struct eprog *p;
 const char **s;
 {
-	str_t left, right;
-	const char *sl, *sr;
-	char *el, *er;
-	long il, ir;
-	enum compare_type cmp;
-	int x, icmp;
-
-	str_new (&left);
-	e_unary (sc, prefix, s, &left);
+	extern bool ep_compile_ref ();
+	const char *orig = *s;
+	struct emod *md;
+	struct eop *op;
+	str_t name, msg;
 
-	skip_ws (s);
+	op = ep_op (p, EOP_REF);
 
-	if (starts_with (*s, "==")) {
-		cmp = COMP_EQ;
-		*s += 2;
-	} else if (starts_with (*s, "!=")) {
-		cmp = COMP_NE;
-		*s += 2;
-	} else if (**s == '<') {
-		++*s;
-		if (**s == '=') {
-			cmp = COMP_LE;
+	/* parse macro name */
+	memset (&name, 0, sizeof (name));
+	while (**s != '\0') {
+		if (ismname (**s)) {
+			str_putc (&name, **s);
 			++*s;
-		} else {
-			cmp = COMP_LT;
-		}
-	} else if (**s == '>') {
-		++*s;
-		if (**s == '=') {
-			cmp = COMP_GE;
+		} else if (**s == '$') {
 			++*s;
+			if (op->name == NULL)
+				op->name = new (struct eprog);
+			ep_flush (op->name, &name);
+			if (!ep_compile_ref (op->name, s))
+				return false;
 		} else {
-			cmp = COMP_GT;
+			break;
 		}
+	}
+
+	if (op->name != NULL) {
+		ep_flush (op->name, &name);
 	} else {
-		str_trim (&left);
-		x = is_truthy (str_get (&left));
-		str_free (&left);
-		return x;
+		op->text = intern (name.len > 0 ? str_get (&name) : "");
+		op->sp = special_find (op->text);
+		str_free (&name);
 	}
 
-	skip_ws (s);
-	str_new (&right);
-	e_unary (sc, prefix, s, &right);
+	while (**s == ':') {
+		++*s;
 
-	str_trim (&left);
-	str_trim (&right);
+		md = ep_mod (op, EMOD_DYN);
+		if (!ea_compile (&md->arg, s, ":=}"))
+			return false;
 
-	sl = str_get (&left);
-	sr = str_get (&right);
-	il = strtol (sl, &el, 0);
-	ir = strtol (sr, &er, 0);
-	icmp = *sl != '\0' && *sr != '\0' && *el == '\0' && *er == '\0';
-	x = icmp ? il - ir : strcmp (sl, sr);
-	switch (cmp) {
-	case COMP_EQ:
-		x = x == 0;
-		break;
-	case COMP_NE:
-		x = x != 0;
-		break;
-	case COMP_LT:
-		x = x < 0;
-		break;
-	case COMP_LE:
-		x = x <= 0;
-		break;
-	case COMP_GT:
-		x = x > 0;
-		break;
-	case COMP_GE:
-		x = x >= 0;
-		break;
-	default:
-		abort ();
-	}
-	
-	str_free (&left);
-	str_free (&right);
-	return x;
-}
+		if (**s == '=') {
+			++*s;
+			md->kind = EMOD_SUBST;
+			if (!ea_compile (&md->rep, s, "}"))
+				return false;
+			break;
+		}
 
-bool
-e_and (sc, prefix, s)
-struct scope *sc;
-const struct path *prefix;
-const char **s;
-{
-	int x;
+		if (!ep_decode (op, md, orig)) {
+			md->kind = EMOD_ERROR;
+			return false;
+		}
+	}
 
-	x = e_comp (sc, prefix, s);
-	while (skip_ws (s), starts_with (*s, "&&")) {
-		*s += 2;
-		x &= e_comp (sc, prefix, s);
+	if (**s != '}') {
+		str_new (&msg);
+		str_puts (&msg, "invalid macro expansion: '${");
+		str_puts (&msg, orig);
+		str_puts (&msg, "', s = '");
+		str_puts (&msg, *s);
+		str_putc (&msg, '\'');
+		md = ep_mod (op, EMOD_ERROR);
+		md->arg.lit = str_release (&msg);
+		return false;
 	}
 
-	return x;
+	++*s;
+	return true;
 }
 
+/* compile the reference at `*s`, just after the `$` */
 bool
-e_or (sc, prefix, s)
-struct scope *sc;
-const struct path *prefix;
+ep_compile_ref (p, s)
+struct eprog *p;
 const char **s;
 {
-	int x;
+	struct eop *op;
+	enum special sp;
+	char buf[2];
+	str_t msg;
+	int ch;
 
-	x = e_and (sc, prefix, s);
-	while (skip_ws (s), starts_with (*s, "||")) {
-		*s += 2;
-		x |= e_and (sc, prefix, s);
-	}
+	ch = **s;
+	if (ch != '\0')
+		++*s;
 
-	return x;
+	switch (ch) {
+	case '$':
+		op = ep_op (p, EOP_TEXT);
+		op->text = strdup ("$");
+		op->len = 1;
+		return true;
+	case '.':
+		sp = SP_TOPDIR;
+		goto special;
+	case '@':
+		sp = SP_TARGET;
+		goto special;
+	case '<':
+		sp = SP_IMPSRC;
+		goto special;
+	case '^':
+		sp = SP_ALLSRC;
+	special:
+		op = ep_op (p, EOP_SPECIAL);
+		op->text = (char *)special_names[sp];
+		op->sp = sp;
+		return true;
+	case '*':
+		sp = SP_IMPSRC;
+		goto tail;
+	case '&':
+		sp = SP_SCOPE;
+	tail:
+		/* ${.IMPSRC:T} or ${.SCOPE:T}, without parsing them */
+		op = ep_op (p, EOP_REF);
+		op->text = intern (special_names[sp]);
+		op->sp = sp;
+		ep_mod (op, EMOD_T);
+		return true;
+	case '{':
+		return ep_compile_braced (p, s);
+	case '(':
+		return ep_error (p, "syntax error: $(...) syntax is reserved for future use, please use ${...} instead.");
+	default:
+		if (isalpha (ch)) {
+			buf[0] = ch;
+			buf[1] = '\0';
+			ep_op (p, EOP_REF)->text = intern (buf);
+			return true;
+		}
+
+		str_new (&msg);
+		str_puts (&msg, "syntax error: invalid escape sequence: $");
+		if (ch != '\0')
+			str_putc (&msg, ch);
+		str_puts (&msg, *s);
+		ep_error (p, str_get (&msg));
+		str_free (&msg);
+		return false;
+	}
 }
 
+/* whether the special `sp` depends on the target */
 bool
-parse_expr (sc, prefix, s)
-struct scope *sc;
-const struct path *prefix;
-const char *s;
+is_ctx_special (sp)
+enum special sp;
 {
-	return e_or (sc, prefix, &s);
+	return sp == SP_TARGET || sp == SP_IMPSRC || sp == SP_ALLSRC || sp == SP_SCOPE;
 }
 
-/* PARSER */
-
-char *
-readline (file, ln)
-FILE *file;
-int *ln;
+/*
+ * Whether `p` itself refers to the target being built, or to files.  The
+ * macros it refers to might still do that, which expansion finds out.
+ */
+bool
+ep_ctx (p)
+const struct eprog *p;
 {
-	str_t line;
-	int ch, eof = 1;
+	const struct eop *op;
+	const struct emod *md;
+	int i, j;
 
-	str_new (&line);
+	if (p == NULL)
+		return false;
 
-	while (1) {
-		ch = fgetc (file);
-		switch (ch) {
-		case EOF:
-			goto ret;
-		case '\n':
-			eof = 0;
-			++*ln;
-			goto ret;
-		case '\\':
-			ch = fgetc (file);
-			if (ch == '\n') {
-				++*ln;
-			} else {
-				str_putc (&line, '\\');
-				str_putc (&line, ch);
+	for (i = 0; i < p->n; ++i) {
+		op = &p->ops[i];
+		switch (op->kind) {
+		case EOP_SPECIAL:
+			if (is_ctx_special (op->sp))
+				return true;
+			break;
+		case EOP_REF:
+			if (op->name == NULL && is_ctx_special (op->sp))
+				return true;
+			if (ep_ctx (op->name))
+				return true;
+			for (j = 0; j < op->nmods; ++j) {
+				md = &op->mods[j];
+				if (md->kind == EMOD_F || md->kind == EMOD_DYN)
+					return true;
+				if (ep_ctx (md->arg.prog) || ep_ctx (md->rep.prog))
+					return true;
 			}
-			eof = 0;
 			break;
 		default:
-			str_putc (&line, ch);
-			eof = 0;
 			break;
 		}
 	}
 
-ret:
-	return eof ? NULL : str_release (&line);
+	return false;
 }
 
-struct scope *
-new_subdir (parent, name)
-struct scope *parent;
-const char *name;
+/* compile `s`, which may be freed afterwards */
+struct eprog *
+ep_compile (s)
+const char *s;
 {
-	struct directory *pdir;
-	struct scope *sub;
-	
-	assert (name != NULL);
-
-	pdir = sc_dir (parent);
-
-	sub = new (struct scope);
-	sub->type = SC_DIR;
-	sub->name = strdup (name);
-	sub->parent = parent;
-	sub->makefile = NULL;
-	sub->created = false;
-	SLIST_INSERT_HEAD (&pdir->subdirs, sub, next);
+	struct eprog *p;
 
-	return sub;
+	p = new (struct eprog);
+	ep_compile_text (p, &s, "", false);
+	p->ctx = ep_ctx (p);
+	return p;
 }
 
-struct macro *
-new_macro (name, value, help, lazy, prepend)
-char		*name, *value, *help;
-struct macro	*prepend;
-bool		 lazy;
+/* the argument `a`, expanded into `tmp` if needed; free `tmp` afterwards */
+const char *
+ea_get (tmp, sc, prefix, a, ctx)
+str_t *tmp;
+struct scope *sc;
+const struct path *prefix;
+const struct earg *a;
+struct expand_ctx *ctx;
 {
-	struct macro *m;
-	const char *s;
+	extern void ep_run ();
 
-	assert (name != NULL);
-	assert (value != NULL);
-
-	/* check name */
-	if (*name == '\0')
-		errx (1, "new_macro(): macro name is empty");
+	memset (tmp, 0, sizeof (*tmp));
+	if (a->prog == NULL)
+		return a->lit;
 
-	for (s = name; *s != '\0'; ++s) {
-		if (!ismname (*s))
-			errx (1, "invalid macro name: '%s'", name);
-	}
+	str_scratch (tmp);
+	ep_run (tmp, sc, prefix, a->prog, ctx);
+	return str_get (tmp);
+}
 
-	m = new (struct macro);
-	/* SLIST_ENTRY fields are zeroed by calloc; set explicitly for clarity */
-	m->next.sle_next = NULL;
-	m->enext.sle_next = NULL;
-	m->prepend = prepend;
-	m->name = name;
-	m->value = value;
-	m->help = help;
-	m->lazy = lazy;
+/*
+ * Modifiers are applied in runs: consecutive modifiers that work on each
+ * word by itself (like :R or :M), optionally ending with :J or :old=new,
+ * make one pass over the words of the value.  Each word is transformed in
+ * a scratch buffer and appended to a single output buffer.
+ */
+#define MAX_RUN 8
+
+/* a modifier, with its arguments expanded */
+struct rmod {
+	enum emod_kind	 kind;
+	const char	*arg, *rep;
+	str_t		 abuf, rbuf;
+	struct glob	 glob;		/* :M and :N */
+};
 
-	return m;
+bool
+is_word_mod (kind)
+enum emod_kind kind;
+{
+	switch (kind) {
+	case EMOD_PLUS:
+	case EMOD_MINUS:
+	case EMOD_DYN:
+	case EMOD_ERROR:
+		return false;
+	default:
+		return true;
+	}
 }
 
-struct file *
-new_file (name, rule, time, deps, help, inf, obj)
-char			*name, *help;
-struct rule		*rule;
-struct timespec		 time;
-struct dep_list		*deps;
-struct inference	*inf;
-bool			 obj;
-{
-	struct file *f;
-
-	assert (name != NULL);
-
-	f = new (struct file);
-	/* TAILQ_ENTRY is zeroed by calloc; initialise the embedded head */
-	if (deps != NULL)
-		f->deps = *deps;
-	else
-		TAILQ_INIT (&f->deps);
-	f->name = name;
-	f->rule = rule;
-	f->mtime = time;
-	f->help = help;
-	f->inf = inf;
-	f->obj = obj;
-	f->err = false;
+/* expand the arguments of `md`, and decode it if needed */
+void
+rm_init (rm, sc, prefix, op, md, ctx)
+struct rmod *rm;
+struct scope *sc;
+const struct path *prefix;
+const struct eop *op;
+const struct emod *md;
+struct expand_ctx *ctx;
+{
+	if (md->kind == EMOD_ERROR)
+		errx (1, "%s: %s", sc_path (sc), md->arg.lit);
+
+	rm->kind = md->kind;
+	rm->arg = ea_get (&rm->abuf, sc, prefix, &md->arg, ctx);
+	rm->rep = NULL;
+	memset (&rm->rbuf, 0, sizeof (rm->rbuf));
+	memset (&rm->glob, 0, sizeof (rm->glob));
+
+	if (rm->kind == EMOD_DYN) {
+		rm->kind = emod_decode (rm->arg);
+		if (rm->kind == EMOD_ERROR)
+			errx (1, "%s: invalid modifier: ':%s' in '${%s'", sc_path (sc), rm->arg, op->src);
+		if (strchr ("+-MNJ", rm->arg[0]) != NULL)
+			++rm->arg;
+	}
 
-	return f;
+	switch (rm->kind) {
+	case EMOD_SUBST:
+		rm->rep = ea_get (&rm->rbuf, sc, prefix, &md->rep, ctx);
+		break;
+	case EMOD_M:
+	case EMOD_N:
+		glob_compile (&rm->glob, rm->arg);
+		break;
+	case EMOD_F:
+		ctx->tainted = true;
+		break;
+	default:
+		break;
+	}
 }
 
-struct dep *
-new_dep (path)
-struct path *path;
+/* replace the word in `w` with the `n` bytes at `s`, which may point into `w` */
+void
+w_set (w, s, n)
+str_t *w;
+const char *s;
+size_t n;
 {
-	struct dep *d;
+	if (s >= w->ptr && s < w->ptr + w->cap) {
+		memmove (w->ptr, s, n);
+		w->len = n;
+	} else {
+		w->len = 0;
+		str_write (w, s, n);
+	}
+}
 
-	assert (path != NULL);
+/* apply the word modifiers `rm` to the word in `w`; false drops the word */
+bool
+w_apply (w, tmp, sc, prefix, rm, n)
+str_t *w, *tmp;
+struct scope *sc;
+const struct path *prefix;
+const struct rmod *rm;
+int n;
+{
+	struct filetime ft;
+	const char *t;
+	size_t i, len;
+	int k;
 
-	d = new (struct dep);
-	d->path = path;
-	/* link.tqe_next / tqe_prev are zeroed by calloc */
+	for (k = 0; k < n; ++k, ++rm) {
+		/* an emptied word would have been dropped by a separate pass */
+		if (w->len == 0 && rm->kind != EMOD_U && rm->kind != EMOD_L)
+			return false;
+		str_get (w);
+		switch (rm->kind) {
+		case EMOD_F:
+			if (get_mtime (&ft, sc, prefix, w->ptr) == 0 && ft.obj) {
+				str_reset (tmp);
+				write_objdir (tmp, sc);
+				str_putc (tmp, '/');
+				str_write (tmp, w->ptr, w->len);
+				w_set (w, tmp->ptr, tmp->len);
+			}
+			break;
+		case EMOD_E:
+			t = strrchr (w->ptr, '.');
+			if (t == NULL || strchr (t, '/') != NULL)
+				return false;
+			w_set (w, t, strlen (t));
+			break;
+		case EMOD_R:
+			t = strrchr (w->ptr, '.');
+			if (t != NULL && strchr (t, '/') == NULL)
+				w->len = t - w->ptr;
+			break;
+		case EMOD_H:
+			t = dirname (w->ptr);
+			w_set (w, t, strlen (t));
+			break;
+		case EMOD_T:
+			t = basename (w->ptr);
+			w_set (w, t, strlen (t));
+			break;
+		case EMOD_M:
+			if (!glob_match (&rm->glob, w->ptr, w->len))
+				return false;
+			break;
+		case EMOD_N:
+			if (glob_match (&rm->glob, w->ptr, w->len))
+				return false;
+			break;
+		case EMOD_U:
+			for (i = 0; i < w->len; ++i)
+				w->ptr[i] = mk_toupper (w->ptr[i]);
+			break;
+		case EMOD_L:
+			for (i = 0; i < w->len; ++i)
+				w->ptr[i] = mk_tolower (w->ptr[i]);
+			break;
+		case EMOD_SUBST:
+			len = strlen (rm->arg);
+			if (w->len >= len && memcmp (w->ptr + w->len - len, rm->arg, len) == 0) {
+				w->len -= len;
+				str_puts (w, rm->rep);
+			}
+			break;
+		default:
+			break;
+		}
+	}
 
-	return d;
+	return true;
 }
 
-/*
- * dup_deps: copy a dep_list into a fresh dep_list.
- * Returns nothing; result is in *out.
- */
+/* append the words of `v`, passed through the run `rm`, to `out` */
 void
-dup_deps (src, out)
-struct dep_list *src;
-struct dep_list *out;
+ep_words (out, sc, prefix, v, rm, n)
+str_t *out;
+struct scope *sc;
+const struct path *prefix;
+const char *v;
+const struct rmod *rm;
+int n;
 {
-	struct dep *s, *d;
+	const char *sep, *s;
+	str_t w, tmp;
+	bool first = true;
+
+	sep = rm[n - 1].kind == EMOD_J ? rm[n - 1].arg : " ";
+
+	str_scratch (&w);
+	str_scratch (&tmp);
+	for (;;) {
+		while (*v == ' ' || *v == '\t')
+			++v;
+		if (*v == '\0')
+			break;
+
+		for (s = v; *v != '\0' && *v != ' ' && *v != '\t'; ++v);
+		w.len = 0;
+		str_write (&w, s, v - s);
+		if (!w_apply (&w, &tmp, sc, prefix, rm, n))
+			continue;
 
-	TAILQ_INIT (out);
-	TAILQ_FOREACH (s, src, link) {
-		d = new_dep (s->path);
-		d->obj = s->obj;
-		TAILQ_INSERT_TAIL (out, d, link);
+		if (!first)
+			str_puts (out, sep);
+		str_write (out, w.ptr, w.len);
+		first = false;
 	}
 }
 
-struct dep *
-new_dep_name (name)
-char *name;
+/* apply the modifier `rm`, which works on the whole value, to `v` */
+char *
+ep_modify (v, rm)
+char *v;
+const struct rmod *rm;
 {
-	struct path *p;
-
-	assert (name != NULL);
+	char *t;
 
-	p = newa (2, struct path);
-	p[0].type = PATH_NAME;
-	p[0].name = name;
-	p[1].type = PATH_NULL;
+	switch (rm->kind) {
+	case EMOD_PLUS:
+		if (*v != '\0')
+			v = arena_strdup (&scratch, rm->arg);
+		break;
+	case EMOD_MINUS:
+		if (*v == '\0')
+			v = arena_strdup (&scratch, rm->arg);
+		break;
+	case EMOD_U:
+		for (t = v; *t != '\0'; ++t)
+			*t = mk_toupper (*t);
+		break;
+	case EMOD_L:
+		for (t = v; *t != '\0'; ++t)
+			*t = mk_tolower (*t);
+		break;
+	default:
+		abort ();
+	}
 
-	return new_dep (p);
+	return v;
 }
 
+/* apply the modifiers of `op` to `v`, in the scratch arena, and append it to `out` */
 void
-dir_add_file (dir, f)
-struct directory *dir;
-struct file *f;
+ep_modifiers (out, sc, prefix, op, v, ctx)
+str_t *out;
+struct scope *sc;
+const struct path *prefix;
+const struct eop *op;
+char *v;
+struct expand_ctx *ctx;
 {
-	TAILQ_INSERT_TAIL (&dir->files, f, link);
-}
+	struct rmod rm[MAX_RUN];
+	bool split;
+	str_t tmp;
+	int i, j, n;
 
-/*
- * file_add_deps: append dep_list src onto the end of file->deps.
- * Ownership of elements in src is transferred to file->deps;
- * src is left initialised-but-empty (TAILQ_INIT'd) afterwards.
- */
-void
-file_add_deps (file, src)
-struct file *file;
-struct dep_list *src;
-{
-	TAILQ_CONCAT (&file->deps, src, link);
-}
+	for (i = 0; i < op->nmods; i += n) {
+		/* collect the next run */
+		split = false;
+		for (n = 0; i + n < op->nmods && n < MAX_RUN; ) {
+			if (n > 0 && !is_word_mod (op->mods[i + n].kind))
+				break;
+			rm_init (&rm[n], sc, prefix, op, &op->mods[i + n], ctx);
+			if (!is_word_mod (rm[n++].kind))
+				break;
+			if (rm[n - 1].kind != EMOD_U && rm[n - 1].kind != EMOD_L)
+				split = true;
+			if (rm[n - 1].kind == EMOD_J || rm[n - 1].kind == EMOD_SUBST)
+				break;
+		}
 
-void
-file_add_dep (file, dep)
-struct file *file;
-struct dep *dep;
-{
-	TAILQ_INSERT_TAIL (&file->deps, dep, link);
+		/* :U and :L by themselves keep the spacing of the value */
+		if (!split) {
+			for (j = 0; j < n; ++j)
+				v = ep_modify (v, &rm[j]);
+		} else if (i + n == op->nmods) {
+			ep_words (out, sc, prefix, v, rm, n);
+			return;
+		} else {
+			str_scratch (&tmp);
+			ep_words (&tmp, sc, prefix, v, rm, n);
+			v = (char *)str_get (&tmp);
+		}
+	}
+
+	str_puts (out, v);
 }
 
 void
-foreign_remember (sc, name, t, obj)
-struct scope	*sc;
-const char	*name;
-struct timespec	 t;
-bool		 obj;
+ep_ref (out, sc, prefix, op, ctx)
+str_t *out;
+struct scope *sc;
+const struct path *prefix;
+const struct eop *op;
+struct expand_ctx *ctx;
 {
-	struct cbuilt *b;
+	extern void expand_macro_into ();
+	extern void ep_run ();
+	struct macro *m;
+	struct amark mark;
+	enum special sp;
+	const char *name, *t;
+	size_t cap, start, len;
+	str_t tmp, *dst;
+
+	if (++ctx->depth >= MAX_EXPAND_DEPTH)
+		errx (1, "%s: reached maximum expansion depth", path_str (prefix));
+
+	arena_mark (&scratch, &mark);
+	cap = out->cap;
+
+	if (op->name != NULL) {
+		str_scratch (&tmp);
+		ep_run (&tmp, sc, prefix, op->name, ctx);
+		name = str_get (&tmp);
+		m = find_macro (sc, name);
+		sp = m == NULL ? special_find (name) : SP_NONE;
+	} else {
+		name = op->text;
+		m = find_imacro (sc, name);
+		sp = op->sp;
+	}
 
-	b = new (struct cbuilt);
-	b->name = strdup (name != NULL ? name : "");
-	b->t = t;
-	b->obj = obj;
-	SLIST_INSERT_HEAD (&sc_foreign (sc)->built, b, next);
+	if (m == NULL && op->nmods == 1 && op->mods[0].kind == EMOD_T
+	    && (sp == SP_IMPSRC || sp == SP_SCOPE)) {
+		/* $* and $&: a single path, cut down to its tail in place */
+		start = out->len;
+		expand_special_into (out, sc, prefix, sp, ctx);
+		if (out->len > start) {
+			str_get (out);
+			t = basename (out->ptr + start);
+			len = strlen (t);
+			memmove (out->ptr + start, t, len);
+			out->len = start + len;
+		}
+	} else {
+		if (op->nmods == 0) {
+			dst = out;
+		} else {
+			str_scratch (&tmp);
+			dst = &tmp;
+		}
+
+		/* a macro of the same name hides the special */
+		if (m != NULL)
+			expand_macro_into (dst, sc, prefix, m, name, ctx);
+		else
+			expand_special_into (dst, sc, prefix, sp, ctx);
+
+		if (op->nmods != 0)
+			ep_modifiers (out, sc, prefix, op, (char *)str_get (&tmp), ctx);
+	}
+
+	/* unless `out` itself grew in the arena since */
+	if (out->arena == NULL || out->cap == cap)
+		arena_release (&scratch, &mark);
+	--ctx->depth;
 }
 
-char *
-strip_comment (s)
-char *s;
+/* run the program `p` */
+void
+ep_run (out, sc, prefix, p, ctx)
+str_t *out;
+struct scope *sc;
+const struct path *prefix;
+const struct eprog *p;
+struct expand_ctx *ctx;
 {
-	char *t, *o = s;
-
-	while ((t = strchr (s, '#')) != NULL) {
-		if (t == o || isspace (t[-1])) {
-			*t = '\0';
+	const struct eop *op;
+	int i;
+
+	arena_enter (&scratch);
+	for (i = 0; i < p->n; ++i) {
+		op = &p->ops[i];
+		switch (op->kind) {
+		case EOP_TEXT:
+			str_write (out, op->text, op->len);
 			break;
+		case EOP_SPECIAL:
+			expand_special_into (out, sc, prefix, op->sp, ctx);
+			break;
+		case EOP_REF:
+			ep_ref (out, sc, prefix, op, ctx);
+			break;
+		case EOP_ERROR:
+			errx (1, "%s: %s", sc_path (sc), op->text);
 		}
-		s = t + 1;
 	}
-
-	return o;
+	arena_leave (&scratch);
 }
 
-/* .SUBDIRS: cc make sys # comment */
+/* expand the reference at `*s`, just after the `$` */
 void
-parse_subdirs (sc, dir, s)
+subst (out, sc, prefix, s, ctx)
+str_t *out;
 struct scope *sc;
-const struct path *dir;
-char *s;
+const struct path *prefix;
+const char **s;
+struct expand_ctx *ctx;
 {
-	struct scope *sub;
-	char *subdir;
-	const char *path, *name;
-
-	strip_comment (s);
+	struct eprog *p;
 
-	while ((subdir = strsep (&s, " \t")) != NULL) {
-		if (*subdir == '\0')
-			continue;
+	p = new (struct eprog);
+	ep_compile_ref (p, s);
+	ep_run (out, sc, prefix, p, ctx);
+	ep_free (p);
+}
 
-		name = trim (subdir);
-		sub = new_subdir (sc, name);
-		sub->type = SC_DIR;
-		sub->makefile = MAKEFILE;
+/* the slot of `m` in the expansions of `d` */
+struct mval *
+mv_slot (d, m)
+struct directory *d;
+const struct macro *m;
+{
+	struct mval *v, *tab;
+	size_t i, j, cap;
+
+	/* keep the table at most half full */
+	if ((d->nvals + 1) * 2 > d->vcap) {
+		cap = d->vcap ? d->vcap * 2 : 16;
+		tab = newa (cap, struct mval);
+		for (i = 0; i < d->vcap; ++i) {
+			if (d->vtab[i].m == NULL)
+				continue;
+			j = intern_hash (d->vtab[i].m->name) & (cap - 1);
+			while (tab[j].m != NULL)
+				j = (j + 1) & (cap - 1);
+			tab[j] = d->vtab[i];
+		}
+		free (d->vtab);
+		d->vtab = tab;
+		d->vcap = cap;
+	}
 
-		path = path_cat_str (dir, sub->name);
-		if (access (path, F_OK) != 0)
-			errx (1, "%s:%d: directory not found: %s", cpath, cline, sub->name);
+	i = intern_hash (m->name) & (d->vcap - 1);
+	for (v = &d->vtab[i]; v->m != NULL; v = &d->vtab[i]) {
+		if (v->m == m)
+			return v;
+		i = (i + 1) & (d->vcap - 1);
 	}
+
+	v->m = m;
+	++d->nvals;
+	return v;
 }
 
-/* .FOREIGN: libfoo libbar # comment */
+/*
+ * Expand the lazy macro `m`, whose value does not refer to the target.
+ * Unless one of the macros it refers to does, the expansion is remembered
+ * until the next macro is defined in the directory of `sc`.
+ */
 void
-parse_foreign (sc, s)
+expand_memo_into (out, sc, prefix, m, ctx)
+str_t *out;
 struct scope *sc;
-char *s;
+const struct path *prefix;
+struct macro *m;
+struct expand_ctx *ctx;
 {
-	struct foreign *cs;
-	struct scope *sub;
-	const char *name;
-	char *subdir;
-
-	strip_comment (s);
-
-	while ((subdir = strsep (&s, " \t")) != NULL) {
-		if (*subdir == '\0')
-			continue;
+	struct directory *d = sc_dir (sc);
+	struct mval *v;
+	bool tainted;
+	size_t start;
+
+	v = mv_slot (d, m);
+	if (v->gen == d->mgen + 1) {
+		str_write (out, v->value, v->len);
+		return;
+	}
 
-		name = trim (subdir);
-		sub = new_subdir (sc, name);
-		sub->type = SC_FOREIGN;
-		sub->makefile = NULL;
-		cs = new (struct foreign);
-		cs->test = NULL;
-		cs->exec = NULL;
-		TAILQ_INIT (&cs->deps);
-		SLIST_INIT (&cs->built);
-		sub->inner.foreign = cs;
+	tainted = ctx->tainted;
+	ctx->tainted = false;
+	start = out->len;
+	ep_run (out, sc, prefix, m->prog, ctx);
+
+	/* `v` may have moved, if the table grew */
+	if (!ctx->tainted) {
+		v = mv_slot (d, m);
+		free (v->value);
+		v->len = out->len - start;
+		v->value = newa (v->len + 1, char);
+		memcpy (v->value, out->ptr + start, v->len);
+		v->gen = d->mgen + 1;
 	}
+	ctx->tainted |= tainted;
 }
 
-/* .EXPORTS: CC CFLAGS # comment */
 void
-parse_exports (sc, s)
+expand_macro_into (out, sc, prefix, m, name, ctx)
+str_t *out;
 struct scope *sc;
-char *s;
+const struct path *prefix;
+struct macro *m;
+const char *name;
+struct expand_ctx *ctx;
 {
-	struct macro *m;
-	const char *name;
+	if (m == NULL) {
+		expand_special_into (out, sc, prefix, special_find (name), ctx);
+		return;
+	}
 
-	strip_comment (s);
+	if (m->prepend != NULL) {
+		expand_macro_into (out, sc, prefix, m->prepend, m->prepend->name, ctx);
+		str_putc (out, ' ');
+	}
 
-	while ((name = strsep (&s, " \t")) != NULL) {
-		if (*name == '\0')
-			continue;
+	if (m->value == NULL)
+		return;
 
-		/* check if the macro is already exported */
-		SLIST_FOREACH (m, &sc_dir (sc)->emacros, enext) {
-			if (strcmp (m->name, name) == 0)
-				goto cont; /* already exported */
+	if (m->lazy) {
+		if (m->prog == NULL)
+			m->prog = ep_compile (m->value);
+		if (m->prog->ctx) {
+			ep_run (out, sc, prefix, m->prog, ctx);
+		} else {
+			expand_memo_into (out, sc, prefix, m, ctx);
 		}
-
-		m = find_macro (sc, name);
-		if (m == NULL)
-			errx (1, "%s:%d: no such macro: '%s'", cpath, cline, name);
-
-		SLIST_INSERT_HEAD (&sc_dir (sc)->emacros, m, enext);
-
-	cont:;
+	} else {
+		str_puts (out, m->value);
 	}
 }
 
-bool
-try_add_foreign (sc, f)
+/* run the program `p` and trim the result */
+char *
+ep_expand (sc, prefix, p, ctx)
 struct scope *sc;
-struct file *f;
+const struct path *prefix;
+const struct eprog *p;
+struct expand_ctx *ctx;
 {
-	struct scope *sub;
-	char *name;
-	size_t len;
-	int ch;
+	struct expand_ctx null;
+	str_t out;
 
-	len = strlen (f->name);
-	ch = f->name[len - 1];
-	if (ch != '?' && ch != '!')
-		return false;
+	if (ctx == NULL) {
+		ectx_init (&null, NULL, NULL, NULL, NULL);
+		ctx = &null;
+	}
 
-	name = strdup (f->name);
-	name[len - 1] = '\0';
-	sub = find_subdir (sc, name);
-	if (sub == NULL)
-		errx (1, "%s: not a subdir: %s", sc_path_str (sc), name);
+	str_new (&out);
+	ep_run (&out, sc, prefix, p, ctx);
+	str_trim (&out);
+	return str_release (&out);
+}
 
-	if (sub->type != SC_FOREIGN)
-		errx (1, "%s: not a foreign subdir: %s", sc_path_str (sc), name);
+char *
+expand (sc, prefix, s, ctx)
+struct scope *sc;
+const struct path *prefix;
+const char *s;
+struct expand_ctx *ctx;
+{
+	struct eprog *p;
+	char *t;
 
-	if (ch == '?') {
-		sub->inner.foreign->test = f;
-	} else {
-		sub->inner.foreign->exec = f;
+	p = ep_compile (s);
+	t = ep_expand (sc, prefix, p, ctx);
+	ep_free (p);
+	return t;
+}
+
+/* COMMAND EXECUTION */
+
+void
+get_shell (out, sc, dir, ctx)
+str_t			*out;
+struct scope		*sc;
+const struct path	*dir;
+struct expand_ctx	*ctx;
+{
+	struct macro	*m;
+
+	m = find_macro (sc, "SHELL");
+	if (m == NULL) {
+		warnx ("BUG: ${SHELL} not found");
+		m = &m_shell;
 	}
 
-	free (name);
-	return true;
+	expand_macro_into (out, sc, dir, m, "SHELL", ctx);
 }
 
-/*
- * If 'name' is the bare name of an SC_FOREIGN subdir, append 'dhead..dtail'
- * to its ordering dep list and return true.  The rule (if any) must be
- * empty; if the caller supplied commands, we error out.
- */
-bool
-try_add_foreign_deps (sc, name, src)
-struct scope *sc;
-const char *name;
-struct dep_list *src;
+/* run `cmd` in `cwd`, and read what it prints into `out`; returns its exit status */
+int
+shell_output (out, shell, cmd, cwd)
+str_t *out;
+char *shell, *cmd;
+const char *cwd;
 {
-	struct scope *sub;
-	struct foreign *cs;
+	char *args[4];
+	ssize_t i, n;
+	pid_t pid;
+	mk_wait_t ws;
+	int pipefd[2];
+	char buf[64 + 1];
 
-	sub = find_subdir (sc, name);
-	if (sub == NULL || sub->type != SC_FOREIGN)
-		return false;
+	args[0] = shell;
+	args[1] = "-c";
+	args[2] = cmd;
+	args[3] = NULL;
 
-	if (TAILQ_EMPTY (src))
-		return true;
+	if (pipe (pipefd) != 0)
+		err (1, "pipe()");
 
-	cs = sc_foreign (sub);
-	TAILQ_CONCAT (&cs->deps, src, link);
-	return true;
+	pid = fork ();
+	if (pid == -1)
+		err (1, "fork()");
+
+	if (pid == 0) {
+		close (STDOUT_FILENO);
+		close (pipefd[0]);
+		if (dup (pipefd[1]) != STDOUT_FILENO)
+			err (1, "failed to dup");
+		close (STDIN_FILENO);
+		if (open ("/dev/null", O_RDONLY) != STDIN_FILENO)
+			err (1, "failed to open /dev/null");
+		close (pipefd[1]);
+
+		if (chdir (cwd) != 0)
+			err (1, "failed to chdir");
+
+		execvp (shell, args);
+		err (1, "failed to launch shell");
+	}
+
+	close (pipefd[1]);
+	while ((n = read (pipefd[0], buf, sizeof (buf) - 1)) > 0) {
+		for (i = 0; i < n; ++i)
+			str_putc (out, buf[i]);
+	}
+	close (pipefd[0]);
+	if (waitpid (pid, &ws, 0) != pid)
+		err (1, "wait()");
+	str_chomp (out);
+	return WIFEXITED (ws) ? WEXITSTATUS (ws) : -1;
 }
 
-/* TODO: impl .SUFFIXES: */
-bool
-is_inf (s)
-char *s;
+char *
+evalcom (pctx, sc, dir, cmd)
+struct parse_ctx	*pctx;
+struct scope		*sc;
+const struct path	*dir;
+const char		*cmd;
 {
-	char *d;
-	int x;
+	extern void pc_dep_cmd ();
+	char *shell, *text;
+	str_t data;
 
-	if (*s != '.')
-		return 0;
-	++s;
-	d = strchr (s, '.');
+	str_new (&data);
+	get_shell (&data, sc, dir, NULL);
+	shell = str_release (&data);
+	text = expand (sc, dir, cmd, NULL);
+
+	str_new (&data);
+	if (shell_output (&data, shell, text, path_str (dir)) != 0)
+		errx (1, "%s:%d: command failed: %s", pctx->path, pctx->line, cmd);
+	pc_dep_cmd (shell, text, path_str (dir), str_get (&data), data.len);
+	free (shell);
+	free (text);
+	return str_release (&data);
+}
 
-	if (d == NULL) {
-		return strlen (s) <= 3;
+/* the compiled recipe line `*line` of `r` */
+struct eprog *
+rule_prog (r, line)
+struct rule *r;
+char **line;
+{
+	const char *s;
+	size_t i, n;
+
+	if (r->progs == NULL) {
+		for (n = 0; r->code[n] != NULL; ++n);
+		r->progs = newa (n, struct eprog *);
 	}
 
-	*d = '\0';
-	x = strlen (s) <= 3 && strlen (d + 1) <= 3;
-	*d = '.';
-	return x;
+	i = line - r->code;
+	if (r->progs[i] == NULL) {
+		s = *line;
+		if (*s == '@' || *s == '-')
+			++s;
+		r->progs[i] = ep_compile (s);
+	}
+
+	return r->progs[i];
 }
 
-struct rule *
-parse_rule (sc, dir, s, t, help)
+/* run `cmd`, where `prog` is the compiled command, see rule_prog() */
+int
+runcom (sc, prefix, cmd, prog, ctx, rule)
 struct scope *sc;
-const struct path *dir;
-char *s, *t, *help;
+const struct path *prefix;
+const char *cmd, *rule;
+const struct eprog *prog;
+struct expand_ctx *ctx;
 {
-	struct inference *inf;
-	struct filetime ft;
-	struct dep_list deps, cdeps;
-	struct rule *r;
-	struct file *f;
-	struct file **seen;
-	struct dep *dep;
-	char *u, *v, *p;
-	size_t i, nseen, cseen;
-	int flag;
+	char *shell, *ecmd, *args[5];
+	struct timespec t_before, t_after, t_elapsed;
+	str_t fullrule, tmp;
+	pid_t pid;
+	mk_wait_t ws;
+	int i = 0, q = 0, ign = 0, rc;
 
-	r = new (struct rule);
-	r->code = NULL;
-	TAILQ_INIT (&deps);
+	if (*cmd == '@') {
+		q = 1;
+		++cmd;
+	} else if (*cmd == '-') {
+		ign = 1;
+		++cmd;
+	} else if (verbose < 0) {
+		q = 1;
+	}
 
-	*t = '\0';
+	/* everything built here is released when the command is done */
+	arena_enter (&scratch);
 
-	/* parse deps */
-	v = u = expand (sc, dir, t + 1, NULL);
-	while ((p = strsep (&v, " \t")) != NULL) {
-		if (*p == '\0')
-			continue;
-		dep = new_dep (parse_path (p));
-		TAILQ_INSERT_TAIL (&deps, dep, link);
+	/* build full rule path: prefix/rule (mirrors the echo label) */
+	str_scratch (&fullrule);
+	if (prefix[0].type != PATH_NULL) {
+		str_puts (&fullrule, path_str (prefix));
+		if (rule != NULL)
+			str_putc (&fullrule, '/');
 	}
-	free (u);
-
-	/* parse targets */
-	u = expand (sc, dir, s, NULL);
-	flag = 0;
-	if (is_inf (u)) {
-		p = strchr (u + 1, '.');
-		inf = new (struct inference);
-		inf->rule = r;
-		inf->deps = deps;
+	if (rule != NULL)
+		str_puts (&fullrule, rule);
 
-		if (p != NULL) {
-			*p = '\0';
-			inf->from = strdup (u);
-			*p = '.';
-			inf->to = strdup (p);
-		} else {
-			inf->from = strdup (u);
-			inf->to = "";
-		}
+	str_scratch (&tmp);
+	get_shell (&tmp, sc, prefix, ctx);
+	shell = (char *)str_get (&tmp);
 
-		SLIST_INSERT_HEAD (&sc_dir (sc)->infs, inf, next);
-		flag = 1;
-	} else {
-		seen = NULL;
-		nseen = cseen = 0;
-		v = u;
-		while ((p = strsep (&v, " \t")) != NULL) {
+	str_scratch (&tmp);
+	ep_run (&tmp, sc, prefix, prog, ctx);
+	str_trim (&tmp);
+	ecmd = (char *)str_get (&tmp);
 
-			if (*p == '\0')
-				continue;
-			/* TODO: check name */
+	if (!q) {
+		printf ("[%s] $ %s\n",
+			str_get (&fullrule),
+			verbose ? ecmd : cmd
+		);
+	}
 
-			f = find_file (sc_dir (sc), p);
+	t_before = now ();
+	pid = fork ();
+	if (pid < 0)
+		err (1, "fork()");
 
-			/* skip duplicate targets on the same rule line */
-			if (f != NULL) {
-				for (i = 0; i < nseen; ++i) {
-					if (seen[i] == f)
-						break;
-				}
-				if (i != nseen)
-					continue;
-			}
+	args[i++] = shell;
+	args[i++] = ign ? "-c" : "-ec";
+	args[i++] = ecmd;
+	args[i] = NULL;
 
-			dup_deps (&deps, &cdeps);
+	if (pid == 0) {
+		close (STDIN_FILENO);
+		if (open ("/dev/null", O_RDONLY) != STDIN_FILENO)
+			warn ("%d: open('/dev/null')", STDIN_FILENO);
 
-			if (f == NULL && try_add_foreign_deps (sc, p, &cdeps)) {
-				flag = 1;
-				continue;
-			}
+		if (chdir (path_str (prefix)) != 0)
+			err (126, "chdir()");
 
-			if (f == NULL) {
-				get_mtime (&ft, sc, dir, p);
+		execvp (shell, args);
+		err (127, "exec('%s')", ecmd);
+	} else {
+		if (waitpid (pid, &ws, 0) != pid) {
+			arena_leave (&scratch);
+			warn ("wait()");
+			return 254;
+		}
 
-				f = new_file (
-					/* name */ strdup (p),
-					/* rule */ r,
-					/* time */ ft.t,
-					/* deps */ &cdeps,
-					/* help */ help,
-					/* inf  */ NULL,
-					/* obj  */ ft.obj
-				);
-				/* TODO: maybe first do try_add_foreign()? */
-				dir_add_file (sc_dir (sc), f);
-				try_add_foreign (sc, f);
-				flag = 1;
-			} else {
-				if (f->help == NULL)
-					f->help = help;
+		t_after = now ();
+		t_elapsed = tv_sub (&t_after, &t_before);
 
-				if (!TAILQ_EMPTY (&cdeps))
-					file_add_deps (f, &cdeps);
-			}
-
-			if (nseen == cseen) {
-				cseen = cseen ? cseen * 2 : 4;
-				seen = renew (seen, cseen, struct file *);
-			}
-			seen[nseen++] = f;
+		if (timings_file != NULL) {
+			fprintf (timings_file, "%s,%ld,%ld,%s\n",
+				str_get (&fullrule),
+				(long)t_elapsed.tv_sec,
+				t_elapsed.tv_nsec,
+				ecmd
+			);
 		}
-		free (seen);
-	}
-	free (u);
-	return flag ? r : NULL;
-}
-
-void
-parse_assign (sc, dir, s, t, help)
-struct scope		*sc;
-const struct path	*dir;
-char			*s, *t, *help;
-{
-	struct macro *m, *prepend = NULL;
-	char *value;
-	bool lazy;
 
-	if (t[-1] == '!') {
-		t[-1] = '\0';
-		lazy = false;
-		value = evalcom (sc, dir, trim (t + 1));
-	} else if (t[-1] == '?') {
-		/* handle both `?=` and `??=` */
-		if (s == (t - 1))
-			errx (1, "why are you doing this to me Davids?");
+		arena_leave (&scratch);
 
-		if (t[-2] == '?') {
-			t[-2] = '\0';
-			value = getenv (trim (s));
-			if (value == NULL) {
-				m = find_macro (sc, trim (s));
-				if (m != NULL)
-					value = m->value;
-			}
-			if (value == NULL)
-				value = strdup (trim (t + 1));
-		} else {
-			t[-1] = '\0';
-			m = find_macro (sc, trim (s));
-			value = m != NULL ? m->value : strdup (trim (t + 1));
+		if (!WIFEXITED (ws)) {
+			warnx ("%d: process didn't exit", (int)pid);
+			return 255;
 		}
-		lazy = true;
-	} else if (t[-1] == ':') {
-		/* handle both `:=` and `::=` */
-		if (s == (t - 1))
-			errx (1, "why are you doing this to me Davids, again?");
-		t[t[-2] == ':' ? -2 : -1] = '\0';
-		value = expand (sc, dir, trim (t + 1), NULL);
-		lazy = false;
-	} else if (t[-1] == '+') {
-		t[-1] = '\0';
-		value = strdup (trim (t + 1));
-		prepend = find_macro (sc, trim (s));
-		lazy = true;
-	} else {
-		value = strdup (trim (t + 1));
-		lazy = true;
-	}
 
-	m = new_macro (
-		/* name  */ strdup (trim (s)),
-		/* value */ value,
-		/* help  */ help,
-		/* lazy  */ lazy,
-		/*prepend*/ prepend
-	);
-	SLIST_INSERT_HEAD (&sc_dir (sc)->macros, m, next);
+		rc = ign ? 0 : WEXITSTATUS (ws);
+		return rc;
+	}
 }
 
-
-#define IF_VAL 0x01
-#define IF_HAS 0x02
-#define MAX_IFSTACK 16
+/* EXPRESSION PARSER */
 
 bool
-walkifstack (s, n)
+is_truthy (s)
 const char *s;
-size_t n;
-{
-	size_t i;
-
-	for (i = 0; i < n; ++i) {
-		if (!(s[i] & IF_VAL))
-			return false;
-	}
-	return true;
-}
-
-bool
-is_directive (out, s, name)
-char **out, *s;
-const char *name;
 {
-	size_t len;
-
-	if (*s != '.')
-		return false;
-	++s;
-
-	skip_ws (&s);
-	len = strlen (name);
-	if (strncmp (s, name, len) != 0)
-		return false;
+	char *endp;
+	long x;
 
-	s += len;
+	if (*s == '\0')
+		return 0;
 
-	if (*s != '\0' && !isspace (*s))
-		return false;
+	x = strtol (s, &endp, 0);
 
-	if (out != NULL)
-		*out = trim (s);
-	return true;
+	return *endp != '\0' || x != 0;
 }
 
-bool
-is_target (out, s, name)
-char **out, *s;
-const char *name;
+void
+e_command (pctx, s, cmd, arg)
+struct parse_ctx *pctx;
+const char **s;
+const char *cmd;
+str_t *arg;
 {
-	size_t len;
-
-	len = strlen (name);
-	if (strncmp (s, name, len) != 0)
-		return false;
+	const char *orig = *s;
 
-	s += len;
-	skip_ws (&s);
-	if (*s != ':')
-		return false;
-	++s;
+	*s += strlen (cmd);
+	skip_ws (s);
+	if (**s != '(')
+		errx (1, "%s:%d: expected '(' after 'defined': %s", pctx->path, pctx->line, orig);
 
-	if (out != NULL)
-		*out = trim (s);
+	str_new (arg);
+	for (++*s; **s != ')'; ++*s)
+		str_putc (arg, **s);
+	++*s;
 
-	return true;
+	str_trim (arg);
 }
 
-char *
-parse_def (s, name, value)
-char *s, **name, **value;
+void
+e_atom (pctx, sc, prefix, s, val)
+struct parse_ctx *pctx;
+struct scope *sc;
+const struct path *prefix;
+const char **s;
+str_t *val;
 {
-	char *i;
+	extern bool e_or ();
+	struct expand_ctx ctx;
+	str_t arg;
+	char *result;
+	int x;
 
-	for (i = s; *i != '\0'; ++i) {
-		switch (*i) {
-		case '$':
-			switch (*++i) {
-			case '\0':
-				return NULL;
-			case '{':
-				for (++i; *i != '\0' && *i != '}'; ++i);
-				if (*i != '}')
-					return NULL;
-				break;
-			default:
-				break;
+	skip_ws (s);
+
+	if (**s == '(') {
+		++*s;
+		x = e_or (pctx, sc, prefix, s);
+		skip_ws (s);
+		if (**s != ')')
+			errx (1, "%s:%d: expected ')'", pctx->path, pctx->line);
+		++*s;
+		str_putc (val, x ? '1' : '0');
+	} else if (**s == '"') {
+		++*s;
+
+		while (**s != '"') {
+			if (**s == '$') {
+				++*s;
+				ectx_init (&ctx, NULL, NULL, NULL, NULL);
+				subst (val, sc, prefix, s, &ctx);
+			} else {
+				str_putc (val, **s);
+				++*s;
 			}
-			break;
-		case ':':
-			if (i[1] == '=' || (i[1] == ':' && i[2] == '='))
-				break;
-			*name = s;
-			*value = i + 1;
-			return i;
-		case '=':
-			*name = s;
-			*value = i + 1;
-			return i;
 		}
+		++*s;
+	} else if (starts_with (*s, "defined")) {
+		e_command (pctx, s, "defined", &arg);
+		x = find_macro (sc, str_get (&arg)) != NULL;
+	comm:
+		str_putc (val, x ? '1' : '0');
+		str_free (&arg);
+	} else if (starts_with (*s, "target")) {
+		e_command (pctx, s, "target", &arg);
+		x = find_file (sc_dir (sc), str_get (&arg)) != NULL;
+		goto comm;
+	} else if (**s == '`') {
+		str_new (&arg);
+		for (++*s; **s != '`'; ++*s) {
+			if (**s == '\0')
+				errx (1, "%s:%d: unterminated backtick expression",
+				    pctx->path, pctx->line);
+			str_putc (&arg, **s);
+		}
+		++*s;
+		result = evalcom (pctx, sc, prefix, str_get (&arg));
+		str_puts (val, result);
+		str_free (&arg);
+		free (result);
+	} else {
+		errx (1, "%s:%d: invalid expression: '%s'", pctx->path, pctx->line, *s);
 	}
-	return NULL;
 }
 
 void
-do_parse (sc, dir, path, file)
+e_unary (pctx, sc, prefix, s, val)
+struct parse_ctx *pctx;
 struct scope *sc;
-const struct path *dir;
-const char *path;
-FILE *file;
+const struct path *prefix;
+const char **s;
+str_t *val;
 {
-	extern void parse ();
-	struct template *tm;
-	struct rule *r = NULL;
-	size_t len, cap, iflen = 0;
-	char *s, *t, *u, *name, *value, *help = NULL;
-	char ifstack[MAX_IFSTACK];
-	int x, run, oldcline;
-	FILE *tfile;
-	str_t text;
+	skip_ws (s);
+	if (**s != '!') {
+		e_atom (pctx, sc, prefix, s, val);
+		return;
+	}
+	++*s;
 
-	assert (sc->type == SC_DIR);
-	cpath = path;
+	e_unary (pctx, sc, prefix, s, val);
 
-	if (verbose >= 3) {
-		printf ("Parsing dir '%s' ...\n", path_to_str (dir));
+	if (is_truthy (str_get (val))) {
+		str_reset (val);
+		str_putc (val, '0');
+	} else {
+		str_reset (val);
+		str_putc (val, '1');
 	}
+}
 
-	cline = 1;
-
-	for (; (s = readline (file, &cline)) != NULL; free (s)) {
-		run = walkifstack (ifstack, iflen);
-		if (s[0] == '#' && s[1] == '#') {
+enum compare_type {
+	COMP_EQ,
+	COMP_NE,
+	COMP_LT,
+	COMP_LE,
+	COMP_GT,
+	COMP_GE,
+};
+
+bool
+e_comp (pctx, sc, prefix, s)
+struct parse_ctx *pctx;
+struct scope *sc;
+const struct path *prefix;
+const char **s;
+{
+	str_t left, right;
+	const char *sl, *sr;
+	char *el, *er;
+	long il, ir;
+	enum compare_type cmp;
+	int x, icmp;
+
+	str_new (&left);
+	e_unary (pctx, sc, prefix, s, &left);
+
+	skip_ws (s);
+
+	if (starts_with (*s, "==")) {
+		cmp = COMP_EQ;
+		*s += 2;
+	} else if (starts_with (*s, "!=")) {
+		cmp = COMP_NE;
+		*s += 2;
+	} else if (**s == '<') {
+		++*s;
+		if (**s == '=') {
+			cmp = COMP_LE;
+			++*s;
+		} else {
+			cmp = COMP_LT;
+		}
+	} else if (**s == '>') {
+		++*s;
+		if (**s == '=') {
+			cmp = COMP_GE;
+			++*s;
+		} else {
+			cmp = COMP_GT;
+		}
+	} else {
+		str_trim (&left);
+		x = is_truthy (str_get (&left));
+		str_free (&left);
+		return x;
+	}
+
+	skip_ws (s);
+	str_new (&right);
+	e_unary (pctx, sc, prefix, s, &right);
+
+	str_trim (&left);
+	str_trim (&right);
+
+	sl = str_get (&left);
+	sr = str_get (&right);
+	il = strtol (sl, &el, 0);
+	ir = strtol (sr, &er, 0);
+	icmp = *sl != '\0' && *sr != '\0' && *el == '\0' && *er == '\0';
+	x = icmp ? il - ir : strcmp (sl, sr);
+	switch (cmp) {
+	case COMP_EQ:
+		x = x == 0;
+		break;
+	case COMP_NE:
+		x = x != 0;
+		break;
+	case COMP_LT:
+		x = x < 0;
+		break;
+	case COMP_LE:
+		x = x <= 0;
+		break;
+	case COMP_GT:
+		x = x > 0;
+		break;
+	case COMP_GE:
+		x = x >= 0;
+		break;
+	default:
+		abort ();
+	}
+	
+	str_free (&left);
+	str_free (&right);
+	return x;
+}
+
+bool
+e_and (pctx, sc, prefix, s)
+struct parse_ctx *pctx;
+struct scope *sc;
+const struct path *prefix;
+const char **s;
+{
+	int x;
+
+	x = e_comp (pctx, sc, prefix, s);
+	while (skip_ws (s), starts_with (*s, "&&")) {
+		*s += 2;
+		x &= e_comp (pctx, sc, prefix, s);
+	}
+
+	return x;
+}
+
+bool
+e_or (pctx, sc, prefix, s)
+struct parse_ctx *pctx;
+struct scope *sc;
+const struct path *prefix;
+const char **s;
+{
+	int x;
+
+	x = e_and (pctx, sc, prefix, s);
+	while (skip_ws (s), starts_with (*s, "||")) {
+		*s += 2;
+		x |= e_and (pctx, sc, prefix, s);
+	}
+
+	return x;
+}
+
+bool
+parse_expr (pctx, sc, prefix, s)
+struct parse_ctx *pctx;
+struct scope *sc;
+const struct path *prefix;
+const char *s;
+{
+	return e_or (pctx, sc, prefix, &s);
+}
+
+/* PARSE CACHE */
+
+/*
+ * With -c, the result of parsing a makefile (struct directory) is kept in
+ * `.mkcache`, next to the build state, together with everything the parse
+ * looked at: the contents of the makefile and its includes, the environment
+ * variables read by `??=`, the output of `!=` commands, the command line
+ * and the parent scope.  The commands are run again before a parse is
+ * restored, after everything else was checked.
+ */
+
+#define PCACHE_MAGIC	"MKPC"
+#define PCACHE_VERSION	2
+
+enum pcdep_kind {
+	PD_FILE,
+	PD_ENV,
+	PD_CMD,
+};
+
+/* something a parse depended on */
+struct pcdep {
+	struct pcdep	*next;
+	enum pcdep_kind	 kind;
+	char		*name;		/* PD_CMD: the expanded command */
+	char		*value;		/* PD_ENV: value, or NULL if unset; PD_CMD: shell */
+	char		*cwd;		/* PD_CMD */
+	unsigned long	 hash, size;	/* PD_FILE: contents; PD_CMD: output */
+	bool		 exists;	/* PD_FILE */
+};
+
+/* a cached parse of a scope, as seen from a certain directory */
+struct pcentry {
+	struct pcentry	*next;
+	char		*key;
+	unsigned long	 gfp, pfp, fp;	/* fingerprints: global, parent, own */
+	struct pcdep	*deps;
+	char		*blob;		/* the serialized struct directory */
+	size_t		 len;
+};
+
+static struct pcentry *pc_list = NULL;
+static struct pcdep **pc_rec = NULL;
+static char *pc_path = NULL;
+static unsigned long pc_gfp;
+static bool pc_on = false, pc_dirty = false;
+
+/* the environment variables read by the parses of a daemon, see serve_one() */
+static struct pcdep *serve_env = NULL;
+
+void
+str_u32 (s, x)
+str_t *s;
+unsigned long x;
+{
+	str_putc (s, (int)(x & 0xff));
+	str_putc (s, (int)((x >> 8) & 0xff));
+	str_putc (s, (int)((x >> 16) & 0xff));
+	str_putc (s, (int)((x >> 24) & 0xff));
+}
+
+void
+str_pstr (s, t)
+str_t *s;
+const char *t;
+{
+	size_t len;
+
+	len = strlen (t);
+	str_u32 (s, (unsigned long)len);
+	str_write (s, t, len);
+}
+
+/* an optional string */
+void
+str_popt (s, t)
+str_t *s;
+const char *t;
+{
+	str_u32 (s, t != NULL);
+	if (t != NULL)
+		str_pstr (s, t);
+}
+
+int
+sb_opt (b, s)
+struct sbuf *b;
+char **s;
+{
+	unsigned long x;
+
+	if (sb_u32 (b, &x) != 0)
+		return -1;
+	if (x == 0) {
+		*s = NULL;
+		return 0;
+	}
+	*s = sb_str (b);
+	return *s != NULL ? 0 : -1;
+}
+
+/* record that the current parse read the file `path`, which has `hash` */
+void
+pc_dep_file (path, exists, hash, len)
+const char *path;
+bool exists;
+unsigned long hash;
+size_t len;
+{
+	struct pcdep *d;
+
+	if (pc_rec == NULL)
+		return;
+
+	d = new (struct pcdep);
+	d->kind = PD_FILE;
+	d->name = strdup (path);
+	d->exists = exists;
+	d->hash = hash;
+	d->size = (unsigned long)len;
+	d->next = *pc_rec;
+	*pc_rec = d;
+}
+
+/* record that the current parse ran `cmd` in `cwd`, which printed `out` */
+void
+pc_dep_cmd (shell, cmd, cwd, out, len)
+const char *shell, *cmd, *cwd, *out;
+size_t len;
+{
+	struct pcdep *d;
+
+	if (pc_rec == NULL)
+		return;
+
+	d = new (struct pcdep);
+	d->kind = PD_CMD;
+	d->name = strdup (cmd);
+	d->value = strdup (shell);
+	d->cwd = strdup (cwd);
+	d->hash = fnv_update (FNV_INIT, out, len);
+	d->size = (unsigned long)len;
+	d->next = *pc_rec;
+	*pc_rec = d;
+}
+
+/* remember that the tree a daemon serves depends on the variable `name` */
+void
+serve_dep_env (name, value)
+const char *name, *value;
+{
+	struct pcdep *d;
+
+	d = new (struct pcdep);
+	d->kind = PD_ENV;
+	d->name = strdup (name);
+	d->value = value != NULL ? strdup (value) : NULL;
+	d->next = serve_env;
+	serve_env = d;
+}
+
+/* record that the current parse read the environment variable `name` */
+void
+pc_dep_env (name, value)
+const char *name, *value;
+{
+	struct pcdep *d;
+
+	if (serve_mode)
+		serve_dep_env (name, value);
+
+	if (pc_rec == NULL)
+		return;
+
+	d = new (struct pcdep);
+	d->kind = PD_ENV;
+	d->name = strdup (name);
+	d->value = value != NULL ? strdup (value) : NULL;
+	d->next = *pc_rec;
+	*pc_rec = d;
+}
+
+/* is `d` still what the parse saw? */
+bool
+pc_dep_valid (d)
+const struct pcdep *d;
+{
+	unsigned long hash, size;
+	const char *v;
+	str_t out;
+	bool ok;
+
+	switch (d->kind) {
+	case PD_FILE:
+		if (hash_file (d->name, &hash, &size) != 0)
+			return !d->exists;
+		return d->exists && hash == d->hash && size == d->size;
+	case PD_ENV:
+		v = getenv (d->name);
+		if (v == NULL || d->value == NULL)
+			return v == d->value;
+		return strcmp (v, d->value) == 0;
+	case PD_CMD:
+		str_new (&out);
+		ok = shell_output (&out, d->value, d->name, d->cwd) == 0
+		    && out.len == d->size && fnv_update (FNV_INIT, str_get (&out), out.len) == d->hash;
+		str_free (&out);
+		if (!ok && verbose >= 2)
+			printf ("parse cache: the output of '%s' changed\n", d->name);
+		return ok;
+	}
+
+	abort ();
+}
+
+unsigned long
+pc_fnv_u32 (h, x)
+unsigned long h, x;
+{
+	unsigned char b[4];
+
+	b[0] = x & 0xff;
+	b[1] = (x >> 8) & 0xff;
+	b[2] = (x >> 16) & 0xff;
+	b[3] = (x >> 24) & 0xff;
+	return fnv_update (h, (const char *)b, 4);
+}
+
+/* the fingerprint of a parse, which the parses of subdirectories depend on */
+unsigned long
+pc_fingerprint (e)
+const struct pcentry *e;
+{
+	const struct pcdep *d;
+	unsigned long h;
+
+	h = pc_fnv_u32 (pc_fnv_u32 (FNV_INIT, e->gfp), e->pfp);
+	h = fnv_update (h, e->key, strlen (e->key) + 1);
+	for (d = e->deps; d != NULL; d = d->next) {
+		h = fnv_update (h, d->name, strlen (d->name) + 1);
+		if (d->kind == PD_FILE) {
+			h = pc_fnv_u32 (pc_fnv_u32 (pc_fnv_u32 (h, d->exists), d->hash), d->size);
+		} else if (d->kind == PD_CMD) {
+			h = fnv_update (h, d->value, strlen (d->value) + 1);
+			h = fnv_update (h, d->cwd, strlen (d->cwd) + 1);
+			h = pc_fnv_u32 (pc_fnv_u32 (h, d->hash), d->size);
+		} else if (d->value != NULL) {
+			h = fnv_update (h, d->value, strlen (d->value) + 1);
+		}
+	}
+	return h;
+}
+
+/* load `.mkcache` from the top of the tree, at the first parse */
+void
+pcache_load (top)
+const struct path *top;
+{
+	struct pcentry *e, **tail;
+	struct pcdep *d, **dtail;
+	struct sbuf b;
+	unsigned long ver, n, nd, x;
+	size_t len;
+	char *data;
+
+	if (pc_path != NULL)
+		return;
+
+	if (objdir != NULL) {
+		pc_path = xstrcat (objdir, "/.mkcache");
+	} else {
+		pc_path = path_join (top, ".mkcache");
+	}
+
+	pc_gfp = FNV_INIT;
+	pc_gfp = fnv_update (pc_gfp, m_make.value, strlen (m_make.value) + 1);
+	pc_gfp = fnv_update (pc_gfp, m_makeflags.value, strlen (m_makeflags.value) + 1);
+	if (objdir != NULL)
+		pc_gfp = fnv_update (pc_gfp, objdir, strlen (objdir) + 1);
+
+	data = read_file (pc_path, &len);
+	if (data == NULL)
+		return;
+
+	b.p = (const unsigned char *)data;
+	b.end = b.p + len;
+	if (len < 4 || memcmp (data, PCACHE_MAGIC, 4) != 0)
+		goto corrupt;
+	b.p += 4;
+	if (sb_u32 (&b, &ver) != 0 || ver != PCACHE_VERSION || sb_u32 (&b, &n) != 0)
+		goto corrupt;
+
+	tail = &pc_list;
+	for (; n > 0; --n) {
+		e = new (struct pcentry);
+		*tail = e;
+		tail = &e->next;
+		if ((e->key = sb_str (&b)) == NULL)
+			goto corrupt;
+		if (sb_u32 (&b, &e->gfp) != 0 || sb_u32 (&b, &e->pfp) != 0 || sb_u32 (&b, &e->fp) != 0)
+			goto corrupt;
+		if (sb_u32 (&b, &nd) != 0)
+			goto corrupt;
+		for (dtail = &e->deps; nd > 0; --nd) {
+			d = new (struct pcdep);
+			*dtail = d;
+			dtail = &d->next;
+			if (sb_u32 (&b, &x) != 0 || (d->name = sb_str (&b)) == NULL)
+				goto corrupt;
+			d->kind = x;
+			if (d->kind == PD_FILE) {
+				if (sb_u32 (&b, &x) != 0 || sb_u32 (&b, &d->hash) != 0 || sb_u32 (&b, &d->size) != 0)
+					goto corrupt;
+				d->exists = x != 0;
+			} else if (d->kind == PD_ENV) {
+				if (sb_opt (&b, &d->value) != 0)
+					goto corrupt;
+			} else if (d->kind == PD_CMD) {
+				if ((d->value = sb_str (&b)) == NULL || (d->cwd = sb_str (&b)) == NULL)
+					goto corrupt;
+				if (sb_u32 (&b, &d->hash) != 0 || sb_u32 (&b, &d->size) != 0)
+					goto corrupt;
+			} else {
+				goto corrupt;
+			}
+		}
+
+		if (sb_u32 (&b, &x) != 0 || (unsigned long)(b.end - b.p) < x)
+			goto corrupt;
+		e->len = x;
+		e->blob = newa (x + 1, char);
+		memcpy (e->blob, b.p, x);
+		b.p += x;
+	}
+
+	free (data);
+	return;
+
+corrupt:
+	warnx ("%s: corrupt parse cache, ignoring", pc_path);
+	pc_list = NULL;
+	free (data);
+}
+
+void
+pcache_save ()
+{
+	struct pcentry *e;
+	struct pcdep *d;
+	unsigned long n;
+	FILE *file;
+	str_t tmp;
+
+	if (!pc_dirty || pc_path == NULL)
+		return;
+
+	str_new (&tmp);
+	str_puts (&tmp, pc_path);
+	str_puts (&tmp, ".tmp");
+
+	file = fopen (str_get (&tmp), "wb");
+	if (file == NULL) {
+		warn ("fopen('%s')", str_get (&tmp));
+		str_free (&tmp);
+		return;
+	}
+
+	fwrite (PCACHE_MAGIC, 1, 4, file);
+	put_u32 (file, PCACHE_VERSION);
+
+	for (n = 0, e = pc_list; e != NULL; e = e->next)
+		++n;
+	put_u32 (file, n);
+
+	for (e = pc_list; e != NULL; e = e->next) {
+		put_str (file, e->key);
+		put_u32 (file, e->gfp);
+		put_u32 (file, e->pfp);
+		put_u32 (file, e->fp);
+
+		for (n = 0, d = e->deps; d != NULL; d = d->next)
+			++n;
+		put_u32 (file, n);
+
+		for (d = e->deps; d != NULL; d = d->next) {
+			put_u32 (file, d->kind);
+			put_str (file, d->name);
+			if (d->kind == PD_FILE) {
+				put_u32 (file, d->exists);
+				put_u32 (file, d->hash);
+				put_u32 (file, d->size);
+			} else if (d->kind == PD_CMD) {
+				put_str (file, d->value);
+				put_str (file, d->cwd);
+				put_u32 (file, d->hash);
+				put_u32 (file, d->size);
+			} else {
+				put_u32 (file, d->value != NULL);
+				if (d->value != NULL)
+					put_str (file, d->value);
+			}
+		}
+
+		put_u32 (file, (unsigned long)e->len);
+		fwrite (e->blob, 1, e->len, file);
+	}
+
+	if (ferror (file) | fclose (file)) {
+		warnx ("%s: failed to write the parse cache", str_get (&tmp));
+	} else if (rename (str_get (&tmp), pc_path) != 0) {
+		warn ("rename('%s')", pc_path);
+	}
+
+	str_free (&tmp);
+	pc_dirty = false;
+}
+
+/* the key of a parse: the scope, and where it is seen from */
+char *
+pc_key (sc, dir)
+const struct scope *sc;
+const struct path *dir;
+{
+	str_t key;
+
+	str_new (&key);
+	sc_path_into (&key, sc);
+	str_putc (&key, ' ');
+	str_puts (&key, path_str (dir));
+	return str_release (&key);
+}
+
+struct pcentry *
+pcache_find (key)
+const char *key;
+{
+	struct pcentry *e;
+
+	for (e = pc_list; e != NULL; e = e->next) {
+		if (strcmp (e->key, key) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+/* forget the entry `e`, and write the cache without it */
+void
+pcache_drop (e)
+struct pcentry *e;
+{
+	struct pcentry **pp;
+
+	for (pp = &pc_list; *pp != NULL; pp = &(*pp)->next) {
+		if (*pp == e) {
+			*pp = e->next;
+			break;
+		}
+	}
+	pc_dirty = true;
+}
+
+unsigned long
+pc_parent_fp (sc)
+const struct scope *sc;
+{
+	if (sc->parent == NULL || sc->parent->type != SC_DIR || sc->parent->inner.dir == NULL)
+		return 0;
+	return sc->parent->inner.dir->fp;
+}
+
+/* PARSER */
+
+/*
+ * A makefile, read in one go; lines are split off in place.
+ * If `lines` is set, that was already done by the read-ahead.
+ */
+struct reader {
+	char	*p, *end;
+	char	**lines;
+	int	*nls;		/* newlines in each of `lines` */
+	unsigned char *kinds;	/* enum line_kind of each of `lines` */
+	int	*args;		/* offset of the argument in each of `lines` */
+	size_t	 i, n;
+};
+
+/*
+ * Return the next line of `rd`, with backslash-newline sequences removed,
+ * or NULL at the end.  The line is a view into the buffer of `rd`,
+ * which is modified for that.  `*ln` is incremented for every newline.
+ */
+char *
+readline (rd, ln)
+struct reader *rd;
+int *ln;
+{
+	char *line, *out, *p, *q, *b;
+	size_t n;
+
+	if (rd->lines != NULL) {
+		if (rd->i == rd->n)
+			return NULL;
+		*ln += rd->nls[rd->i];
+		return rd->lines[rd->i++];
+	}
+
+	if (rd->p >= rd->end)
+		return NULL;
+
+	line = out = p = rd->p;
+	for (;;) {
+		q = memchr (p, '\n', rd->end - p);
+		if (q == NULL)
+			q = rd->end;
+
+		/* a backslash escapes the next character, so count them */
+		for (b = q; b > p && b[-1] == '\\'; --b);
+		n = (q - p) - ((q - b) & 1 && q != rd->end);
+
+		if (out != p)
+			memmove (out, p, n);
+		out += n;
+
+		if (q == rd->end) {
+			p = q;
+			break;
+		}
+
+		++*ln;
+		p = q + 1;
+		if (((q - b) & 1) == 0)
+			break;
+	}
+
+	*out = '\0';
+	rd->p = p;
+	return line;
+}
+
+/* split all of `rd` into lines now; readline() then returns those */
+void
+split_lines (rd)
+struct reader *rd;
+{
+	size_t n = 0, cap = 64;
+	char **lines, *s;
+	int *nls, ln;
+
+	rd->lines = NULL;
+	rd->kinds = NULL;
+	rd->args = NULL;
+	lines = newa (cap, char *);
+	nls = newa (cap, int);
+	for (;;) {
+		ln = 0;
+		if ((s = readline (rd, &ln)) == NULL)
+			break;
+		if (n == cap) {
+			cap *= 2;
+			lines = renew (lines, cap, char *);
+			nls = renew (nls, cap, int);
+		}
+		lines[n] = s;
+		nls[n] = ln;
+		++n;
+	}
+
+	rd->lines = lines;
+	rd->nls = nls;
+	rd->i = 0;
+	rd->n = n;
+}
+
+struct scope *
+new_subdir (parent, name)
+struct scope *parent;
+const char *name;
+{
+	struct directory *pdir;
+	struct scope *sub;
+	
+	assert (name != NULL);
+
+	pdir = sc_dir (parent);
+
+	sub = pool_new (&scope_pool, struct scope);
+	sub->type = SC_DIR;
+	sub->name = intern (name);
+	sub->parent = parent;
+	sub->makefile = NULL;
+	sub->created = false;
+	SLIST_INSERT_HEAD (&pdir->subdirs, sub, next);
+
+	return sub;
+}
+
+struct macro *
+new_macro (name, value, help, lazy, prepend)
+const char	*name;
+char		*value, *help;
+struct macro	*prepend;
+bool		 lazy;
+{
+	struct macro *m;
+	const char *s;
+
+	assert (name != NULL);
+	assert (value != NULL);
+
+	/* check name */
+	if (*name == '\0')
+		errx (1, "new_macro(): macro name is empty");
+
+	for (s = name; *s != '\0'; ++s) {
+		if (!ismname (*s))
+			errx (1, "invalid macro name: '%s'", name);
+	}
+
+	m = pool_new (&macro_pool, struct macro);
+	/* SLIST_ENTRY fields are zeroed by the pool; set explicitly for clarity */
+	m->next.sle_next = NULL;
+	m->enext.sle_next = NULL;
+	m->prepend = prepend;
+	m->name = intern (name);
+	m->value = value;
+	m->help = help;
+	m->lazy = lazy;
+
+	return m;
+}
+
+struct file *
+new_file (name, rule, time, deps, help, inf, obj)
+const char		*name;
+char			*help;
+struct rule		*rule;
+struct timespec		 time;
+struct dep_list		*deps;
+struct inference	*inf;
+bool			 obj;
+{
+	struct file *f;
+
+	assert (name != NULL);
+
+	f = pool_new (&file_pool, struct file);
+	/* `deps` is moved into `f` */
+	if (deps != NULL)
+		f->deps = *deps;
+	else
+		f->deps.a = NULL;
+	f->name = intern (name);
+	f->rule = rule;
+	f->mtime = time;
+	f->ltime = time;
+	f->help = help;
+	f->inf = inf;
+	f->obj = obj;
+	f->err = false;
+
+	return f;
+}
+
+/* make `dl` the only owner of its array, with room for `n` more deps */
+void
+dl_own (dl, n)
+struct dep_list *dl;
+size_t n;
+{
+	struct dep_array *a = dl->a, *b;
+	size_t len, cap;
+
+	len = dl_len (dl);
+	cap = a != NULL ? a->cap : 0;
+	if (a != NULL && a->refs == 1 && len + n <= cap)
+		return;
+
+	if (cap < len + n)
+		for (cap = cap ? cap * 2 : 4; cap < len + n; cap *= 2);
+
+	if (a != NULL && a->refs == 1) {
+		a = realloc (a, sizeof (struct dep_array) + (cap - 1) * sizeof (struct dep));
+		if (a == NULL)
+			err (1, "realloc()");
+		a->cap = cap;
+		dl->a = a;
+		return;
+	}
+
+	b = malloc (sizeof (struct dep_array) + (cap - 1) * sizeof (struct dep));
+	if (b == NULL)
+		err (1, "malloc()");
+	b->refs = 1;
+	b->n = len;
+	b->cap = cap;
+	if (a != NULL) {
+		memcpy (b->v, a->v, len * sizeof (struct dep));
+		--a->refs;
+	}
+	dl->a = b;
+}
+
+void
+dl_free (dl)
+struct dep_list *dl;
+{
+	if (dl->a != NULL && --dl->a->refs == 0)
+		free (dl->a);
+	dl->a = NULL;
+}
+
+/* append a dep on `path`, which must be interned */
+void
+dl_add (dl, path)
+struct dep_list *dl;
+struct path *path;
+{
+	struct dep *d;
+
+	assert (path != NULL);
+
+	dl_own (dl, 1);
+	d = &dl->a->v[dl->a->n++];
+	d->path = path;
+	d->obj = false;
+}
+
+/* insert a dep on `path` in front */
+void
+dl_prepend (dl, path)
+struct dep_list *dl;
+struct path *path;
+{
+	struct dep_array *a;
+
+	dl_own (dl, 1);
+	a = dl->a;
+	memmove (a->v + 1, a->v, a->n * sizeof (struct dep));
+	a->v[0].path = path;
+	a->v[0].obj = false;
+	++a->n;
+}
+
+/* append the deps of `src` to `dl`; if `dl` has none, it shares them */
+void
+dl_append (dl, src)
+struct dep_list *dl;
+const struct dep_list *src;
+{
+	size_t n = dl_len (src);
+
+	if (n == 0)
+		return;
+
+	if (dl->a == NULL) {
+		dl->a = src->a;
+		++dl->a->refs;
+		return;
+	}
+
+	dl_own (dl, n);
+	memcpy (dl->a->v + dl->a->n, src->a->v, n * sizeof (struct dep));
+	dl->a->n += n;
+}
+
+/* the interned path of the file `name` */
+struct path *
+path_name (name)
+const char *name;
+{
+	struct path p;
+
+	assert (name != NULL);
+
+	p.type = PATH_NAME;
+	p.name = intern (name);
+	return path_intern (&p, (size_t)1);
+}
+
+void
+dir_add_file (dir, f)
+struct directory *dir;
+struct file *f;
+{
+	struct fslot *tab;
+	size_t i, j, cap;
+
+	if (dir->nfiles == dir->cfiles) {
+		dir->cfiles = dir->cfiles ? dir->cfiles * 2 : 16;
+		dir->files = renew (dir->files, dir->cfiles, struct file *);
+	}
+	dir->files[dir->nfiles++] = f;
+
+	/* keep the index at most half full */
+	if ((dir->nnames + 1) * 2 > dir->fcap) {
+		cap = dir->fcap ? dir->fcap * 2 : 64;
+		tab = newa (cap, struct fslot);
+		for (i = 0; i < dir->fcap; ++i) {
+			if (dir->ftab[i].name == NULL)
+				continue;
+			j = intern_hash (dir->ftab[i].name) & (cap - 1);
+			while (tab[j].name != NULL)
+				j = (j + 1) & (cap - 1);
+			tab[j] = dir->ftab[i];
+		}
+		free (dir->ftab);
+		dir->ftab = tab;
+		dir->fcap = cap;
+	}
+
+	i = intern_hash (f->name) & (dir->fcap - 1);
+	while (dir->ftab[i].name != NULL && dir->ftab[i].name != f->name)
+		i = (i + 1) & (dir->fcap - 1);
+	if (dir->ftab[i].name == NULL)
+		++dir->nnames;
+	dir->ftab[i].name = f->name;
+	dir->ftab[i].file = f;
+}
+
+/* define `m` in `dir`, hiding earlier definitions of the same name */
+void
+dir_add_macro (dir, m)
+struct directory *dir;
+struct macro *m;
+{
+	SLIST_INSERT_HEAD (&dir->macros, m, next);
+	mt_put (&dir->mtab, m->name)->m = m;
+	++dir->mgen;
+}
+
+/* export `m` from `dir` */
+void
+dir_export_macro (dir, m)
+struct directory *dir;
+struct macro *m;
+{
+	SLIST_INSERT_HEAD (&dir->emacros, m, enext);
+	mt_put (&dir->etab, m->name)->m = m;
+	++dir->mgen;
+}
+
+/*
+ * file_add_deps: append dep_list src onto the end of file->deps.
+ * src is left empty afterwards.
+ */
+void
+file_add_deps (file, src)
+struct file *file;
+struct dep_list *src;
+{
+	dl_append (&file->deps, src);
+	dl_free (src);
+}
+
+/* parse the prerequisites of `f` that lazy_rule() put off */
+void
+file_force (f)
+struct file *f;
+{
+	struct lazydeps *l;
+	struct dep_list deps;
+	char *p, *v;
+	size_t n;
+
+	l = f->lazy;
+	f->lazy = NULL;
+	for (; l != NULL; l = l->next) {
+		for (n = 0, p = l->text; *p != '\0'; ++p) {
+			if ((p == l->text || p[-1] == ' ' || p[-1] == '\t') && *p != ' ' && *p != '\t')
+				++n;
+		}
+
+		deps.a = NULL;
+		if (n > 0)
+			dl_own (&deps, n);
+		v = l->text;
+		while ((p = strsep (&v, " \t")) != NULL) {
+			if (*p == '\0')
+				continue;
+			dl_add (&deps, parse_path (p));
+		}
+		file_add_deps (f, &deps);
+	}
+}
+
+void
+foreign_remember (sc, name, t, obj)
+struct scope	*sc;
+const char	*name;
+struct timespec	 t;
+bool		 obj;
+{
+	struct cbuilt *b;
+
+	b = new (struct cbuilt);
+	b->name = strdup (name != NULL ? name : "");
+	b->t = t;
+	b->obj = obj;
+	SLIST_INSERT_HEAD (&sc_foreign (sc)->built, b, next);
+}
+
+char *
+strip_comment (s)
+char *s;
+{
+	char *t, *o = s;
+
+	while ((t = strchr (s, '#')) != NULL) {
+		if (t == o || isspace (t[-1])) {
+			*t = '\0';
+			break;
+		}
+		s = t + 1;
+	}
+
+	return o;
+}
+
+/* .SUBDIRS: cc make sys # comment */
+void
+parse_subdirs (pctx, sc, dir, s)
+struct parse_ctx *pctx;
+struct scope *sc;
+const struct path *dir;
+char *s;
+{
+	struct scope *sub;
+	char *subdir;
+	const char *name;
+	char *path;
+
+	strip_comment (s);
+
+	while ((subdir = strsep (&s, " \t")) != NULL) {
+		if (*subdir == '\0')
+			continue;
+
+		name = trim (subdir);
+		sub = new_subdir (sc, name);
+		sub->type = SC_DIR;
+		sub->makefile = MAKEFILE;
+
+		path = path_join (dir, sub->name);
+		if (access (path, F_OK) != 0)
+			errx (1, "%s:%d: directory not found: %s", pctx->path, pctx->line, sub->name);
+		free (path);
+	}
+}
+
+/* .FOREIGN: libfoo libbar # comment */
+void
+parse_foreign (sc, s)
+struct scope *sc;
+char *s;
+{
+	struct foreign *cs;
+	struct scope *sub;
+	const char *name;
+	char *subdir;
+
+	strip_comment (s);
+
+	while ((subdir = strsep (&s, " \t")) != NULL) {
+		if (*subdir == '\0')
+			continue;
+
+		name = trim (subdir);
+		sub = new_subdir (sc, name);
+		sub->type = SC_FOREIGN;
+		sub->makefile = NULL;
+		cs = new (struct foreign);
+		cs->test = NULL;
+		cs->exec = NULL;
+		cs->deps.a = NULL;
+		SLIST_INIT (&cs->built);
+		sub->inner.foreign = cs;
+	}
+}
+
+/* .EXPORTS: CC CFLAGS # comment */
+void
+parse_exports (pctx, sc, s)
+struct parse_ctx *pctx;
+struct scope *sc;
+char *s;
+{
+	struct macro *m;
+	const char *name;
+
+	strip_comment (s);
+
+	while ((name = strsep (&s, " \t")) != NULL) {
+		if (*name == '\0')
+			continue;
+
+		m = find_macro (sc, name);
+		if (m == NULL)
+			errx (1, "%s:%d: no such macro: '%s'", pctx->path, pctx->line, name);
+
+		/* skip a macro that is already exported */
+		if (mt_get (&sc_dir (sc)->etab, m->name) == NULL)
+			dir_export_macro (sc_dir (sc), m);
+	}
+}
+
+/* .RESTAT: gen.h .y.c # comment */
+void
+parse_attrs (sc, s, flags)
+struct scope *sc;
+char *s;
+int flags;
+{
+	struct attr *a;
+	const char *name;
+
+	strip_comment (s);
+
+	while ((name = strsep (&s, " \t")) != NULL) {
+		if (*name == '\0')
+			continue;
+
+		SLIST_FOREACH (a, &sc_dir (sc)->attrs, next) {
+			if (strcmp (a->name, name) == 0)
+				break;
+		}
+
+		if (a == NULL) {
+			a = new (struct attr);
+			a->name = strdup (name);
+			a->flags = 0;
+			SLIST_INSERT_HEAD (&sc_dir (sc)->attrs, a, next);
+		}
+
+		a->flags |= flags;
+	}
+}
+
+bool
+try_add_foreign (sc, f)
+struct scope *sc;
+struct file *f;
+{
+	struct scope *sub;
+	char *name;
+	size_t len;
+	int ch;
+
+	len = strlen (f->name);
+	ch = f->name[len - 1];
+	if (ch != '?' && ch != '!')
+		return false;
+
+	name = strdup (f->name);
+	name[len - 1] = '\0';
+	sub = find_subdir (sc, name);
+	if (sub == NULL)
+		errx (1, "%s: not a subdir: %s", sc_path (sc), name);
+
+	if (sub->type != SC_FOREIGN)
+		errx (1, "%s: not a foreign subdir: %s", sc_path (sc), name);
+
+	if (ch == '?') {
+		sub->inner.foreign->test = f;
+	} else {
+		sub->inner.foreign->exec = f;
+	}
+
+	free (name);
+	return true;
+}
+
+/*
+ * If 'name' is the bare name of an SC_FOREIGN subdir, append 'dhead..dtail'
+ * to its ordering dep list and return true.  The rule (if any) must be
+ * empty; if the caller supplied commands, we error out.
+ */
+bool
+try_add_foreign_deps (sc, name, src)
+struct scope *sc;
+const char *name;
+struct dep_list *src;
+{
+	struct scope *sub;
+	struct foreign *cs;
+
+	sub = find_subdir (sc, name);
+	if (sub == NULL || sub->type != SC_FOREIGN)
+		return false;
+
+	if (dl_len (src) == 0)
+		return true;
+
+	cs = sc_foreign (sub);
+	dl_append (&cs->deps, src);
+	dl_free (src);
+	return true;
+}
+
+/* TODO: impl .SUFFIXES: */
+bool
+is_inf (s)
+char *s;
+{
+	char *d;
+	int x;
+
+	if (*s != '.')
+		return 0;
+	++s;
+	d = strchr (s, '.');
+
+	if (d == NULL) {
+		return strlen (s) <= 3;
+	}
+
+	*d = '\0';
+	x = strlen (s) <= 3 && strlen (d + 1) <= 3;
+	*d = '.';
+	return x;
+}
+
+/*
+ * The header scan: a rule line for a single target, without macros, only
+ * defines the target and its recipe.  Its prerequisites are kept as text
+ * and parsed by find_file(), when the target is first looked up, so that
+ * a goal only pays for the rules that it reaches.  Returns false if the
+ * line must be parsed by parse_rule(), otherwise `*rp` is the rule that
+ * parse_rule() would have returned.
+ */
+bool
+lazy_rule (sc, s, t, help, rp)
+struct scope *sc;
+char *s, *t, *help;
+struct rule **rp;
+{
+	struct lazydeps *l, **tail;
+	struct rule *r;
+	struct file *f;
+	char *name, *e, *p;
+
+	for (name = s; *name == ' ' || *name == '\t'; ++name);
+	for (e = name; e < t && *e != ' ' && *e != '\t'; ++e) {
+		if (*e == '$' || *e == '/')
+			return false;
+	}
+	for (p = e; p < t; ++p) {
+		if (*p != ' ' && *p != '\t')
+			return false;
+	}
+
+	/* inference rules, special and foreign targets */
+	if (e == name || *name == '.' || e[-1] == '?' || e[-1] == '!')
+		return false;
+	if (strchr (t + 1, '$') != NULL)
+		return false;
+
+	*t = '\0';
+	*e = '\0';
+	if (find_subdir (sc, name) != NULL)
+		return false;
+
+	f = find_file_lazy (sc_dir (sc), name);
+	if (f == NULL) {
+		r = new (struct rule);
+		r->code = NULL;
+		r->progs = NULL;
+		f = new_file (name, r, time_zero, NULL, help, NULL, false);
+		dir_add_file (sc_dir (sc), f);
+		*rp = r;
+	} else {
+		if (f->help == NULL)
+			f->help = help;
+		*rp = NULL;
+	}
+
+	for (p = t + 1; *p == ' ' || *p == '\t'; ++p);
+	if (*p == '\0')
+		return true;
+
+	l = pool_new (&lazy_pool, struct lazydeps);
+	l->text = arena_strdup (&lazy_pool, p);
+	for (tail = &f->lazy; *tail != NULL; tail = &(*tail)->next);
+	*tail = l;
+	return true;
+}
+
+struct rule *
+parse_rule (sc, dir, s, t, help)
+struct scope *sc;
+const struct path *dir;
+char *s, *t, *help;
+{
+	struct inference *inf;
+	struct dep_list deps, cdeps;
+	struct rule *r;
+	struct file *f;
+	struct file **seen;
+	char *u, *v, *p;
+	size_t i, nseen, cseen;
+	int flag;
+
+	r = new (struct rule);
+	r->code = NULL;
+	r->progs = NULL;
+	deps.a = NULL;
+
+	*t = '\0';
+
+	/* parse deps, into an array of the right size */
+	v = u = expand (sc, dir, t + 1, NULL);
+	for (i = 0, p = u; *p != '\0'; ++p) {
+		if ((p == u || p[-1] == ' ' || p[-1] == '\t') && *p != ' ' && *p != '\t')
+			++i;
+	}
+	if (i > 0)
+		dl_own (&deps, i);
+	while ((p = strsep (&v, " \t")) != NULL) {
+		if (*p == '\0')
+			continue;
+		dl_add (&deps, parse_path (p));
+	}
+	free (u);
+
+	/* parse targets */
+	u = expand (sc, dir, s, NULL);
+	flag = 0;
+	if (is_inf (u)) {
+		p = strchr (u + 1, '.');
+		inf = new (struct inference);
+		inf->rule = r;
+		inf->deps = deps;
+		deps.a = NULL;
+
+		if (p != NULL) {
+			*p = '\0';
+			inf->from = strdup (u);
+			*p = '.';
+			inf->to = strdup (p);
+		} else {
+			inf->from = strdup (u);
+			inf->to = "";
+		}
+
+		SLIST_INSERT_HEAD (&sc_dir (sc)->infs, inf, next);
+		flag = 1;
+	} else {
+		seen = NULL;
+		nseen = cseen = 0;
+		v = u;
+		while ((p = strsep (&v, " \t")) != NULL) {
+
+			if (*p == '\0')
+				continue;
+			/* TODO: check name */
+
+			f = find_file (sc_dir (sc), p);
+
+			/* skip duplicate targets on the same rule line */
+			if (f != NULL) {
+				for (i = 0; i < nseen; ++i) {
+					if (seen[i] == f)
+						break;
+				}
+				if (i != nseen)
+					continue;
+			}
+
+			/* the targets of the line share its deps */
+			cdeps.a = NULL;
+			dl_append (&cdeps, &deps);
+
+			if (f == NULL && try_add_foreign_deps (sc, p, &cdeps)) {
+				flag = 1;
+				continue;
+			}
+
+			if (f == NULL) {
+				/* stat()ed by build_file(), if it is ever needed */
+				f = new_file (
+					/* name */ p,
+					/* rule */ r,
+					/* time */ time_zero,
+					/* deps */ &cdeps,
+					/* help */ help,
+					/* inf  */ NULL,
+					/* obj  */ false
+				);
+				/* TODO: maybe first do try_add_foreign()? */
+				dir_add_file (sc_dir (sc), f);
+				try_add_foreign (sc, f);
+				flag = 1;
+			} else {
+				if (f->help == NULL)
+					f->help = help;
+
+				file_add_deps (f, &cdeps);
+			}
+
+			if (nseen == cseen) {
+				cseen = cseen ? cseen * 2 : 4;
+				seen = renew (seen, cseen, struct file *);
+			}
+			seen[nseen++] = f;
+		}
+		free (seen);
+	}
+	dl_free (&deps);
+	free (u);
+	return flag ? r : NULL;
+}
+
+void
+parse_assign (pctx, sc, dir, s, t, help)
+struct parse_ctx	*pctx;
+struct scope		*sc;
+const struct path	*dir;
+char			*s, *t, *help;
+{
+	struct macro *m, *prepend = NULL;
+	char *value;
+	bool lazy;
+
+	if (t[-1] == '!') {
+		t[-1] = '\0';
+		lazy = false;
+		value = evalcom (pctx, sc, dir, trim (t + 1));
+	} else if (t[-1] == '?') {
+		/* handle both `?=` and `??=` */
+		if (s == (t - 1))
+			errx (1, "why are you doing this to me Davids?");
+
+		if (t[-2] == '?') {
+			t[-2] = '\0';
+			value = getenv (trim (s));
+			pc_dep_env (trim (s), value);
+			if (value == NULL) {
+				m = find_macro (sc, trim (s));
+				if (m != NULL)
+					value = m->value;
+			}
+			if (value == NULL)
+				value = strdup (trim (t + 1));
+		} else {
+			t[-1] = '\0';
+			m = find_macro (sc, trim (s));
+			value = m != NULL ? m->value : strdup (trim (t + 1));
+		}
+		lazy = true;
+	} else if (t[-1] == ':') {
+		/* handle both `:=` and `::=` */
+		if (s == (t - 1))
+			errx (1, "why are you doing this to me Davids, again?");
+		t[t[-2] == ':' ? -2 : -1] = '\0';
+		value = expand (sc, dir, trim (t + 1), NULL);
+		lazy = false;
+	} else if (t[-1] == '+') {
+		t[-1] = '\0';
+		value = strdup (trim (t + 1));
+		prepend = find_macro (sc, trim (s));
+		lazy = true;
+	} else {
+		value = strdup (trim (t + 1));
+		lazy = true;
+	}
+
+	m = new_macro (
+		/* name  */ trim (s),
+		/* value */ value,
+		/* help  */ help,
+		/* lazy  */ lazy,
+		/*prepend*/ prepend
+	);
+	dir_add_macro (sc_dir (sc), m);
+}
+
+
+#define IF_VAL 0x01
+#define IF_HAS 0x02
+#define MAX_IFSTACK 16
+
+bool
+walkifstack (s, n)
+const char *s;
+size_t n;
+{
+	size_t i;
+
+	for (i = 0; i < n; ++i) {
+		if (!(s[i] & IF_VAL))
+			return false;
+	}
+	return true;
+}
+
+bool
+is_directive (out, s, name)
+char **out, *s;
+const char *name;
+{
+	size_t len;
+
+	if (*s != '.')
+		return false;
+	++s;
+
+	skip_ws (&s);
+	len = strlen (name);
+	if (strncmp (s, name, len) != 0)
+		return false;
+
+	s += len;
+
+	if (*s != '\0' && !isspace (*s))
+		return false;
+
+	if (out != NULL)
+		*out = trim (s);
+	return true;
+}
+
+bool
+is_target (out, s, name)
+char **out, *s;
+const char *name;
+{
+	size_t len;
+
+	len = strlen (name);
+	if (strncmp (s, name, len) != 0)
+		return false;
+
+	s += len;
+	skip_ws (&s);
+	if (*s != ':')
+		return false;
+	++s;
+
+	if (out != NULL)
+		*out = trim (s);
+
+	return true;
+}
+
+char *
+parse_def (s, name, value)
+char *s, **name, **value;
+{
+	char *i;
+
+	for (i = s; *i != '\0'; ++i) {
+		switch (*i) {
+		case '$':
+			switch (*++i) {
+			case '\0':
+				return NULL;
+			case '{':
+				for (++i; *i != '\0' && *i != '}'; ++i);
+				if (*i != '}')
+					return NULL;
+				break;
+			default:
+				break;
+			}
+			break;
+		case ':':
+			if (i[1] == '=' || (i[1] == ':' && i[2] == '='))
+				break;
+			*name = s;
+			*value = i + 1;
+			return i;
+		case '=':
+			*name = s;
+			*value = i + 1;
+			return i;
+		}
+	}
+	return NULL;
+}
+
+/* what a line of a makefile is; only depends on the text of the line */
+enum line_kind {
+	LK_HELP,
+	LK_BLANK,
+	LK_INCLUDE,
+	LK_SINCLUDE,
+	LK_OLDINCLUDE,
+	LK_IF,
+	LK_ELSE,
+	LK_ELIF,
+	LK_ENDIF,
+	LK_TEMPLATE,
+	LK_EXPAND,
+	LK_DEFAULT,
+	LK_POSIX,
+	LK_SUFFIXES,
+	LK_SUBDIRS,
+	LK_FOREIGN,
+	LK_EXPORTS,
+	LK_RESTAT,
+	LK_DEPFILE,
+	LK_NOFOLLOW,
+	LK_RECIPE,
+	LK_DEF,
+	LK_INVALID,
+	LK_BODY,	/* inside a .template, not classified */
+};
+
+/*
+ * Classify the line `s`, and point `*out` at its argument, if any.
+ * This trims trailing whitespace off `s`, but changes nothing else.
+ */
+enum line_kind
+classify (s, out)
+char *s, **out;
+{
+	char *name, *value;
+
+	*out = NULL;
+	if (s[0] == '#' && s[1] == '#')
+		return LK_HELP;
+	if (s[0] == '#' || *trim (s) == '\0')
+		return LK_BLANK;
+	if (starts_with (s, "include "))
+		return LK_INCLUDE;
+	if (starts_with (s, "-include ") || starts_with (s, "sinclude "))
+		return LK_SINCLUDE;
+	if (is_directive (out, s, "include"))
+		return LK_OLDINCLUDE;
+	if (is_directive (out, s, "if"))
+		return LK_IF;
+	if (is_directive (NULL, s, "else"))
+		return LK_ELSE;
+	if (is_directive (out, s, "elif"))
+		return LK_ELIF;
+	if (is_directive (NULL, s, "endif"))
+		return LK_ENDIF;
+	if (is_directive (out, s, "template"))
+		return LK_TEMPLATE;
+	if (is_directive (out, s, "expand"))
+		return LK_EXPAND;
+	if (is_target (out, s, ".DEFAULT"))
+		return LK_DEFAULT;
+	if (is_target (NULL, s, ".POSIX"))
+		return LK_POSIX;
+	if (is_target (NULL, s, ".SUFFIXES"))
+		return LK_SUFFIXES;
+	if (is_target (out, s, ".SUBDIRS"))
+		return LK_SUBDIRS;
+	if (is_target (out, s, ".FOREIGN"))
+		return LK_FOREIGN;
+	if (is_target (out, s, ".EXPORTS"))
+		return LK_EXPORTS;
+	if (is_target (out, s, ".RESTAT"))
+		return LK_RESTAT;
+	if (is_target (out, s, ".DEPFILE"))
+		return LK_DEPFILE;
+	if (is_target (out, s, ".NOFOLLOW"))
+		return LK_NOFOLLOW;
+	if (s[0] == '\t')
+		return LK_RECIPE;
+	if ((*out = parse_def (s, &name, &value)) != NULL)
+		return LK_DEF;
+	return LK_INVALID;
+}
+
+bool
+is_endtemplate (s)
+char *s;
+{
+	return is_directive (NULL, s, "endt") || is_directive (NULL, s, "endtemplate");
+}
+
+/* classify all lines of `rd`, which must have been split already */
+void
+classify_lines (rd)
+struct reader *rd;
+{
+	size_t i;
+	char *t;
+	bool body = false;
+
+	rd->kinds = newa (rd->n + 1, unsigned char);
+	rd->args = newa (rd->n + 1, int);
+	for (i = 0; i < rd->n; ++i) {
+		if (body) {
+			rd->kinds[i] = LK_BODY;
+			rd->args[i] = -1;
+			body = !is_endtemplate (rd->lines[i]);
+			continue;
+		}
+
+		rd->kinds[i] = classify (rd->lines[i], &t);
+		rd->args[i] = t != NULL ? (int)(t - rd->lines[i]) : -1;
+		body = rd->kinds[i] == LK_TEMPLATE;
+	}
+}
+
+void
+reader_free (rd)
+struct reader *rd;
+{
+	free (rd->lines);
+	free (rd->nls);
+	free (rd->kinds);
+	free (rd->args);
+}
+
+/* keep a copy of `buf`, which was split and classified into `rd` */
+void
+pl_save (pl, rd, buf, len)
+struct plines *pl;
+const struct reader *rd;
+const char *buf;
+size_t len;
+{
+	size_t i;
+
+	pl->len = len;
+	pl->buf = newa (len + 1, char);
+	memcpy (pl->buf, buf, len + 1);
+	pl->n = rd->n;
+	pl->offs = newa (rd->n + 1, size_t);
+	pl->nls = newa (rd->n + 1, int);
+	pl->kinds = newa (rd->n + 1, unsigned char);
+	pl->args = newa (rd->n + 1, int);
+	for (i = 0; i < rd->n; ++i)
+		pl->offs[i] = rd->lines[i] - buf;
+	memcpy (pl->nls, rd->nls, rd->n * sizeof (int));
+	memcpy (pl->kinds, rd->kinds, rd->n);
+	memcpy (pl->args, rd->args, rd->n * sizeof (int));
+}
+
+/* set up `rd` to parse a fresh copy of `pl`, which is returned */
+char *
+pl_load (pl, rd)
+const struct plines *pl;
+struct reader *rd;
+{
+	char *buf;
+	size_t i;
+
+	buf = newa (pl->len + 1, char);
+	memcpy (buf, pl->buf, pl->len + 1);
+	rd->lines = newa (pl->n + 1, char *);
+	rd->nls = newa (pl->n + 1, int);
+	rd->kinds = newa (pl->n + 1, unsigned char);
+	rd->args = newa (pl->n + 1, int);
+	for (i = 0; i < pl->n; ++i)
+		rd->lines[i] = buf + pl->offs[i];
+	memcpy (rd->nls, pl->nls, pl->n * sizeof (int));
+	memcpy (rd->kinds, pl->kinds, pl->n);
+	memcpy (rd->args, pl->args, pl->n * sizeof (int));
+	rd->i = 0;
+	rd->n = pl->n;
+	rd->p = rd->end = buf + pl->len;
+	return buf;
+}
+
+void
+pl_free (pl)
+struct plines *pl;
+{
+	free (pl->buf);
+	free (pl->offs);
+	free (pl->nls);
+	free (pl->kinds);
+	free (pl->args);
+}
+
+/* split and classify the text of `tm` */
+struct plines *
+compile_template (tm)
+const struct template *tm;
+{
+	struct plines *pl;
+	struct reader rd;
+	char *buf;
+	size_t len;
+
+	len = strlen (tm->text);
+	buf = strdup (tm->text);
+	rd.p = buf;
+	rd.end = buf + len;
+	split_lines (&rd);
+	classify_lines (&rd);
+
+	pl = new (struct plines);
+	pl_save (pl, &rd, buf, len);
+	reader_free (&rd);
+	free (buf);
+	return pl;
+}
+
+/* like readline(), but also classify the line */
+char *
+readline_kind (rd, ln, kind, out)
+struct reader *rd;
+int *ln;
+enum line_kind *kind;
+char **out;
+{
+	char *s;
+	int a;
+
+	s = readline (rd, ln);
+	if (s == NULL)
+		return NULL;
+
+	if (rd->kinds != NULL) {
+		*kind = rd->kinds[rd->i - 1];
+		a = rd->args[rd->i - 1];
+		*out = a >= 0 ? s + a : NULL;
+	} else {
+		*kind = classify (s, out);
+	}
+	return s;
+}
+
+void
+do_parse (sc, dir, path, rd)
+struct scope *sc;
+const struct path *dir;
+const char *path;
+struct reader *rd;
+{
+	extern void parse ();
+	struct template *tm;
+	struct rule *r = NULL;
+	size_t len, cap, iflen = 0;
+	char *s, *t, *u, *help = NULL;
+	char ifstack[MAX_IFSTACK];
+	enum line_kind kind;
+	struct parse_ctx pctx;
+	struct reader trd;
+	int x, run;
+	str_t text;
+
+	assert (sc->type == SC_DIR);
+	pctx.path = path;
+	pctx.line = 1;
+
+	if (verbose >= 3)
+		printf ("Parsing dir '%s' ...\n", path_str (dir));
+
+	while ((s = readline_kind (rd, &pctx.line, &kind, &t)) != NULL) {
+		run = walkifstack (ifstack, iflen);
+		switch (kind) {
+		case LK_HELP:
 			help = expand (sc, dir, trim (s + 2), NULL);
 			continue;
-		} else if (s[0] == '#' || *trim (s) == '\0') {
+		case LK_BLANK:
+		case LK_BODY:
+			continue;
+		case LK_INCLUDE:
+			if (!run)
+				goto cont;
+
+			strip_comment (s);
+			t = expand (sc, dir, trim (s + 8), NULL);
+			if (*t == '/') {
+				u = t;
+			} else {
+				u = path_join (dir, t);
+			}
+			parse (sc, dir, u);
+			sc_dir (sc)->done = false;
+			if (u != t)
+				free (u);
+			free (t);
+			break;
+		case LK_SINCLUDE:
+			if (!run)
+				goto cont;
+
+			strip_comment (s);
+			t = expand (sc, dir, trim (s + 9), NULL);
+			if (*t == '/') {
+				u = t;
+			} else {
+				u = path_join (dir, t);
+			}
+
+			if (access (u, R_OK) == 0) {
+				parse (sc, dir, u);
+			} else {
+				pc_dep_file (u, false, 0UL, (size_t)0);
+			}
+
+			sc_dir (sc)->done = false;
+
+			if (u != t)
+				free (u);
+			free (t);
+			break;
+		case LK_OLDINCLUDE:
+			if (!run)
+				goto cont;
+
+			errx (1, "%s:%d: please use .SUBDIRS: or .FOREIGN: now", path, pctx.line);
+		case LK_IF:
+			if (iflen == MAX_IFSTACK)
+				errx (1, "%s:%d: maximum .if depth of %d reached", path, pctx.line, MAX_IFSTACK);
+			x = parse_expr (&pctx, sc, dir, t) & 0x01;
+			ifstack[iflen++] = x * (IF_VAL | IF_HAS);
+			break;
+		case LK_ELSE:
+			if (iflen == 0)
+				errx (1, "%s:%d: not in .if", path, pctx.line);
+			t = &ifstack[iflen - 1];
+			*t = (!(*t & IF_HAS) * (IF_VAL | IF_HAS)) | (*t & IF_HAS);
+			break;
+		case LK_ELIF:
+			if (iflen == 0)
+				errx (1, "%s:%d: not in .if", path, pctx.line);
+			x = parse_expr (&pctx, sc, dir, t);
+			t = &ifstack[iflen - 1];
+			*t = ((!(*t & IF_HAS) && x) * (IF_VAL | IF_HAS)) | (*t & IF_HAS);
+			break;
+		case LK_ENDIF:
+			if (iflen == 0)
+				errx (1, "%s:%d: not in .if", path, pctx.line);
+			--iflen;
+			break;
+		case LK_TEMPLATE:
+			str_new (&text);
+
+			tm = new (struct template);
+			tm->name = strdup (strip_comment (t));
+
+			while ((s = readline (rd, &pctx.line)) != NULL) {
+				if (is_endtemplate (s))
+					break;
+
+				str_puts (&text, s);
+				str_putc (&text, '\n');
+			}
+
+			if (run) {
+				tm->text = str_release (&text);
+				SLIST_INSERT_HEAD (&sc_dir (sc)->templates, tm, next);
+			} else {
+				free (tm);
+				str_free (&text);
+			}
+			break;
+		case LK_EXPAND:
+			if (!run)
+				goto cont;
+			tm = find_template (sc, strip_comment (t));
+			if (tm == NULL)
+				errx (1, "%s:%d: no such template: %s", pctx.path, pctx.line, t);
+			if (tm->pl == NULL)
+				tm->pl = compile_template (tm);
+			u = pl_load (tm->pl, &trd);
+			do_parse (sc, dir, "template", &trd);
+			reader_free (&trd);
+			free (u);
+			break;
+		case LK_DEFAULT:
+			if (run)
+				sc_dir (sc)->default_file = strdup (strip_comment (t));
+			break;
+		case LK_POSIX:
+			if (run)
+				warnx ("%s:%d: this is not a POSIX-compatible make", path, pctx.line);
+			break;
+		case LK_SUFFIXES:
+			if (run)
+				warnx ("%s:%d: this make doesn't require .SUFFIXES", path, pctx.line);
+			break;
+		case LK_SUBDIRS:
+			if (run) {
+				u = expand (sc, dir, t, NULL);
+				parse_subdirs (&pctx, sc, dir, u);
+				free (u);
+			}
+			break;
+		case LK_FOREIGN:
+			if (run) {
+				u = expand (sc, dir, t, NULL);
+				parse_foreign (sc, u);
+				free (u);
+			}
+			break;
+		case LK_EXPORTS:
+			if (run)
+				parse_exports (&pctx, sc, t);
+			break;
+		case LK_RESTAT:
+			if (run) {
+				u = expand (sc, dir, t, NULL);
+				parse_attrs (sc, u, ATTR_RESTAT);
+				free (u);
+			}
+			break;
+		case LK_DEPFILE:
+			if (run) {
+				u = expand (sc, dir, t, NULL);
+				parse_attrs (sc, u, ATTR_DEPFILE);
+				free (u);
+			}
+			break;
+		case LK_NOFOLLOW:
+			if (run) {
+				u = expand (sc, dir, t, NULL);
+				parse_attrs (sc, u, ATTR_NOFOLLOW);
+				free (u);
+			}
+			break;
+		case LK_RECIPE:
+			if (!run)
+				goto cont;
+
+			if (r == NULL)
+				errx (1, "%s:%d: syntax error", path, pctx.line);
+
+			if (len == cap) {
+				cap *= 2;
+				r->code = renew (r->code, cap + 1, char *);
+			}
+
+			r->code[len++] = strdup (s + 1);
+			r->code[len] = NULL;
+			break;
+		case LK_DEF:
+			if (!run)
+				goto cont;
+
+			if (trim (s) == t)
+				goto invalid;
+
+			switch (*t) {
+			case ':':
+				if (!lazy_rule (sc, s, t, help, &r))
+					r = parse_rule (sc, dir, s, t, help);
+				if (r == NULL)
+					goto cont;
+
+				len = 0;
+				cap = 1;
+				r->code = newa (cap + 1, char *);
+				r->code[0] = NULL;
+				break;
+			case '=':
+				/* TODO: write a proper function for checking macro names */
+				if (*t == '\0')
+					errx (1, "%s:%d: invalid macro name", path, pctx.line);
+
+				*t = '\0';
+
+				parse_assign (&pctx, sc, dir, s, t, help);
+				break;
+			default:
+				abort ();
+			}
+			break;
+		case LK_INVALID:
+		invalid:
+			warnx ("%s:%d: invalid line: %s", path, pctx.line, s);
+			break;
+		}
+
+	cont:
+		help = NULL;
+	}
+}
+
+void
+pc_put_path (s, p)
+str_t *s;
+const struct path *p;
+{
+	size_t n;
+
+	for (n = 0; p[n].type != PATH_NULL; ++n);
+	str_u32 (s, (unsigned long)n);
+	for (; p->type != PATH_NULL; ++p) {
+		str_u32 (s, p->type);
+		if (p->type == PATH_NAME)
+			str_pstr (s, p->name);
+	}
+}
+
+void
+pc_put_deps (s, deps)
+str_t *s;
+const struct dep_list *deps;
+{
+	const struct dep *dep;
+	size_t i;
+
+	str_u32 (s, (unsigned long)dl_len (deps));
+	DL_FOREACH (dep, i, deps)
+		pc_put_path (s, dep->path);
+}
+
+/* 0: no rule, 1: the same rule as before, 2: a new rule */
+void
+pc_put_rule (s, r, prev)
+str_t *s;
+const struct rule *r, *prev;
+{
+	char **c;
+	unsigned long n;
+
+	if (r == NULL) {
+		str_u32 (s, 0);
+	} else if (r == prev) {
+		str_u32 (s, 1);
+	} else {
+		str_u32 (s, 2);
+		if (r->code == NULL) {
+			str_u32 (s, 0);
+			return;
+		}
+		for (n = 0, c = r->code; *c != NULL; ++c)
+			++n;
+		str_u32 (s, n + 1);
+		for (c = r->code; *c != NULL; ++c)
+			str_pstr (s, *c);
+	}
+}
+
+/* index of `m` in `v`, or -1 */
+long
+pc_index (v, n, m)
+void **v;
+size_t n;
+const void *m;
+{
+	size_t i;
+
+	for (i = 0; i < n; ++i) {
+		if (v[i] == m)
+			return (long)i;
+	}
+	return -1;
+}
+
+/* serialize the parsed directory of `sc`, oldest definitions first */
+void
+pc_snapshot (s, sc)
+str_t *s;
+struct scope *sc;
+{
+	struct directory *d = sc_dir (sc);
+	struct inference *inf;
+	struct template *tm;
+	struct scope *sub;
+	struct macro *m;
+	struct attr *a;
+	struct file *f;
+	struct rule *prev;
+	void **v, **files;
+	size_t i, n, nf;
+	long idx;
+
+	str_popt (s, d->default_file);
+
+	/* macros, and which of them are exported */
+	n = 0;
+	SLIST_FOREACH (m, &d->macros, next)
+		++n;
+	v = newa (n + 1, void *);
+	i = n;
+	SLIST_FOREACH (m, &d->macros, next)
+		v[--i] = m;
+	str_u32 (s, (unsigned long)n);
+	for (i = 0; i < n; ++i) {
+		m = v[i];
+		str_pstr (s, m->name);
+		str_pstr (s, m->value);
+		str_popt (s, m->help);
+		str_u32 (s, m->lazy);
+		if (m->prepend == NULL) {
+			str_u32 (s, 0);
+		} else if ((idx = pc_index (v, i, m->prepend)) >= 0) {
+			str_u32 (s, 1);
+			str_u32 (s, (unsigned long)idx);
+		} else {
+			str_u32 (s, 2);
+			str_pstr (s, m->prepend->name);
+		}
+	}
+
+	i = 0;
+	SLIST_FOREACH (m, &d->emacros, enext)
+		++i;
+	str_u32 (s, (unsigned long)i);
+	files = newa (i + 1, void *);
+	SLIST_FOREACH (m, &d->emacros, enext)
+		files[--i] = m;
+	for (m = files[i]; m != NULL; m = files[++i]) {
+		if ((idx = pc_index (v, n, m)) >= 0) {
+			str_u32 (s, 1);
+			str_u32 (s, (unsigned long)idx);
+		} else {
+			str_u32 (s, 2);
+			str_pstr (s, m->name);
+		}
+	}
+	free (files);
+	free (v);
+
+	nf = d->nfiles;
+	files = newa (nf + 1, void *);
+	str_u32 (s, (unsigned long)nf);
+	prev = NULL;
+	for (i = 0; i < nf; ++i) {
+		f = d->files[i];
+		if (f->lazy != NULL)
+			file_force (f);
+		files[i] = f;
+		str_pstr (s, f->name);
+		pc_put_rule (s, f->rule, prev);
+		prev = f->rule;
+		str_popt (s, f->help);
+		pc_put_deps (s, &f->deps);
+	}
+
+	n = 0;
+	SLIST_FOREACH (inf, &d->infs, next)
+		++n;
+	str_u32 (s, (unsigned long)n);
+	v = newa (n + 1, void *);
+	SLIST_FOREACH (inf, &d->infs, next)
+		v[--n] = inf;
+	for (inf = v[n]; inf != NULL; inf = v[++n]) {
+		str_pstr (s, inf->from);
+		str_pstr (s, inf->to);
+		pc_put_rule (s, inf->rule, NULL);
+		pc_put_deps (s, &inf->deps);
+	}
+	free (v);
+
+	n = 0;
+	SLIST_FOREACH (tm, &d->templates, next)
+		++n;
+	str_u32 (s, (unsigned long)n);
+	v = newa (n + 1, void *);
+	SLIST_FOREACH (tm, &d->templates, next)
+		v[--n] = tm;
+	for (tm = v[n]; tm != NULL; tm = v[++n]) {
+		str_pstr (s, tm->name);
+		str_pstr (s, tm->text);
+	}
+	free (v);
+
+	n = 0;
+	SLIST_FOREACH (a, &d->attrs, next)
+		++n;
+	str_u32 (s, (unsigned long)n);
+	v = newa (n + 1, void *);
+	SLIST_FOREACH (a, &d->attrs, next)
+		v[--n] = a;
+	for (a = v[n]; a != NULL; a = v[++n]) {
+		str_pstr (s, a->name);
+		str_u32 (s, (unsigned long)a->flags);
+	}
+	free (v);
+
+	n = 0;
+	SLIST_FOREACH (sub, &d->subdirs, next)
+		++n;
+	str_u32 (s, (unsigned long)n);
+	v = newa (n + 1, void *);
+	SLIST_FOREACH (sub, &d->subdirs, next)
+		v[--n] = sub;
+	for (sub = v[n]; sub != NULL; sub = v[++n]) {
+		str_pstr (s, sub->name);
+		str_u32 (s, sub->type);
+		str_popt (s, sub->makefile);
+		if (sub->type == SC_FOREIGN) {
+			str_u32 (s, (unsigned long)(pc_index (files, nf, sub->inner.foreign->test) + 1));
+			str_u32 (s, (unsigned long)(pc_index (files, nf, sub->inner.foreign->exec) + 1));
+			pc_put_deps (s, &sub->inner.foreign->deps);
+		}
+	}
+	free (v);
+	free (files);
+}
+
+struct path *
+pc_get_path (b)
+struct sbuf *b;
+{
+	struct path *p, *r;
+	unsigned long i, n, t;
+	char *name;
+
+	if (sb_u32 (b, &n) != 0 || n > 0x10000)
+		return NULL;
+
+	arena_enter (&scratch);
+	p = arena_alloc (&scratch, n * sizeof (struct path) + 1);
+	r = NULL;
+	for (i = 0; i < n; ++i) {
+		if (sb_u32 (b, &t) != 0)
+			goto end;
+		p[i].type = t;
+		p[i].name = NULL;
+		if (t == PATH_NAME) {
+			if ((name = sb_str (b)) == NULL)
+				goto end;
+			p[i].name = intern (name);
+			free (name);
+		}
+	}
+	r = path_intern (p, n);
+end:
+	arena_leave (&scratch);
+	return r;
+}
+
+int
+pc_get_deps (b, deps)
+struct sbuf *b;
+struct dep_list *deps;
+{
+	struct path *p;
+	unsigned long n;
+
+	deps->a = NULL;
+	if (sb_u32 (b, &n) != 0)
+		return -1;
+	for (; n > 0; --n) {
+		if ((p = pc_get_path (b)) == NULL)
+			return -1;
+		dl_add (deps, p);
+	}
+	return 0;
+}
+
+int
+pc_get_rule (b, r, prev)
+struct sbuf *b;
+struct rule **r, *prev;
+{
+	unsigned long kind, n, i;
+
+	if (sb_u32 (b, &kind) != 0)
+		return -1;
+
+	switch (kind) {
+	case 0:
+		*r = NULL;
+		return 0;
+	case 1:
+		*r = prev;
+		return 0;
+	case 2:
+		*r = new (struct rule);
+		if (sb_u32 (b, &n) != 0 || n > 0x100000)
+			return -1;
+		if (n == 0)
+			return 0;
+		(*r)->code = newa (n, char *);
+		for (i = 0; i + 1 < n; ++i) {
+			if (((*r)->code[i] = sb_str (b)) == NULL)
+				return -1;
+		}
+		return 0;
+	}
+
+	return -1;
+}
+
+/* the macro defined outside of `sc`, as find_macro() would see it */
+struct macro *
+pc_outer_macro (sc, name)
+struct scope *sc;
+const char *name;
+{
+	struct macro *m;
+
+	if ((name = intern_find (name)) == NULL)
+		return NULL;
+
+	m = find_emacro (sc->parent, name);
+	if (m != NULL)
+		return m;
+
+	for (m = globals; m != NULL; m = SLIST_NEXT (m, next)) {
+		if (m->name == name)
+			return m;
+	}
+
+	return NULL;
+}
+
+/* rebuild the directory of `sc` from a snapshot */
+int
+pc_restore (sc, d, b)
+struct scope *sc;
+struct directory *d;
+struct sbuf *b;
+{
+	struct inference *inf;
+	struct template *tm;
+	struct scope *sub;
+	struct macro *m, **v;
+	struct attr *a;
+	struct file *f, **files;
+	struct rule *r, *prev;
+	unsigned long i, n, nf, x, lazy;
+	char *name, *value, *help;
+
+	if (sb_opt (b, &d->default_file) != 0)
+		return -1;
+
+	if (sb_u32 (b, &n) != 0 || n > 0x1000000)
+		return -1;
+	v = newa (n + 1, struct macro *);
+	for (i = 0; i < n; ++i) {
+		if ((name = sb_str (b)) == NULL || (value = sb_str (b)) == NULL)
+			return -1;
+		if (sb_opt (b, &help) != 0 || sb_u32 (b, &lazy) != 0 || sb_u32 (b, &x) != 0)
+			return -1;
+
+		m = new_macro (name, value, help, lazy != 0, NULL);
+		free (name);
+		switch (x) {
+		case 0:
+			break;
+		case 1:
+			if (sb_u32 (b, &x) != 0 || x >= i)
+				return -1;
+			m->prepend = v[x];
+			break;
+		case 2:
+			if ((name = sb_str (b)) == NULL)
+				return -1;
+			m->prepend = pc_outer_macro (sc, name);
+			free (name);
+			break;
+		default:
+			return -1;
+		}
+		v[i] = m;
+		dir_add_macro (d, m);
+	}
+
+	if (sb_u32 (b, &nf) != 0)
+		return -1;
+	for (; nf > 0; --nf) {
+		if (sb_u32 (b, &x) != 0)
+			return -1;
+		if (x == 1) {
+			if (sb_u32 (b, &x) != 0 || x >= n)
+				return -1;
+			m = v[x];
+		} else {
+			if ((name = sb_str (b)) == NULL)
+				return -1;
+			m = pc_outer_macro (sc, name);
+			free (name);
+			if (m == NULL)
+				return -1;
+		}
+		dir_export_macro (d, m);
+	}
+	free (v);
+
+	if (sb_u32 (b, &nf) != 0 || nf > 0x1000000)
+		return -1;
+	files = newa (nf + 1, struct file *);
+	prev = NULL;
+	for (i = 0; i < nf; ++i) {
+		if ((name = sb_str (b)) == NULL || pc_get_rule (b, &r, prev) != 0 || sb_opt (b, &help) != 0)
+			return -1;
+		prev = r;
+		f = new_file (name, r, time_zero, NULL, help, NULL, false);
+		free (name);
+		if (pc_get_deps (b, &f->deps) != 0)
+			return -1;
+		files[i] = f;
+		dir_add_file (d, f);
+	}
+
+	if (sb_u32 (b, &n) != 0)
+		return -1;
+	for (; n > 0; --n) {
+		inf = new (struct inference);
+		if ((inf->from = sb_str (b)) == NULL || (inf->to = sb_str (b)) == NULL)
+			return -1;
+		if (pc_get_rule (b, &inf->rule, NULL) != 0 || pc_get_deps (b, &inf->deps) != 0)
+			return -1;
+		SLIST_INSERT_HEAD (&d->infs, inf, next);
+	}
+
+	if (sb_u32 (b, &n) != 0)
+		return -1;
+	for (; n > 0; --n) {
+		tm = new (struct template);
+		if ((tm->name = sb_str (b)) == NULL || (tm->text = sb_str (b)) == NULL)
+			return -1;
+		SLIST_INSERT_HEAD (&d->templates, tm, next);
+	}
+
+	if (sb_u32 (b, &n) != 0)
+		return -1;
+	for (; n > 0; --n) {
+		a = new (struct attr);
+		if ((a->name = sb_str (b)) == NULL || sb_u32 (b, &x) != 0)
+			return -1;
+		a->flags = (int)x;
+		SLIST_INSERT_HEAD (&d->attrs, a, next);
+	}
+
+	if (sb_u32 (b, &n) != 0)
+		return -1;
+	for (; n > 0; --n) {
+		if ((name = sb_str (b)) == NULL || sb_u32 (b, &x) != 0)
+			return -1;
+		sub = new_subdir (sc, name);
+		free (name);
+		sub->type = x;
+		if (sb_opt (b, &sub->makefile) != 0)
+			return -1;
+		if (sub->type != SC_FOREIGN)
+			continue;
+
+		sub->inner.foreign = new (struct foreign);
+		SLIST_INIT (&sub->inner.foreign->built);
+		if (sb_u32 (b, &x) != 0 || x > nf)
+			return -1;
+		sub->inner.foreign->test = x > 0 ? files[x - 1] : NULL;
+		if (sb_u32 (b, &x) != 0 || x > nf)
+			return -1;
+		sub->inner.foreign->exec = x > 0 ? files[x - 1] : NULL;
+		if (pc_get_deps (b, &sub->inner.foreign->deps) != 0)
+			return -1;
+	}
+	free (files);
+
+	/* the timestamps are not cached, build_file() gets them */
+	return b->p == b->end ? 0 : -1;
+}
+
+/* try to restore the parse of `sc` from the cache */
+bool
+pcache_get (sc, dir)
+struct scope *sc;
+const struct path *dir;
+{
+	extern struct directory *new_directory ();
+	struct directory *dirx;
+	struct pcentry *e;
+	struct pcdep *d;
+	struct sbuf b;
+	char *key;
+
+	key = pc_key (sc, dir);
+	e = pcache_find (key);
+	free (key);
+
+	if (e == NULL || e->gfp != pc_gfp || e->pfp != pc_parent_fp (sc))
+		return false;
+
+	/* commands are slow, and may have effects: run them last */
+	for (d = e->deps; d != NULL; d = d->next) {
+		if (d->kind != PD_CMD && !pc_dep_valid (d))
+			return false;
+	}
+	for (d = e->deps; d != NULL; d = d->next) {
+		if (d->kind == PD_CMD && !pc_dep_valid (d))
+			return false;
+	}
+
+	/* new_subdir() finds the directory through `sc`, detach it again on failure */
+	dirx = new_directory ();
+	sc->inner.dir = dirx;
+	b.p = (const unsigned char *)e->blob;
+	b.end = b.p + e->len;
+	if (pc_restore (sc, dirx, &b) != 0) {
+		warnx ("%s: corrupt parse cache entry for %s, ignoring", pc_path, e->key);
+		sc->inner.dir = NULL;
+		pcache_drop (e);
+		return false;
+	}
+
+	dirx->done = true;
+	dirx->fp = e->fp;
+	for (d = e->deps; d != NULL; d = d->next) {
+		if (d->kind == PD_FILE)
+			stat_mkfile (d->name);
+		else if (d->kind == PD_ENV && serve_mode)
+			serve_dep_env (d->name, d->value);
+	}
+
+	if (verbose >= 2)
+		printf ("parse cache hit: %s\n", e->key);
+	return true;
+}
+
+/* store the parse of `sc`, which depended on `deps` */
+void
+pcache_put (sc, dir, deps)
+struct scope *sc;
+const struct path *dir;
+struct pcdep *deps;
+{
+	struct pcentry *e;
+	str_t blob;
+	char *key;
+
+	key = pc_key (sc, dir);
+	e = pcache_find (key);
+	if (e == NULL) {
+		e = new (struct pcentry);
+		e->next = pc_list;
+		pc_list = e;
+		e->key = key;
+	} else {
+		free (key);
+		free (e->blob);
+	}
+
+	e->gfp = pc_gfp;
+	e->pfp = pc_parent_fp (sc);
+	e->deps = deps;
+	e->fp = pc_fingerprint (e);
+
+	str_new (&blob);
+	pc_snapshot (&blob, sc);
+	e->len = blob.len;
+	e->blob = str_release (&blob);
+
+	sc_dir (sc)->fp = e->fp;
+	pc_dirty = true;
+}
+
+/* an empty directory, to be filled by the parser or the parse cache */
+struct directory *
+new_directory ()
+{
+	struct directory *dirx;
+
+	dirx = new (struct directory);
+	SLIST_INIT (&dirx->subdirs);
+	SLIST_INIT (&dirx->macros);
+	SLIST_INIT (&dirx->emacros);
+	SLIST_INIT (&dirx->infs);
+	SLIST_INIT (&dirx->templates);
+	SLIST_INIT (&dirx->attrs);
+	dirx->done = false;
+	return dirx;
+}
+
+void
+parse (sc, dir, path) 
+struct scope *sc;
+const struct path *dir;
+char *path;
+{
+	extern char *ra_take (), *ic_take ();
+	struct pcdep *deps = NULL, **prev;
+	struct reader rd;
+	unsigned long hash = 0;
+	char *buf;
+	size_t len;
+
+	stat_mkfile (path);
+
+	rd.lines = NULL;
+	rd.nls = NULL;
+	rd.kinds = NULL;
+	rd.args = NULL;
+	if (sc->inner.dir != NULL) {
+		buf = ic_take (path, &len, &hash, &rd);
+	} else {
+		buf = ra_take (path, &len, &hash, &rd);
+	}
+
+	if (buf == NULL) {
+		buf = read_file (path, &len);
+		if (buf != NULL && pc_on)
+			hash = fnv_update (FNV_INIT, buf, len);
+	}
+
+	if (buf == NULL || sc->inner.dir != NULL)
+		pc_dep_file (path, buf != NULL, hash, len);
+	if (buf == NULL) {
+		/* err (1, "fopen(\"%s\")", path); */
+		sc->inner.dir = new_directory ();
+		return;
+	}
+
+	prev = pc_rec;
+	if (sc->inner.dir == NULL) {
+		if (pc_on) {
+			pcache_load (dir);
+			if (pcache_get (sc, dir)) {
+				reader_free (&rd);
+				free (buf);
+				return;
+			}
+
+			/* record what this parse depends on */
+			deps = NULL;
+			pc_rec = &deps;
+			pc_dep_file (path, true, hash, len);
+		}
+
+		sc->inner.dir = new_directory ();
+	} else if (sc_dir (sc)->done) {
+		errx (1, "%s: parsing this file again?", path);
+	}
+
+	rd.p = buf;
+	rd.end = buf + len;
+	do_parse (sc, dir, path, &rd);
+	sc_dir (sc)->done = true;
+
+	if (pc_rec != prev) {
+		pc_rec = prev;
+		pcache_put (sc, dir, deps);
+	}
+
+	reader_free (&rd);
+	free (buf);
+}
+
+void
+parse_dir (sc, dir)
+struct scope *sc;
+const struct path *dir;
+{
+	extern void ra_start ();
+	char *path;
+
+	ra_start (sc, dir);
+	path = path_join (dir, sc->makefile);
+	parse (sc, dir, path);
+	free (path);
+}
+
+struct scope *
+parse_recursive (dir, makefile)
+const struct path *dir;
+char *makefile;
+{
+	struct path *ppath;
+	struct scope *sc, *parent;
+	char *path, *name;
+	str_t tmp;
+
+	str_new (&tmp);
+	if (dir[0].type != PATH_NULL) {
+		str_puts (&tmp, path_str (dir));
+		str_putc (&tmp, '/');
+	}
+	str_puts (&tmp, makefile);
+	path = str_release (&tmp);
+	if (access (path, F_OK) != 0) {
+		sc = NULL;
+		goto ret;
+	}
+
+	ppath = path_cat (dir, &path_super);
+	parent = parse_recursive (ppath, makefile);
+	if (parent == NULL)
+		parent = parse_recursive (ppath, MAKEFILE);
+
+	name = intern (path_basename (dir));
+
+	if (parent != NULL) {
+		if (parent->type != SC_DIR)
+			errx (1, "%s: invalid parent type", path);
+
+		SLIST_FOREACH (sc, &sc_dir (parent)->subdirs, next) {
+			if (sc->name == name) {
+				if (sc->type != SC_DIR)
+					errx (1, "%s: invalid type", path);
+				goto parselbl;
+			}
+		}
+
+		goto create;
+	} else {
+	create:
+		sc = new (struct scope);
+		sc->type = SC_DIR;
+		sc->name = name;
+		sc->inner.dir = NULL;
+	}
+
+parselbl:
+	sc->makefile = makefile;
+	sc->parent = parent;
+	parse (sc, dir, path);
+
+ret:
+	free (path);
+	return sc;
+}
+
+struct path *	
+parse_subdir (prefix, sub)
+const struct path *prefix;
+struct scope *sub;
+{
+	struct path *np;
+
+	np = path_cat_name (prefix, sub->name);
+	parse_dir (sub, np);
+	return np;
+}
+
+/* INCLUDE CACHE */
+
+/*
+ * Fragments like ${.TOPDIR}/mk/rules.mk are included by many scopes,
+ * under many different paths.  Each of them is read, split into lines and
+ * classified only once; every include gets a copy of the lines, because
+ * do_parse() modifies them.
+ */
+
+#define IC_NBUCKETS	256
+
+struct incfile {
+	struct incfile	*next;
+	struct stat	 st;		/* to notice an include that changed */
+	unsigned long	 hash;
+	struct plines	 pl;
+};
+
+static struct incfile *ic_tab[IC_NBUCKETS];
+
+/* like ra_take(), but for an include; NULL if it cannot be read */
+char *
+ic_take (path, len, hash, rd)
+const char *path;
+size_t *len;
+unsigned long *hash;
+struct reader *rd;
+{
+	struct incfile *ic, **head;
+	struct stat st;
+	char *buf;
+	int fd;
+
+	if (stat (path, &st) != 0)
+		return NULL;
+
+	head = &ic_tab[(st.st_ino ^ st.st_dev) % IC_NBUCKETS];
+	for (ic = *head; ic != NULL; ic = ic->next) {
+		if (ic->st.st_ino == st.st_ino && ic->st.st_dev == st.st_dev)
+			break;
+	}
+
+	if (ic != NULL && same_file (&ic->st, &st)) {
+		*len = ic->pl.len;
+		*hash = ic->hash;
+		return pl_load (&ic->pl, rd);
+	}
+
+	fd = open (path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat (fd, &st) != 0 || (buf = read_fd (fd, len)) == NULL) {
+		close (fd);
+		return NULL;
+	}
+	close (fd);
+
+	if (pc_on)
+		*hash = fnv_update (FNV_INIT, buf, *len);
+
+	rd->p = buf;
+	rd->end = buf + *len;
+	split_lines (rd);
+	classify_lines (rd);
+
+	if (ic == NULL || ic->st.st_ino != st.st_ino || ic->st.st_dev != st.st_dev) {
+		ic = new (struct incfile);
+		head = &ic_tab[(st.st_ino ^ st.st_dev) % IC_NBUCKETS];
+		ic->next = *head;
+		*head = ic;
+	} else {
+		pl_free (&ic->pl);
+	}
+
+	ic->st = st;
+	ic->hash = *hash;
+	pl_save (&ic->pl, rd, buf, *len);
+	return buf;
+}
+
+/* READ-AHEAD */
+
+/*
+ * The makefiles of sibling subdirectories do not depend on each other
+ * until they are parsed, so when the first of them is needed, all of them
+ * are read, hashed and split into lines by a few threads.  They are still
+ * parsed one at a time and in the usual order, so nothing else changes.
+ *
+ * This is the only work done off the main thread.  Parsing, expansion and
+ * stat() are single-threaded: the scratch arena, the node pools, the
+ * intern tables and the stat cache have no locks, so ra_read() must not
+ * use any of them.
+ */
+
+#if HAVE_PTHREAD
+# define USE_READAHEAD 1
+#endif
+
+#if USE_READAHEAD
+#define RA_NBUCKETS	256
+#define RA_MAXTHREADS	8
+
+enum ra_state {
+	RA_QUEUED,
+	RA_BUSY,
+	RA_DONE,
+};
+
+struct rajob {
+	struct rajob	*next;		/* work queue */
+	struct rajob	*hnext;		/* hash chain */
+	char		*path;
+	enum ra_state	 state;
+	char		*buf;		/* NULL: could not be read */
+	size_t		 len;
+	unsigned long	 hash;
+	char		**lines;
+	int		*nls;
+	unsigned char	*kinds;
+	int		*args;
+	size_t		 n;
+	struct stat	 st;		/* to notice a makefile that changed since */
+};
+
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ra_done = PTHREAD_COND_INITIALIZER;
+static struct rajob *ra_head = NULL, **ra_tail = &ra_head;
+static struct rajob *ra_tab[RA_NBUCKETS];
+static int ra_nthreads = 0, ra_max = -1;
+static bool ra_forked = false;
+
+/* read, hash and split one makefile; runs without the lock */
+void
+ra_read (j)
+struct rajob *j;
+{
+	struct reader rd;
+	int fd;
+
+	fd = open (j->path, O_RDONLY);
+	if (fd < 0)
+		return;
+
+	if (fstat (fd, &j->st) != 0 || (j->buf = read_fd (fd, &j->len)) == NULL) {
+		close (fd);
+		return;
+	}
+	close (fd);
+
+	if (pc_on)
+		j->hash = fnv_update (FNV_INIT, j->buf, j->len);
+
+	rd.p = j->buf;
+	rd.end = j->buf + j->len;
+	split_lines (&rd);
+	classify_lines (&rd);
+	j->lines = rd.lines;
+	j->nls = rd.nls;
+	j->kinds = rd.kinds;
+	j->args = rd.args;
+	j->n = rd.n;
+}
+
+void *
+ra_worker (arg)
+void *arg;
+{
+	struct rajob *j;
+
+	pthread_mutex_lock (&ra_lock);
+	for (;;) {
+		while (ra_head == NULL)
+			pthread_cond_wait (&ra_work, &ra_lock);
+
+		j = ra_head;
+		ra_head = j->next;
+		if (ra_head == NULL)
+			ra_tail = &ra_head;
+		j->state = RA_BUSY;
+
+		pthread_mutex_unlock (&ra_lock);
+		ra_read (j);
+		pthread_mutex_lock (&ra_lock);
+
+		j->state = RA_DONE;
+		pthread_cond_broadcast (&ra_done);
+	}
+
+	return arg;
+}
+
+/* a forked child only has the thread that forked, so it reads by itself */
+void
+ra_prefork ()
+{
+	pthread_mutex_lock (&ra_lock);
+}
+
+void
+ra_postfork ()
+{
+	pthread_mutex_unlock (&ra_lock);
+}
+
+void
+ra_child ()
+{
+	ra_forked = true;
+	pthread_mutex_unlock (&ra_lock);
+}
+
+/* start reading the makefiles of `sc` and its siblings, seen from `dir` */
+void
+ra_start (sc, dir)
+struct scope *sc;
+const struct path *dir;
+{
+	struct rajob *j, *jobs = NULL, **tail = &jobs;
+	struct path *pdir, *np;
+	struct scope *sub;
+	pthread_t t;
+	size_t i;
+	int n = 0;
+	long ncpu;
+
+	if (ra_max < 0) {
+		ncpu = sysconf (_SC_NPROCESSORS_ONLN);
+		/* reading is I/O bound, so even a single CPU gains a helper */
+		ra_max = ncpu > RA_MAXTHREADS ? RA_MAXTHREADS : ncpu > 2 ? (int)ncpu : 2;
+		if (ra_max > 0 && pthread_atfork (ra_prefork, ra_postfork, ra_child) != 0)
+			ra_max = 0;
+	}
+
+	if (ra_max == 0 || ra_forked || sc->parent == NULL || sc->parent->type != SC_DIR)
+		return;
+
+	/*
+	 * Only once for every directory, and not before the second subdir
+	 * is needed, so a goal deep down the tree reads nothing extra.
+	 */
+	if (sc_dir (sc->parent)->ahead >= 2 || sc_dir (sc->parent)->ahead++ == 0)
+		return;
+
+	i = path_len (dir);
+	if (i == 0 || dir[i - 1].type != PATH_NAME || strcmp (dir[i - 1].name, sc->name) != 0)
+		return;
+	pdir = path_cat (dir, &path_super);
+
+	SLIST_FOREACH (sub, &sc_dir (sc->parent)->subdirs, next) {
+		if (sub->type != SC_DIR || sub->inner.dir != NULL || sub->makefile == NULL)
+			continue;
+
+		np = path_cat_name (pdir, sub->name);
+		j = new (struct rajob);
+		j->path = path_join (np, sub->makefile);
+		j->state = RA_QUEUED;
+
+		*tail = j;
+		tail = &j->next;
+		++n;
+	}
+
+	/* there is nothing to overlap with a single makefile */
+	if (n < 2) {
+		for (; jobs != NULL; jobs = j) {
+			j = jobs->next;
+			free (jobs->path);
+			free (jobs);
+		}
+		return;
+	}
+
+	pthread_mutex_lock (&ra_lock);
+	for (j = jobs; j != NULL; j = j->next) {
+		i = strhash (j->path) % RA_NBUCKETS;
+		j->hnext = ra_tab[i];
+		ra_tab[i] = j;
+	}
+	*ra_tail = jobs;
+	ra_tail = tail;
+
+	for (; ra_nthreads < ra_max && ra_nthreads < n; ++ra_nthreads) {
+		if (pthread_create (&t, NULL, ra_worker, NULL) != 0)
+			break;
+		pthread_detach (t);
+	}
+	pthread_cond_broadcast (&ra_work);
+	pthread_mutex_unlock (&ra_lock);
+}
+
+/* unlink `j` from the work queue and the hash table; called with the lock */
+void
+ra_unlink (j)
+struct rajob *j;
+{
+	struct rajob **p;
+
+	for (p = &ra_head; *p != NULL; p = &(*p)->next) {
+		if (*p == j) {
+			*p = j->next;
+			if (*p == NULL)
+				ra_tail = p;
+			break;
+		}
+	}
+
+	for (p = &ra_tab[strhash (j->path) % RA_NBUCKETS]; *p != j; p = &(*p)->hnext);
+	*p = j->hnext;
+}
+
+/*
+ * Return the makefile `path`, if it was read ahead, and make `rd` use
+ * its lines.  NULL means that the caller has to read it.
+ */
+char *
+ra_take (path, len, hash, rd)
+const char *path;
+size_t *len;
+unsigned long *hash;
+struct reader *rd;
+{
+	struct rajob *j;
+	struct stat st;
+	char *buf;
+
+	if (ra_nthreads == 0)
+		return NULL;
+
+	pthread_mutex_lock (&ra_lock);
+	for (j = ra_tab[strhash (path) % RA_NBUCKETS]; j != NULL; j = j->hnext) {
+		if (strcmp (j->path, path) == 0)
+			break;
+	}
+
+	if (j == NULL) {
+		pthread_mutex_unlock (&ra_lock);
+		return NULL;
+	}
+
+	/* not started yet, or never going to be finished: do it now */
+	if (j->state == RA_QUEUED || (j->state == RA_BUSY && ra_forked)) {
+		ra_unlink (j);
+		pthread_mutex_unlock (&ra_lock);
+		if (j->state == RA_BUSY)
+			return NULL;
+		ra_read (j);
+	} else {
+		while (j->state != RA_DONE)
+			pthread_cond_wait (&ra_done, &ra_lock);
+		ra_unlink (j);
+		pthread_mutex_unlock (&ra_lock);
+	}
+
+	/* the makefile may have been written by a recipe in the meantime */
+	buf = j->buf;
+	if (buf == NULL || stat (path, &st) != 0 || !same_file (&j->st, &st)) {
+		free (buf);
+		buf = NULL;
+	}
+
+	if (buf != NULL) {
+		*len = j->len;
+		*hash = j->hash;
+		rd->lines = j->lines;
+		rd->nls = j->nls;
+		rd->kinds = j->kinds;
+		rd->args = j->args;
+		rd->i = 0;
+		rd->n = j->n;
+	} else {
+		free (j->lines);
+		free (j->nls);
+		free (j->kinds);
+		free (j->args);
+	}
+
+	free (j->path);
+	free (j);
+	return buf;
+}
+#else
+void
+ra_start (sc, dir)
+struct scope *sc;
+const struct path *dir;
+{
+}
+
+char *
+ra_take (path, len, hash, rd)
+const char *path;
+size_t *len;
+unsigned long *hash;
+struct reader *rd;
+{
+	return NULL;
+}
+#endif
+
+/* INFERENCE RULES */
+
+char *
+replace_suffix (name, sufx)
+const char *name, *sufx;
+{
+	const char *ext;
+	char *out;
+	size_t len_name, len_sufx;
+
+	ext = strrchr (name, '.');
+	len_name = ext != NULL ? (size_t)(ext - name) : strlen (name);
+	len_sufx = strlen (sufx);
+
+	out = newa (len_name + len_sufx + 1, char);
+	memcpy (out, name, len_name);
+	memcpy (out + len_name, sufx, len_sufx);
+	out[len_name + len_sufx] = '\0';
+
+	return out;
+}
+
+/* instantiate a new file from an inference rule */
+struct file *
+inst_inf (sc, inf, name)
+struct scope *sc;
+struct inference *inf;
+const char *name;
+{
+	struct file *f;
+	char *u;
+
+	{
+		struct dep_list ideps;
+		u = replace_suffix (name, inf->from);
+		ideps.a = NULL;
+		dl_add (&ideps, path_name (u));
+		free (u);
+		f = new_file (
+			/* name */ name,
+			/* rule */ inf->rule,
+			/* time */ time_zero,
+			/* deps */ &ideps,
+			/* help */ NULL,
+			/* inf  */ inf,
+			/* obj  */ false
+		);
+	}
+	dir_add_file (sc_dir (sc), f);
+
+	return f;
+}
+
+/* instantiate an inference rule on an existing file */
+void
+inf_inst_file (f, inf)
+struct file *f;
+struct inference *inf;
+{
+	char *u;
+
+	assert (f->inf == NULL);
+	/* TODO: this is ugly */
+	assert (f->rule == NULL || f->rule->code == NULL || *f->rule->code == NULL);
+
+	u = replace_suffix (f->name, inf->from);
+
+	/* prepend dependency to file */
+	dl_prepend (&f->deps, path_name (u));
+	free (u);
+	f->inf = inf;
+	f->rule = inf->rule;
+}
+
+struct inference *
+find_inf (sc, dir, name)
+struct scope *sc;
+const struct path *dir;
+const char *name;
+{
+	extern struct file *try_find ();
+	struct inference *inf;
+	struct file *sf;
+	char *sn, *base;
+	const char *ext;
+
+	ext = strrchr (name, '.');
+	base = strdup (name);
+	if (ext == NULL) {
+		ext = "";
+	} else {
+		base[ext - name] = '\0';
+	}
+
+	inf = NULL;
+	SLIST_FOREACH (inf, &sc_dir (sc)->infs, next) {
+		if (strcmp (inf->to, ext) == 0) {
+			sn = xstrcat (base, inf->from);
+			sf = find_file (sc_dir (sc), sn);
+			if (sf == NULL)
+				sf = try_find (sc, dir, sn);
+			free (sn);
+			if (sf != NULL)
+				break;
+		}
+	}
+
+	free (base);
+	return inf != NULL || sc->parent == NULL ? inf : find_inf (sc->parent, dir, name);
+}
+
+struct file *
+try_find (sc, dir, name)
+struct scope *sc;
+const struct path *dir;
+const char *name;
+{
+	struct inference *inf;
+	struct filetime ft;
+	struct file *f;
+
+	get_mtime (&ft, sc, dir, name);
+	if (tv_cmp (&ft.t, &time_zero) <= 0) {
+		inf = find_inf (sc, dir, name);
+		if (inf == NULL)
+			return NULL;
+		return inst_inf (sc, inf, name);
+	}
+
+	f = new_file (
+		/* name */ name,
+		/* rule */ NULL,
+		/* time */ ft.t,
+		/* deps */ NULL,
+		/* help */ NULL,
+		/* inf  */ NULL,
+		/* obj  */ ft.obj
+	);
+	dir_add_file (sc_dir (sc), f);
+
+	return f;
+}
+
+/* RESTAT */
+
+/* hash the current output of `f` */
+int
+file_hash (sc, prefix, f, hash, size)
+const struct scope *sc;
+const struct path *prefix;
+const struct file *f;
+unsigned long *hash, *size;
+{
+	str_t path;
+	int rc;
+
+	str_new (&path);
+	if (f->obj && objdir != NULL) {
+		write_objdir (&path, sc);
+	} else {
+		str_puts (&path, path_str (prefix));
+	}
+	str_putc (&path, '/');
+	str_puts (&path, f->name);
+
+	rc = hash_file (str_get (&path), hash, size);
+	str_free (&path);
+	return rc;
+}
+
+/* the mtime presented to the dependents of an up-to-date `.RESTAT:` target */
+struct timespec
+restat_ltime (sc, f)
+const struct scope *sc;
+const struct file *f;
+{
+	struct sentry *e;
+
+	e = state_find (sc, f->name, false);
+	if (e != NULL && e->restat && tv_cmp (&e->mt, &f->mtime) == 0)
+		return e->lt;
+
+	return f->mtime;
+}
+
+/*
+ * Called before the recipe of a `.RESTAT:` target runs.
+ * If the old output was never hashed, do it now,
+ * so that there is something to compare against afterwards.
+ */
+void
+restat_before (sc, prefix, f)
+const struct scope *sc;
+const struct path *prefix;
+const struct file *f;
+{
+	struct sentry *e;
+	unsigned long h, n;
+
+	if (tv_cmp (&f->mtime, &time_zero) <= 0)
+		return;
+
+	e = state_find (sc, f->name, true);
+	if (e->restat && tv_cmp (&e->mt, &f->mtime) == 0)
+		return;
+
+	if (file_hash (sc, prefix, f, &h, &n) != 0)
+		return;
+
+	e->restat = true;
+	e->hash = h;
+	e->size = n;
+	e->mt = f->mtime;
+	e->lt = f->mtime;
+	state_dirty = true;
+}
+
+/*
+ * Called after the recipe of a `.RESTAT:` target ran.
+ * If the contents of the output did not change,
+ * keep presenting the old mtime to the dependents (early cutoff).
+ */
+struct timespec
+restat_after (sc, prefix, f)
+const struct scope *sc;
+const struct path *prefix;
+const struct file *f;
+{
+	struct sentry *e;
+	unsigned long h, n;
+
+	if (tv_cmp (&f->mtime, &time_zero) <= 0 || file_hash (sc, prefix, f, &h, &n) != 0)
+		return f->mtime;
+
+	e = state_find (sc, f->name, true);
+	if (!e->restat || e->hash != h || e->size != n) {
+		e->lt = f->mtime;
+	} else if (verbose >= 2) {
+		printf ("restat('%s'): unchanged\n", f->name);
+	}
+
+	e->restat = true;
+	e->hash = h;
+	e->size = n;
+	e->mt = f->mtime;
+	state_dirty = true;
+	return e->lt;
+}
+
+/* DEPFILES */
+
+/*
+ * A depfile is written by the recipe itself, eg. by `cc -MD`, which puts
+ * it next to the output, with the suffix replaced by `.d`.  It is read
+ * once, after the recipe ran, and its deps are kept in the build state,
+ * so later runs never have to parse it again.
+ */
+
+void
+depfile_path (out, sc, prefix, f)
+str_t *out;
+const struct scope *sc;
+const struct path *prefix;
+const struct file *f;
+{
+	const char *ext;
+
+	if (f->obj && objdir != NULL) {
+		write_objdir (out, sc);
+	} else {
+		str_puts (out, path_str (prefix));
+	}
+	str_putc (out, '/');
+
+	ext = strrchr (f->name, '.');
+	if (ext != NULL && strchr (ext, '/') == NULL) {
+		str_write (out, f->name, ext - f->name);
+	} else {
+		str_puts (out, f->name);
+	}
+	str_puts (out, ".d");
+}
+
+/*
+ * Parse the deps out of a depfile:
+ *	foo.o: foo.c foo.h \
+ *	  bar\ baz.h
+ *	foo.h:
+ */
+void
+depfile_add (e, word, cap)
+struct sentry *e;
+str_t *word;
+size_t *cap;
+{
+	if (word->len == 0)
+		return;
+
+	if (e->ndeps == *cap) {
+		*cap = *cap ? *cap * 2 : 16;
+		e->deps = renew (e->deps, *cap + 1, char *);
+	}
+	e->deps[e->ndeps++] = state_intern (str_get (word))->s;
+	str_reset (word);
+}
+
+void
+depfile_parse (e, data, len)
+struct sentry *e;
+const char *data;
+size_t len;
+{
+	const char *p, *end = data + len;
+	bool in_deps = false;
+	size_t cap = 0;
+	str_t word;
+
+	str_new (&word);
+	for (p = data; p < end; ++p) {
+		switch (*p) {
+		case '\\':
+			if (p + 1 < end && p[1] == '\n') {
+				++p;
+				goto sep;
+			} else if (p + 2 < end && p[1] == '\r' && p[2] == '\n') {
+				p += 2;
+				goto sep;
+			} else if (p + 1 < end && (p[1] == ' ' || p[1] == '#' || p[1] == '\\')) {
+				++p;
+			}
+			str_putc (&word, *p);
+			break;
+		case '$':
+			if (p + 1 < end && p[1] == '$')
+				++p;
+			str_putc (&word, *p);
+			break;
+		case ':':
+			if (!in_deps && (p + 1 == end || isspace ((unsigned char)p[1]))) {
+				in_deps = true;
+				str_reset (&word);
+				break;
+			}
+			str_putc (&word, *p);
+			break;
+		case '\n':
+			if (in_deps)
+				depfile_add (e, &word, &cap);
+			str_reset (&word);
+			in_deps = false;
+			break;
+		case ' ':
+		case '\t':
+		case '\r':
+		sep:
+			if (in_deps)
+				depfile_add (e, &word, &cap);
+			str_reset (&word);
+			break;
+		default:
+			str_putc (&word, *p);
+			break;
+		}
+	}
+
+	if (in_deps)
+		depfile_add (e, &word, &cap);
+	str_free (&word);
+}
+
+/* read the depfile of `f`, and remember its deps; returns the record */
+struct sentry *
+depfile_read (sc, prefix, f)
+const struct scope *sc;
+const struct path *prefix;
+const struct file *f;
+{
+	struct sentry *e;
+	str_t path;
+	char *data;
+	size_t len;
+
+	str_new (&path);
+	depfile_path (&path, sc, prefix, f);
+	data = read_file (str_get (&path), &len);
+	if (verbose >= 2)
+		printf ("depfile('%s'): %s\n", str_get (&path), data != NULL ? "found" : "not found");
+	str_free (&path);
+
+	if (data == NULL)
+		return NULL;
+
+	e = state_find (sc, f->name, true);
+	free (e->deps);
+	e->deps = NULL;
+	e->ndeps = 0;
+	e->depfile = true;
+	depfile_parse (e, data, len);
+	state_dirty = true;
+	free (data);
+
+	return e;
+}
+
+/* BUILDING */
+
+struct build {
+	struct timespec	 t;
+	struct file	*f;
+	bool		 obj;
+};
+
+void
+build_init (out, t, f, obj)
+struct build	*out;
+struct timespec	 t;
+struct file	*f;
+bool		 obj;
+{
+	out->t = t;
+	out->f = f;
+	out->obj = obj;
+}
+
+int
+build_deps (sc, deps, prefix, mt, maxt, needs_update)
+struct scope *sc;
+struct dep_list *deps;
+const struct path *prefix;
+struct timespec *mt, *maxt;
+int *needs_update;
+{
+	extern int build_dir ();
+	struct build b;
+	size_t i;
+	int ec = 0;
+
+	/*
+	 * Building a prerequisite may parse more of the tree and grow the
+	 * array, so look it up again for every dep.
+	 */
+	for (i = 0; i < dl_len (deps); ++i) {
+		if (build_dir (&b, sc, dl_get (deps, i)->path, prefix) == 0) {
+			deps->a->v[i].obj = b.obj;
+
+			if (tv_cmp (&b.t, mt) > 0)
+				*needs_update = 1;
+			if (tv_cmp (&b.t, maxt) > 0)
+				*maxt = b.t;
+		} else {
+			ec = 1;
+			if (!conterr)
+				break;
+		}
+	}
+
+	return ec;
+}
+
+/*
+ * Whether build_dir() can follow the dep `p` of a depfile from `sc`: it
+ * must not leave the tree, and unless it exists, be a target of `sc`.
+ */
+bool
+depfile_buildable (sc, p, exists)
+const struct scope *sc;
+const struct path *p;
+bool exists;
+{
+	const struct path *q;
+
+	if (p->type == PATH_NULL)
+		return false;
+	if (!exists)
+		return p->type == PATH_NAME && p[1].type == PATH_NULL
+		    && find_file (sc_dir (sc), p->name) != NULL;
+	for (q = p; q->type == PATH_SUPER; ++q) {
+		if (sc->parent == NULL)
+			return false;
+		sc = sc->parent;
+	}
+	return true;
+}
+
+/*
+ * Build the deps found in the depfile of `f`, like build_deps(), so that a
+ * generated header is updated before `f`, and `.RESTAT:` applies to it.
+ * A dep outside of the tree is only stat()ed, and one that vanished and
+ * has no rule forces an update, the recipe sorts it out.
+ */
+int
+build_depfile (sc, prefix, f, maxt, needs_update)
+struct scope *sc;
+const struct path *prefix;
+struct file *f;
+struct timespec *maxt;
+int *needs_update;
+{
+	extern int build_dir ();
+	struct sentry *e;
+	struct timespec t;
+	struct build b;
+	struct path *p;
+	str_t path;
+	char *name;
+	size_t i;
+	int exists, ec = 0;
+
+	e = state_find (sc, f->name, false);
+	if (e == NULL || !e->depfile) {
+		/* no record yet, maybe the depfile is still around */
+		e = depfile_read (sc, prefix, f);
+		if (e == NULL)
+			return 0;
+	}
+
+	str_new (&path);
+	for (i = 0; i < e->ndeps; ++i) {
+		str_reset (&path);
+		if (e->deps[i][0] != '/') {
+			str_puts (&path, path_str (prefix));
+			str_putc (&path, '/');
+		}
+		str_puts (&path, e->deps[i]);
+		exists = cached_mtime (str_get (&path), true, &t) == 0;
+
+		p = NULL;
+		if (e->deps[i][0] != '/') {
+			name = strdup (e->deps[i]);
+			p = parse_path (name);
+			free (name);
+		}
+
+		if (p != NULL && depfile_buildable (sc, p, exists)) {
+			if (build_dir (&b, sc, p, prefix) != 0) {
+				ec = 1;
+				if (!conterr)
+					break;
+				continue;
+			}
+			t = b.t;
+		} else if (!exists) {
+			if (verbose >= 2)
+				printf ("depfile: '%s' vanished\n", e->deps[i]);
+			*needs_update = 1;
 			continue;
-		} else if (starts_with (s, "include ")) {
-			if (!run)
-				goto cont;
+		}
+
+		if (tv_cmp (&t, &f->mtime) > 0) {
+			if (verbose >= 2 && !*needs_update)
+				printf ("depfile: '%s' changed\n", e->deps[i]);
+			*needs_update = 1;
+		}
+		if (tv_cmp (&t, maxt) > 0)
+			*maxt = t;
+	}
+	str_free (&path);
+	return ec;
+}
+
+/* TODO: refactor this function, to be less complicated */
+int
+build_file (out, sc, name, prefix)
+struct build *out;
+struct scope *sc;
+char *name;
+const struct path *prefix;
+{
+	extern int build_dir ();
+	int needs_update;
+	struct scope *sub;
+	struct path *new_prefix;
+	struct file *f;
+	struct timespec maxt;
+	struct inference *inf;
+	struct expand_ctx ctx;
+	struct filetime ft;
+	struct dep *dep;
+	size_t i;
+	struct cbuilt *cb;
+	struct build b;
+	const char *bname;
+	char *scoped_rule = NULL;
+	char **s, *p;
+	int ec, rc, attrs;
+
+	if (verbose >= 2) {
+		printf ("dir %s", path_str (prefix));
+		if (name)
+			printf (" (%s)", name);
+		printf (" ...\n");
+	}
+
+	if (!sc->created) {
+		sc_mkdir_p (sc);
+		sc->created = true;
+	}
+
+	switch (sc->type) {
+	case SC_DIR:
+		/* lazily parse subdirectories */
+		if (sc_dir (sc) == NULL)
+			parse_dir (sc, prefix);
+
+		/* if no rule specified to build, use the default rule */
+		if (name == NULL && sc_dir (sc)->default_file != NULL)
+			name = sc_dir (sc)->default_file;
+
+		if (name != NULL) {
+			/* try finding an explicitly defined file */
+			f = find_file (sc_dir (sc), name);
+
+			if (f == NULL) {
+				/* try finding and building a subdirectory */
+				sub = find_subdir (sc, name);
+				if (sub != NULL) {
+					new_prefix = path_cat_name (prefix, name);
+					return build_file (out, sub, NULL, new_prefix);
+				}
+
+				/* try finding an inference rule */
+				f = try_find (sc, prefix, name);
+				if (f == NULL)
+					errx (1, "%s: no such file: %s", sc_path (sc), name);
+			} else if (f->state != FILE_DONE) {
+				/*
+				 * A finished file is not looked at again: its
+				 * mtime was refreshed after its recipe ran, and
+				 * the stat cache would return the same otherwise.
+				 */
+				get_mtime (&ft, sc, prefix, name);
+				f->mtime = ft.t;
+				f->obj = ft.obj;
+			}
+		} else {
+			f = sc_dir (sc)->nfiles > 0 ? sc_dir (sc)->files[0] : NULL;
+			if (f == NULL)
+				errx (1, "%s: nothing to build", sc_path (sc));
+			if (f->lazy != NULL)
+				file_force (f);
+			get_mtime (&ft, sc, prefix, f->name);
+			f->mtime = ft.t;
+			f->obj = ft.obj;
+		}
+
+		switch (f->state) {
+		case FILE_PENDING:
+			f->state = FILE_BUSY;
+			break;
+		case FILE_BUSY:
+			errx (1, "%s: target '%s' is already being built. Circular dependency?", sc_path (sc), name);
+			break;
+		case FILE_DONE:
+			build_init (out, f->ltime, f, f->obj);
+			return f->err;
+		}
 
-			strip_comment (s);
-			t = expand (sc, dir, trim (s + 8), NULL);
-			if (*t == '/') {
-				u = t;
-			} else {
-				u = strdup (path_cat_str (dir, t));
+		/* if this file has no rule, try to find an inference rule */
+		if (f->inf == NULL && (f->rule == NULL || *f->rule->code == NULL)) {
+			/* try finding an inference rule */
+			inf = name != NULL ? find_inf (sc, prefix, name) : NULL;
+
+			if (inf != NULL) {
+				/* instantiate inference rule */
+				inf_inst_file (f, inf);
+			} else if (f->rule == NULL) {
+				if (tv_cmp (&f->mtime, &time_zero) > 0) {
+					f->state = FILE_DONE;
+					f->ltime = f->mtime;
+					build_init (out, f->mtime, f, f->obj);
+					return 0;
+				} else {
+					errx (1, "%s: no rule to build: %s", sc_path (sc), name);
+				}
 			}
-			oldcline = cline;
-			parse (sc, dir, u);
-			sc_dir (sc)->done = false;
-			cline = oldcline;
-			if (u != t)
-				free (u);
-			free (t);
-		} else if (starts_with (s, "-include ") || starts_with (s, "sinclude ")) {
-			if (!run)
-				goto cont;
+		}
 
-			strip_comment (s);
-			t = expand (sc, dir, trim (s + 9), NULL);
-			if (*t == '/') {
-				u = t;
-			} else {
-				u = strdup (path_cat_str (dir, t));
+		attrs = file_attrs (sc, f);
+		needs_update = (tv_cmp (&f->mtime, &time_zero) <= 0);
+		maxt = f->mtime;
+
+		if (f->err) {
+			f->state = FILE_DONE;
+			return 1;
+		}
+
+		/* build dependencies and record timestamps */
+		if (build_deps (sc, &f->deps, prefix, &f->mtime, &maxt, &needs_update) != 0) {
+			f->err = true;
+			if (!conterr) {
+				f->state = FILE_DONE;
+				return 1;
 			}
+		}
 
-			if (access (u, R_OK) == 0)
-				parse (sc, dir, u);
+		/* build dependencies from inference rule */
+		if (f->inf != NULL) {
+			if (build_deps (sc, &f->inf->deps, prefix, &f->mtime, &maxt, &needs_update) != 0) {
+				f->err = true;
+				if (!conterr) {
+					f->state = FILE_DONE;
+					return 1;
+				}
+			}
+		}
 
-			sc_dir (sc)->done = false;
+		/* deps discovered by the recipe during an earlier run */
+		if ((attrs & ATTR_DEPFILE) && build_depfile (sc, prefix, f, &maxt, &needs_update) != 0) {
+			f->err = true;
+			if (!conterr) {
+				f->state = FILE_DONE;
+				return 1;
+			}
+		}
 
-			if (u != t)
-				free (u);
-			free (t);
-		} else if (is_directive (&t, s, "include")) {
-			if (!run)
-				goto cont;
+		f->state = FILE_DONE;
 
-			errx (1, "%s:%d: please use .SUBDIRS: or .FOREIGN: now", path, cline);
-		} else if (is_directive (&t, s, "if")) {
-			if (iflen == MAX_IFSTACK)
-				errx (1, "%s:%d: maximum .if depth of %d reached", path, cline, MAX_IFSTACK);
-			x = parse_expr (sc, dir, t) & 0x01;
-			ifstack[iflen++] = x * (IF_VAL | IF_HAS);
-		} else if (is_directive (NULL, s, "else")) {
-			if (iflen == 0)
-				errx (1, "%s:%d: not in .if", path, cline);
-			t = &ifstack[iflen - 1];
-			*t = (!(*t & IF_HAS) * (IF_VAL | IF_HAS)) | (*t & IF_HAS);
-		} else if (is_directive (&t, s, "elif")) {
-			if (iflen == 0)
-				errx (1, "%s:%d: not in .if", path, cline);
-			x = parse_expr (sc, dir, t);
-			t = &ifstack[iflen - 1];
-			*t = ((!(*t & IF_HAS) && x) * (IF_VAL | IF_HAS)) | (*t & IF_HAS);
-		} else if (is_directive (NULL, s, "endif")) {
-			if (iflen == 0)
-				errx (1, "%s:%d: not in .if", path, cline);
-			--iflen;
-		} else if (is_directive (&t, s, "template")) {
-			str_new (&text);
+		if (!needs_update) {
+			f->ltime = (attrs & ATTR_RESTAT) ? restat_ltime (sc, f) : f->mtime;
+			build_init (out, f->ltime, f, f->obj);
+			return 0;
+		}
 
-			tm = new (struct template);
-			tm->name = strdup (strip_comment (t));
+		if (f->err)
+			return 1;
 
-			for (free (s); (s = readline (file, &cline)) != NULL; free (s)) {
-				if (is_directive (NULL, s, "endt") || is_directive (NULL, s, "endtemplate"))
-					break;
+		s = f->rule->code;
 
-				str_puts (&text, s);
-				str_putc (&text, '\n');
-			}
+		/* rule is a "sum" rule, so doesn't need to be built */
+		if (s == NULL || *s == NULL) {
+			f->ltime = maxt;
+			build_init (out, maxt, f, f->obj);
+			return 0;
+		}
 
-			if (run) {
-				tm->text = str_release (&text);
-				SLIST_INSERT_HEAD (&sc_dir (sc)->templates, tm, next);
-			} else {
-				free (tm);
-				str_free (&text);
-			}
-		} else if (is_directive (&t, s, "expand")) {
-			if (!run)
-				goto cont;
-			tm = find_template (sc, strip_comment (t));
-			if (tm == NULL)
-				errx (1, "%s:%d: no such template: %s", cpath, cline, t);
-			tfile = fmemopen (tm->text, strlen (tm->text), "r");
-			do_parse (sc, dir, "template", tfile);
-			fclose (tfile);
-		} else if (is_target (&t, s, ".DEFAULT")) {
-			if (run)
-				sc_dir (sc)->default_file = strdup (strip_comment (t));
-		} else if (is_target (NULL, s, ".POSIX")) {
-			if (run)
-				warnx ("%s:%d: this is not a POSIX-compatible make", path, cline);
-		} else if (is_target (NULL, s, ".SUFFIXES")) {
-			if (run)
-				warnx ("%s:%d: this make doesn't require .SUFFIXES", path, cline);
-		} else if (is_target (&t, s, ".SUBDIRS")) {
-			if (run) {
-				u = expand (sc, dir, t, NULL);
-				parse_subdirs (sc, dir, u);
-				free (u);
+		if (attrs & ATTR_RESTAT)
+			restat_before (sc, prefix, f);
+
+		/* run commands */
+		ectx_file (&ctx, sc, f);
+		for (; *s != NULL; ++s) {
+			if ((rc = runcom (sc, prefix, *s, rule_prog (f->rule, s), &ctx, name)) != 0) {
+				p = sc_path (sc);
+				fprintf (stderr, "%s: command failed with %d: %s\n", p, rc, *s);
+				free (p);
+				ectx_free (&ctx);
+				f->err = true;
+				return 1;
 			}
-		} else if (is_target (&t, s, ".FOREIGN")) {
-			if (run) {
-				u = expand (sc, dir, t, NULL);
-				parse_foreign (sc, u);
-				free (u);
+		}
+		ectx_free (&ctx);
+
+		/* update timestamp, bypassing the cache */
+		stat_refresh = true;
+		get_mtime (&ft, sc, prefix, f->name);
+		stat_refresh = false;
+		f->mtime = ft.t;
+		f->obj = ft.obj;
+		f->ltime = (attrs & ATTR_RESTAT) ? restat_after (sc, prefix, f) : f->mtime;
+		if (attrs & ATTR_DEPFILE)
+			depfile_read (sc, prefix, f);
+		build_init (out, f->ltime, f, f->obj);
+		return 0;
+	case SC_FOREIGN:
+		bname = name != NULL ? name : "";
+		SLIST_FOREACH (cb, &sc_foreign (sc)->built, next) {
+			if (strcmp (cb->name, bname) == 0) {
+				build_init (out, cb->t, NULL, cb->obj);
+				return 0;
 			}
-		} else if (is_target (&t, s, ".EXPORTS")) {
-			if (run)
-				parse_exports (sc, t);
-		} else if (s[0] == '\t') {
-			if (!run)
-				goto cont;
+		}
 
-			if (r == NULL)
-				errx (1, "%s:%d: syntax error", path, cline);
+		/* run the "subdir?" rule, to test if the target needs to be updated */
+		new_prefix = path_cat (prefix, &path_super);
 
-			if (len == cap) {
-				cap *= 2;
-				r->code = renew (r->code, cap + 1, char *);
-			}
 
-			r->code[len++] = strdup (s + 1);
-			r->code[len] = NULL;
-		} else if ((t = parse_def (s, &name, &value)) != NULL) {
-			if (!run)
-				goto cont;
+		/* build ordering deps declared on the bare subdir name */
+		DL_FOREACH (dep, i, &sc_foreign (sc)->deps) {
+			if (build_dir (&b, sc->parent, dep->path, new_prefix) != 0)
+				return 1;
+		}
 
-			if (trim (name) == t)
-				goto invalid;
+		/* build the label used in [scope] $ ... output */
+		if (name != NULL && *name != '\0') {
+			char *tmp = xstrcat (sc->name, "/");
+			scoped_rule = xstrcat (tmp, name);
+			free (tmp);
+		} else {
+			scoped_rule = strdup (sc->name);
+		}
 
-			switch (*t) {
-			case ':':
-				r = parse_rule (sc, dir, s, t, help);
-				if (r == NULL)
-					goto cont;
+		f = sc_foreign (sc)->test;
+		if (f != NULL) {
+			assert (f->inf == NULL);
 
-				len = 0;
-				cap = 1;
-				r->code = newa (cap + 1, char *);
-				r->code[0] = NULL;
-				break;
-			case '=':
-				/* TODO: write a proper function for checking macro names */
-				if (*t == '\0')
-					errx (1, "%s:%d: invalid macro name", path, cline);
+			ec = 0;
+			DL_FOREACH (dep, i, &f->deps) {
+				if (build_dir (&b, sc->parent, dep->path, new_prefix) != 0) {
+					ec = 1;
+					if (!conterr) {
+						free (scoped_rule);
+						return ec;
+					}
+				}
+			}
 
-				*t = '\0';
+			if (ec != 0) {
+				free (scoped_rule);
+				return ec;
+			}
 
-				parse_assign (sc, dir, s, t, help);
-				break;
-			default:
-				abort ();
+			ectx_init (
+				/* ctx    */ &ctx,
+				/* sc     */ sc,
+				/* target */ strdup (name != NULL ? name : ""),
+				/* deps   */ &f->deps,
+				/* infdeps*/ NULL
+			);
+
+			needs_update = 0;
+			for (s = f->rule->code; *s != NULL; ++s) {
+				if (runcom (sc->parent, new_prefix, *s, rule_prog (f->rule, s), &ctx, scoped_rule) != 0) {
+					needs_update = 1;
+					break;
+				}
 			}
 		} else {
-		invalid:
-			warnx ("%s:%d: invalid line: %s", path, cline, s);
+			needs_update = 1;
 		}
 
-	cont:
-		help = NULL;
-	}
-}
+		if (!needs_update) {
+			if (name != NULL && get_mtime (&ft, sc, prefix, name) == 0) {
+				build_init (out, ft.t, NULL, ft.obj);
+			} else {
+				build_init (out, time_zero, NULL, false);
+			}
+			foreign_remember (sc, name, out->t, out->obj);
+			free (scoped_rule);
+			return 0;
+		}
 
-void
-parse (sc, dir, path) 
-struct scope *sc;
-const struct path *dir;
-char *path;
-{
-	struct directory *dirx;
-	FILE *file;
+		/* run the "subdir!" rule */
+		f = sc_foreign (sc)->exec;
+		if (f == NULL)
+			errx (1, "%s: missing '%s!' rule", sc_path (sc->parent), sc->name);
+		assert (f->inf == NULL);
+
+		ectx_init (
+			/* ctx    */ &ctx,
+			/* sc     */ sc,
+			/* target */ strdup (name != NULL ? name : ""),
+			/* deps   */ &f->deps,
+			/* infdeps*/ NULL
+		);
+
+		ec = 0;
+		DL_FOREACH (dep, i, &f->deps) {
+			if (build_dir (&b, sc->parent, dep->path, new_prefix) != 0) {
+				ec = 1;
+				if (!conterr) {
+					free (scoped_rule);
+					return ec;
+				}
+			}
+		}
+		if (ec != 0) {
+			free (scoped_rule);
+			return ec;
+		}
 
-	file = fopen (path, "r");
-	if (file == NULL) {
-		/* err (1, "fopen(\"%s\")", path); */
-		dirx = new (struct directory);
-		SLIST_INIT (&dirx->subdirs);
-		TAILQ_INIT (&dirx->files);
-		SLIST_INIT (&dirx->macros);
-		SLIST_INIT (&dirx->emacros);
-		SLIST_INIT (&dirx->infs);
-		SLIST_INIT (&dirx->templates);
-		dirx->done = false;
-		sc->inner.dir = dirx;
-		return;
-	}
+		for (s = f->rule->code; *s != NULL; ++s) {
+			if ((rc = runcom (sc->parent, new_prefix, *s, rule_prog (f->rule, s), &ctx, scoped_rule)) != 0) {
+				p = sc_path (sc->parent);
+				fprintf (stderr, "%s: command failed with %d: %s\n", p, rc, *s);
+				free (p);
+				free (scoped_rule);
+				return 1;
+			}
+		}
 
-	if (sc->inner.dir == NULL) {
-		dirx = new (struct directory);
-		SLIST_INIT (&dirx->subdirs);
-		TAILQ_INIT (&dirx->files);
-		SLIST_INIT (&dirx->macros);
-		SLIST_INIT (&dirx->emacros);
-		SLIST_INIT (&dirx->infs);
-		SLIST_INIT (&dirx->templates);
-		dirx->done = false;
-		sc->inner.dir = dirx;
-	} else if (sc_dir (sc)->done) {
-		errx (1, "%s: parsing this file again?", path);
+		if (name != NULL && get_mtime (&ft, sc, prefix, name) == 0) {
+			build_init (out, ft.t, NULL, ft.obj);
+		} else {
+			build_init (out, now (), NULL, false);
+		}
+		foreign_remember (sc, name, out->t, out->obj);
+		free (scoped_rule);
+		return 0;
 	}
-
-	do_parse (sc, dir, path, file);
-	sc_dir (sc)->done = true;
-
-	fclose (file);
+	
+	abort ();
 }
 
-void
-parse_dir (sc, dir)
+int
+build_dir (out, sc, path, prefix)
+struct build *out;
 struct scope *sc;
-const struct path *dir;
+const struct path *path, *prefix;
 {
-	char *path;
+	struct path *new_prefix, *full_path;
+	struct scope *sub;
+	struct timespec mt, pmt, pmaxt;
+	const struct path *p;
+	struct file *pf;
+	str_t tmp;
+	int pnu;
 
-	path = strdup (path_cat_str (dir, sc->makefile));
-	parse (sc, dir, path);
-	free (path);
-}
+	switch (path[0].type) {
+	case PATH_SUPER:
+		new_prefix = path_cat (prefix, &path[0]);
+		return build_dir (out, sc->parent, path + 1, new_prefix);
+	case PATH_NULL:
+		return build_file (out, sc, NULL, prefix);
+	case PATH_NAME:
+		if (path[1].type == PATH_NULL)
+			return build_file (out, sc, path[0].name, prefix);
 
-struct scope *
-parse_recursive (dir, makefile)
-const struct path *dir;
-char *makefile;
-{
-	struct path *mfpath, *ppath;
-	struct scope *sc, *parent;
-	char *path, *name;
+		if (sc->type != SC_DIR)
+			errx (1, "%s: invalid path", sc_path (sc));
 
-	tmppath.name = makefile;
-	mfpath = path_cat (dir, &tmppath);
-	if (access (path_to_str (mfpath), F_OK) != 0) {
-		sc = NULL;
-		goto ret;
-	}
+		if (sc_dir (sc) == NULL)
+			parse_dir (sc, prefix);
 
-	ppath = path_cat (dir, &path_super);
-	parent = parse_recursive (ppath, makefile);
-	if (parent == NULL)
-		parent = parse_recursive (ppath, MAKEFILE);
-	free (ppath);
+		/* `path` is a tail of an interned path, without a string */
+		arena_enter (&scratch);
+		str_scratch (&tmp);
+		path_write (&tmp, path);
+		pf = find_file (sc_dir (sc), str_get (&tmp));
+		arena_leave (&scratch);
+		if (pf != NULL && dl_len (&pf->deps) > 0) {
+			pmt = pf->mtime;
+			pmaxt = pf->mtime;
+			pnu = 0;
+			if (build_deps (sc, &pf->deps, prefix, &pmt, &pmaxt, &pnu) != 0)
+				return 1;
+		}
 
-	name = path_basename (dir);
+		new_prefix = path_cat (prefix, &path[0]);
 
-	if (parent != NULL) {
-		if (parent->type != SC_DIR)
-			errx (1, "%s: invalid parent type", path_to_str (mfpath));
+		sub = find_subdir (sc, path[0].name);
+		if (sub == NULL) {
+			/*
+			 * Undeclared subdirectory: treat the dependency as a
+			 * plain source file.  Assemble the full path, stat it,
+			 * and return its mtime.  No Mkfile is read and no rules
+			 * are applied.
+			 */
+			if (access (path_str (new_prefix), F_OK) != 0)
+				errx (1, "%s: invalid subdir: %s",
+				    sc_path (sc), path[0].name);
 
-		SLIST_FOREACH (sc, &sc_dir (parent)->subdirs, next) {
-			if (strcmp (sc->name, name) == 0) {
-				if (sc->type != SC_DIR)
-					errx (1, "%s: invalid type", path_to_str (mfpath));
-				goto parselbl;
-			}
+			full_path = new_prefix;
+			for (p = path + 1; p->type != PATH_NULL; ++p)
+				full_path = path_cat (full_path, p);
+
+			if (stat_mtime (path_str (full_path), true, &mt) != 0)
+				errx (1, "%s: no such file: %s",
+				    sc_path (sc), path[0].name);
+			build_init (out, mt, NULL, false);
+			return 0;
 		}
 
-		goto create;
-	} else {
-	create:
-		sc = new (struct scope);
-		sc->type = SC_DIR;
-		sc->name = name;
-		sc->inner.dir = NULL;
+		return build_dir (out, sub, path + 1, new_prefix);
 	}
 
-parselbl:
-	sc->makefile = makefile;
-	sc->parent = parent;
-	path = strdup (path_to_str (mfpath));
-	parse (sc, dir, path);
-	free (path);
+	abort ();
+}
 
-ret:
-	free (mfpath);
-	return sc;
+int
+build (out, sc, path)
+struct build *out;
+struct scope *sc;
+const struct path *path;
+{
+	return build_dir (out, sc, path, path_dot ());
 }
 
-struct path *	
-parse_subdir (prefix, sub)
-const struct path *prefix;
-struct scope *sub;
+/* build the goals given on the command line, or the default one */
+int
+build_goals (sc, argc, argv)
+struct scope *sc;
+int argc;
+char **argv;
 {
-	struct path *np;
+	struct path *path;
+	struct build b;
+	int i, ec, n = 0;
 
-	tmppath.name = sub->name;
-	np = path_cat (prefix, &tmppath);
-	parse_dir (sub, np);
-	return np;
+	for (i = 0, ec = 0; ec == 0 && i < argc; ++i) {
+		if (argv[i] == NULL)
+			continue;
+
+		path = parse_path (argv[i]);
+		ec = build (&b, sc, path) != 0;
+		++n;
+	}
+
+	if (ec == 0 && n == 0)
+		ec = build (&b, sc, path_dot ());
+
+	return ec;
 }
 
-/* INFERENCE RULES */
+/* HELP */
 
-char *
-replace_suffix (name, sufx)
-const char *name, *sufx;
+void
+help_macros (sc)
+struct scope *sc;
 {
-	const char *ext;
-	char *out;
-	size_t len_name, len_sufx;
+	struct macro *m;
 
-	ext = strrchr (name, '.');
-	len_name = ext != NULL ? (size_t)(ext - name) : strlen (name);
-	len_sufx = strlen (sufx);
+	assert (sc_dir (sc) != NULL);
 
-	out = newa (len_name + len_sufx + 1, char);
-	memcpy (out, name, len_name);
-	memcpy (out + len_name, sufx, len_sufx);
-	out[len_name + len_sufx] = '\0';
+	SLIST_FOREACH (m, &sc_dir (sc)->macros, next) {
+		if (m->help == NULL)
+			continue;
 
-	return out;
+		printf ("  %-28s- %s\n", m->name, m->help);
+	}
 }
 
-/* instantiate a new file from an inference rule */
-struct file *
-inst_inf (sc, inf, name)
+void
+help_files (prefix, sc)
+const struct path *prefix;
 struct scope *sc;
-struct inference *inf;
-const char *name;
 {
+	struct path *new_prefix;
+	struct scope *sub;
 	struct file *f;
-	struct dep *dep;
+	const char *p;
+	size_t i;
+	int n;
 
-	{
-		struct dep_list ideps;
-		dep = new_dep_name (replace_suffix (name, inf->from));
-		TAILQ_INIT (&ideps);
-		TAILQ_INSERT_TAIL (&ideps, dep, link);
-		f = new_file (
-			/* name */ strdup (name),
-			/* rule */ inf->rule,
-			/* time */ time_zero,
-			/* deps */ &ideps,
-			/* help */ NULL,
-			/* inf  */ inf,
-			/* obj  */ false
-		);
+	p = path_str (prefix);
+	if (strcmp (p, ".") == 0)
+		p = NULL;
+
+	for (i = 0; i < sc_dir (sc)->nfiles; ++i) {
+		f = sc_dir (sc)->files[i];
+		if (f->help == NULL)
+			continue;
+
+		n = 0;
+		printf ("  ");
+		if (p != NULL) {
+			printf ("%s/", p);
+			n += strlen (p) + 1;
+		}
+		printf ("%s", f->name);
+		n += strlen (f->name);
+		printf ("%-*s- %s\n", n < 28 ? 28 - n : 0, "", f->help);
 	}
-	dir_add_file (sc_dir (sc), f);
 
-	return f;
+	if (!verbose)
+		return;
+
+	SLIST_FOREACH (sub, &sc_dir (sc)->subdirs, next) {
+		if (sub->type != SC_DIR)
+			continue;
+
+		new_prefix = parse_subdir (prefix, sub);
+		help_files (new_prefix, sub);
+	}
 }
 
-/* instantiate an inference rule on an existing file */
-void
-inf_inst_file (f, inf)
-struct file *f;
-struct inference *inf;
+int
+help (prefix, sc)
+const struct path *prefix;
+struct scope *sc;
 {
-	struct dep *dep;
+	extern int usage ();
+	usage (1);
 
-	assert (f->inf == NULL);
-	/* TODO: this is ugly */
-	assert (f->rule == NULL || f->rule->code == NULL || *f->rule->code == NULL);
+	fputs ("\nOptions:\n", stderr);
+	fputs ("  -C dir                      - chdir(dir)\n", stderr);
+	fprintf (stderr, "  -f file                     - read `file` instead of \"%s\"\n", MAKEFILE);
+	fputs ("  -o objdir                   - put build artifacts into objdir\n", stderr);
+	fputs ("  -V var                      - print expanded version of var\n", stderr);
+	fputs ("  -h                          - print help page\n", stderr);
+	fputs ("  -hv                         - print help page, recursively\n", stderr);
+	fputs ("  -p                          - dump tree\n", stderr);
+	fputs ("  -pv                         - dump tree, recursively\n", stderr);
+	fputs ("  -s                          - do not echo commands\n", stderr);
+	fputs ("  -k                          - continue processing after errors are encountered\n", stderr);
+	fputs ("  -S                          - stop processing when errors are encountered (default)\n", stderr);
+	fputs ("  -t file                     - write build timings to file (- for stdout)\n", stderr);
+	fputs ("  -v                          - verbose output\n", stderr);
 
-	dep = new_dep_name (replace_suffix (f->name, inf->from));
+	if (sc != NULL) {
+		fputs ("\nMacros:\n", stderr);
+		help_macros (sc);
 
-	/* prepend dependency to file */
-	TAILQ_INSERT_HEAD (&f->deps, dep, link);
-	f->inf = inf;
-	f->rule = inf->rule;
+		fputs ("\nTargets:\n", stderr);
+		help_files (prefix, sc);
+	}
+
+	fprintf (stderr, "\nbmk v%s, send bug reports to <%s>.\n", BMK_VERSION, BMK_EMAIL);
+	return 1;
 }
 
-struct inference *
-find_inf (sc, dir, name)
+/* DUMP */
+
+void
+print_attrs (sc, flag, name)
 struct scope *sc;
-const struct path *dir;
+int flag;
 const char *name;
 {
-	extern struct file *try_find ();
-	struct inference *inf;
-	struct file *sf;
-	char *sn, *base;
-	const char *ext;
-
-	ext = strrchr (name, '.');
-	base = strdup (name);
-	if (ext == NULL) {
-		ext = "";
-	} else {
-		base[ext - name] = '\0';
-	}
+	struct attr *a;
+	bool any = false;
 
-	inf = NULL;
-	SLIST_FOREACH (inf, &sc_dir (sc)->infs, next) {
-		if (strcmp (inf->to, ext) == 0) {
-			sn = xstrcat (base, inf->from);
-			sf = find_file (sc_dir (sc), sn);
-			if (sf == NULL)
-				sf = try_find (sc, dir, sn);
-			free (sn);
-			if (sf != NULL)
-				break;
-		}
+	SLIST_FOREACH (a, &sc_dir (sc)->attrs, next) {
+		if (!(a->flags & flag))
+			continue;
+		if (!any)
+			printf ("%s:", name);
+		printf (" %s", a->name);
+		any = true;
 	}
 
-	free (base);
-	return inf != NULL || sc->parent == NULL ? inf : find_inf (sc->parent, dir, name);
+	if (any)
+		printf ("\n");
 }
 
-struct file *
-try_find (sc, dir, name)
+void
+print_sc (prefix, sc)
+const struct path *prefix;
 struct scope *sc;
-const struct path *dir;
-const char *name;
 {
+	struct path *new_prefix;
 	struct inference *inf;
-	struct filetime ft;
+	struct scope *sub;
+	struct macro *m;
+	struct dep *dep;
+	size_t i, j;
 	struct file *f;
+	struct rule *r;
+	str_t tmp;
+	char **s;
 
-	get_mtime (&ft, sc, dir, name);
-	if (tv_cmp (&ft.t, &time_zero) <= 0) {
-		inf = find_inf (sc, dir, name);
-		if (inf == NULL)
-			return NULL;
-		return inst_inf (sc, inf, name);
+	str_new (&tmp);
+	if (verbose) {
+		sc_path_into (&tmp, sc);
+		printf ("=== %s\n", str_get (&tmp));
 	}
 
-	f = new_file (
-		/* name */ strdup (name),
-		/* rule */ NULL,
-		/* time */ ft.t,
-		/* deps */ NULL,
-		/* help */ NULL,
-		/* inf  */ NULL,
-		/* obj  */ ft.obj
-	);
-	dir_add_file (sc_dir (sc), f);
+	if (sc->type != SC_DIR || sc_dir (sc) == NULL)
+		errx (1, "%s: print_sc(): must be of type SC_DIR", sc_path (sc));
 
-	return f;
-}
+	printf (".SUBDIRS:");
+	SLIST_FOREACH (sub, &sc_dir (sc)->subdirs, next) {
+		if (sub->type == SC_DIR)
+			printf (" %s", sub->name);
+	}
+	printf ("\n");
+	printf (".FOREIGN:");
+	SLIST_FOREACH (sub, &sc_dir (sc)->subdirs, next) {
+		if (sub->type == SC_FOREIGN)
+			printf (" %s", sub->name);
+	}
+	printf ("\n");
 
-/* BUILDING */
+	if (sc_dir (sc)->default_file != NULL)
+		printf (".DEFAULT: %s\n", sc_dir (sc)->default_file);
 
-struct build {
-	struct timespec	 t;
-	struct file	*f;
-	bool		 obj;
-};
+	print_attrs (sc, ATTR_RESTAT, ".RESTAT");
+	print_attrs (sc, ATTR_DEPFILE, ".DEPFILE");
+	print_attrs (sc, ATTR_NOFOLLOW, ".NOFOLLOW");
 
-void
-build_init (out, t, f, obj)
-struct build	*out;
-struct timespec	 t;
-struct file	*f;
-bool		 obj;
-{
-	out->t = t;
-	out->f = f;
-	out->obj = obj;
-}
+	SLIST_FOREACH (m, &sc_dir (sc)->macros, next) {
+		if (m->help != NULL)
+			printf ("\n## %s\n", m->help);
+		printf ("%s %s= %s\n", m->name, m->prepend != NULL ? "+" : "", m->value);
+	}
 
-int
-build_deps (sc, deps, prefix, mt, maxt, needs_update)
-struct scope *sc;
-struct dep_list *deps;
-const struct path *prefix;
-struct timespec *mt, *maxt;
-int *needs_update;
-{
-	extern int build_dir ();
-	struct build b;
-	struct dep *dep;
-	int ec = 0;
+	printf ("\n");
 
-	TAILQ_FOREACH (dep, deps, link) {
-		if (build_dir (&b, sc, dep->path, prefix) == 0) {
-			dep->obj = b.obj;
+	for (j = 0; j < sc_dir (sc)->nfiles; ++j) {
+		f = sc_dir (sc)->files[j];
+		if (f->lazy != NULL)
+			file_force (f);
+		if (f->help != NULL)
+			printf ("## %s\n", f->help);
+		printf ("%s:", f->name);
 
-			if (tv_cmp (&b.t, mt) > 0)
-				*needs_update = 1;
-			if (tv_cmp (&b.t, maxt) > 0)
-				*maxt = b.t;
-		} else {
-			ec = 1;
-			if (!conterr)
-				break;
+		DL_FOREACH (dep, i, &f->deps) {
+			str_reset (&tmp);
+			path_write (&tmp, dep->path);
+			printf (" %s", str_get (&tmp));
+		}
+		if (f->inf != NULL) {
+			DL_FOREACH (dep, i, &f->inf->deps) {
+				str_reset (&tmp);
+				path_write (&tmp, dep->path);
+				printf (" %s", str_get (&tmp));
+			}
+		}
+		printf ("\n");
+
+		r = f->rule;
+		if (r != NULL && r->code != NULL) {
+			for (s = r->code; *s != NULL; ++s)
+				printf ("\t%s\n", *s);
 		}
+		printf ("\n");
 	}
 
-	return ec;
-}
+	SLIST_FOREACH (inf, &sc_dir (sc)->infs, next) {
+		printf ("%s%s:", inf->from, inf->to);
+		DL_FOREACH (dep, i, &inf->deps) {
+			str_reset (&tmp);
+			path_write (&tmp, dep->path);
+			printf (" %s", str_get (&tmp));
+		}
+		printf ("\n");
+		if (inf->rule->code != NULL) {
+			for (s = inf->rule->code; *s != NULL; ++s)
+				printf ("\t%s\n", *s);
+			printf ("\n");
+		}
+	}
+	str_free (&tmp);
 
-/* TODO: refactor this function, to be less complicated */
-int
-build_file (out, sc, name, prefix)
-struct build *out;
-struct scope *sc;
-char *name;
-const struct path *prefix;
-{
-	extern int build_dir ();
-	int needs_update;
-	struct scope *sub;
-	struct path *new_prefix;
-	struct file *f;
-	struct timespec maxt;
-	struct inference *inf;
-	struct expand_ctx ctx;
-	struct filetime ft;
-	struct dep *dep;
-	struct cbuilt *cb;
-	struct build b;
-	const char *bname;
-	char *scoped_rule = NULL;
-	char **s;
-	int ec, rc;
+	if (verbose) {
+		SLIST_FOREACH (sub, &sc_dir (sc)->subdirs, next) {
+			if (sub->type != SC_DIR)
+				continue;
 
-	if (verbose >= 2) {
-		printf ("dir %s", path_to_str (prefix));
-		if (name)
-			printf (" (%s)", name);
-		printf (" ...\n");
-	}
+			printf ("\n");
 
-	if (!sc->created) {
-		sc_mkdir_p (sc);
-		sc->created = true;
+			new_prefix = parse_subdir (prefix, sub);
+			print_sc (new_prefix, sub);
+		}
 	}
+}
 
-	switch (sc->type) {
-	case SC_DIR:
-		/* lazily parse subdirectories */
-		if (sc_dir (sc) == NULL)
-			parse_dir (sc, prefix);
+/* WATCH */
 
-		/* if no rule specified to build, use the default rule */
-		if (name == NULL && sc_dir (sc)->default_file != NULL)
-			name = sc_dir (sc)->default_file;
+#if HAVE_INOTIFY_INIT && HAVE_SYS_INOTIFY_H && HAVE_POLL && HAVE_POLL_H
+# define USE_INOTIFY 1
+#endif
 
-		if (name != NULL) {
-			/* try finding an explicitly defined file */
-			f = find_file (sc_dir (sc), name);
+/* a directory containing watched files */
+struct wdir {
+	struct wdir	*next;
+	char		*path;
+	int		 wd;	/* inotify watch, or -1 if polled */
+};
 
-			if (f == NULL) {
-				/* try finding and building a subdirectory */
-				sub = find_subdir (sc, name);
-				if (sub != NULL) {
-					tmppath.name = name;
-					new_prefix = path_cat (prefix, &tmppath);
-					ec = build_file (out, sub, NULL, new_prefix);
-					free (new_prefix);
-					return ec;
-				}
+static struct wdir *wdirs = NULL;
+static int watch_fd = -1;
+static char **watch_argv, *watch_cwd;
 
-				/* try finding an inference rule */
-				f = try_find (sc, prefix, name);
-				if (f == NULL)
-					errx (1, "%s: no such file: %s", sc_path_str (sc), name);
+/* assign each newly cached file to a (watched) directory */
+void
+watch_dirs ()
+{
+	struct scache *c;
+	struct wdir *w;
+	const char *dir;
+	size_t i, len;
+
+	for (i = 0; i < STATE_NBUCKETS; ++i) {
+		for (c = scache_tab[i]; c != NULL; c = c->next) {
+			if (c->wdir != NULL)
+				continue;
+
+			if (c->base == c->path) {
+				dir = ".";
+				len = 1;
+			} else if (c->base == c->path + 1) {
+				dir = "/";
+				len = 1;
 			} else {
-				get_mtime (&ft, sc, prefix, name);
-				f->mtime = ft.t;
-				f->obj = ft.obj;
+				dir = c->path;
+				len = c->base - c->path - 1;
 			}
-		} else {
-			f = TAILQ_FIRST (&sc_dir (sc)->files);
-			if (f == NULL)
-				errx (1, "%s: nothing to build", sc_path_str (sc));
-		}
-
-		switch (f->state) {
-		case FILE_PENDING:
-			f->state = FILE_BUSY;
-			break;
-		case FILE_BUSY:
-			errx (1, "%s: target '%s' is already being built. Circular dependency?", sc_path_str (sc), name);
-			break;
-		case FILE_DONE:
-			build_init (out, f->mtime, f, f->obj);
-			return f->err;
-		}
 
-		/* if this file has no rule, try to find an inference rule */
-		if (f->rule == NULL || *f->rule->code == NULL) {
-			/* try finding an inference rule */
-			inf = name != NULL ? find_inf (sc, prefix, name) : NULL;
+			for (w = wdirs; w != NULL; w = w->next) {
+				if (strlen (w->path) == len && memcmp (w->path, dir, len) == 0)
+					break;
+			}
 
-			if (inf != NULL) {
-				/* instantiate inference rule */
-				inf_inst_file (f, inf);
-			} else if (f->rule == NULL) {
-				if (tv_cmp (&f->mtime, &time_zero) > 0) {
-					build_init (out, f->mtime, f, f->obj);
-					return 0;
-				} else {
-					errx (1, "%s: no rule to build: %s", sc_path_str (sc), name);
+			if (w == NULL) {
+				w = new (struct wdir);
+				w->path = newa (len + 1, char);
+				memcpy (w->path, dir, len);
+				w->wd = -1;
+#if USE_INOTIFY
+				if (watch_fd >= 0) {
+					w->wd = inotify_add_watch (watch_fd, w->path,
+					    IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
 				}
+#endif
+				if (verbose >= 2)
+					printf ("watch('%s'): %s\n", w->path, w->wd >= 0 ? "inotify" : "polling");
+				w->next = wdirs;
+				wdirs = w;
 			}
+
+			c->wdir = w;
 		}
+	}
+}
+
+/* re-stat a cached file: 0 = unchanged, 1 = changed, 2 = a makefile changed */
+int
+watch_rescan (c)
+struct scache *c;
+{
+	struct timespec t;
+	int rc;
 
-		needs_update = (tv_cmp (&f->mtime, &time_zero) <= 0);
-		maxt = f->mtime;
+	rc = mk_stat (c->path, c->follow, &t);
+	if (rc != 0)
+		t = time_zero;
 
-		if (f->err)
-			return 1;
+	if (rc == c->rc && tv_cmp (&t, &c->t) == 0)
+		return 0;
 
-		/* build dependencies and record timestamps */
-		if (build_deps (sc, &f->deps, prefix, &f->mtime, &maxt, &needs_update) != 0) {
-			f->err = true;
-			if (!conterr)
-				return 1;
-		}
+	if (verbose >= 1)
+		printf ("watch: %s changed\n", c->path);
 
-		/* build dependencies from inference rule */
-		if (f->inf != NULL) {
-			if (build_deps (sc, &f->inf->deps, prefix, &f->mtime, &maxt, &needs_update) != 0) {
-				f->err = true;
-				if (!conterr)
-					return 1;
-			}
-		}
+	c->rc = rc;
+	c->t = t;
+	return c->mkfile ? 2 : 1;
+}
 
-		if (!needs_update) {
-			build_init (out, f->mtime, f, f->obj);
-			return 0;
-		}
+/*
+ * Re-stat the files in `w` (only `name`, if not NULL),
+ * or if `w` is NULL, the files in directories without an inotify watch.
+ */
+int
+watch_scan (w, name)
+const struct wdir *w;
+const char *name;
+{
+	struct scache *c;
+	size_t i;
+	int x, ch = 0;
 
-		if (f->err)
-			return 1;
+	for (i = 0; i < STATE_NBUCKETS; ++i) {
+		for (c = scache_tab[i]; c != NULL; c = c->next) {
+			if (w != NULL ? c->wdir != w : c->wdir->wd >= 0)
+				continue;
+			if (name != NULL && strcmp (c->base, name) != 0)
+				continue;
 
-		s = f->rule->code;
+			x = watch_rescan (c);
+			if (x > ch)
+				ch = x;
+		}
+	}
 
-		/* rule is a "sum" rule, so doesn't need to be built */
-		if (s == NULL || *s == NULL) {
-			build_init (out, maxt, f, f->obj);
+	return ch;
+}
+
+#if USE_INOTIFY
+/* read a batch of inotify events, and re-stat the files they refer to */
+int
+watch_read ()
+{
+	long buf[1024];
+	struct inotify_event *ev;
+	struct wdir *w;
+	ssize_t n;
+	char *p;
+	int x, ch = 0;
+
+	n = read (watch_fd, buf, sizeof (buf));
+	if (n < 0) {
+		if (errno == EINTR || errno == EAGAIN)
 			return 0;
-		}
+		err (1, "read()");
+	}
 
-		/* run commands */
-		ectx_file (&ctx, sc, f);
-		for (; *s != NULL; ++s) {
-			if ((rc = runcom (sc, prefix, *s, &ctx, name)) != 0) {
-				fprintf (stderr, "%s: command failed with %d: %s\n", sc_path_str (sc), rc, *s);
-				f->err = true;
-				return 1;
-			}
-		}
-		f->state = FILE_DONE;
-		ectx_free (&ctx);
+	for (p = (char *)buf; p < (char *)buf + n; p += sizeof (struct inotify_event) + ev->len) {
+		ev = (struct inotify_event *)p;
 
-		/* update timestamp */
-		get_mtime (&ft, sc, prefix, f->name);
-		f->mtime = ft.t;
-		f->obj = ft.obj;
-		build_init (out, f->mtime, f, f->obj);
-		return 0;
-	case SC_FOREIGN:
-		bname = name != NULL ? name : "";
-		SLIST_FOREACH (cb, &sc_foreign (sc)->built, next) {
-			if (strcmp (cb->name, bname) == 0) {
-				build_init (out, cb->t, NULL, cb->obj);
-				return 0;
+		for (w = wdirs; w != NULL; w = w->next) {
+			if (ev->mask & IN_Q_OVERFLOW) {
+				x = watch_scan (w, NULL);
+			} else if (w->wd == ev->wd) {
+				x = watch_scan (w, ev->len > 0 ? ev->name : NULL);
+			} else {
+				continue;
 			}
-		}
 
-		/* run the "subdir?" rule, to test if the target needs to be updated */
-		new_prefix = path_cat (prefix, &path_super);
+			if (x > ch)
+				ch = x;
+		}
+	}
 
+	return ch;
+}
+#endif
 
-		/* build ordering deps declared on the bare subdir name */
-		TAILQ_FOREACH (dep, &sc_foreign (sc)->deps, link) {
-			if (build_dir (&b, sc->parent, dep->path, new_prefix) != 0) {
-				free (new_prefix);
-				return 1;
-			}
+/* wait until a watched file changes, see watch_rescan() for the result */
+int
+watch_wait ()
+{
+#if USE_INOTIFY
+	struct pollfd pfd;
+	int n, x;
+#endif
+	int ch = 0;
+
+	watch_dirs ();
+
+#if USE_INOTIFY
+	pfd.fd = watch_fd;
+	pfd.events = POLLIN;
+	while (watch_fd >= 0) {
+		/* once something changed, wait for the rest of the burst */
+		n = poll (&pfd, 1, ch != 0 ? 50 : 1000);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			err (1, "poll()");
 		}
 
-		/* build the label used in [scope] $ ... output */
-		if (name != NULL && *name != '\0') {
-			char *tmp = xstrcat (sc->name, "/");
-			scoped_rule = xstrcat (tmp, name);
-			free (tmp);
-		} else {
-			scoped_rule = strdup (sc->name);
+		if (n == 0) {
+			x = watch_scan (NULL, NULL);
+			if (x > ch)
+				ch = x;
+			if (ch != 0)
+				return ch;
+			continue;
 		}
 
-		f = sc_foreign (sc)->test;
-		if (f != NULL) {
-			assert (f->inf == NULL);
+		x = watch_read ();
+		if (x > ch)
+			ch = x;
+	}
+#endif
 
-			ec = 0;
-			TAILQ_FOREACH (dep, &f->deps, link) {
-				if (build_dir (&b, sc->parent, dep->path, new_prefix) != 0) {
-					ec = 1;
-					if (!conterr) {
-						free (scoped_rule);
-						return ec;
-					}
-				}
-			}
+	/* no inotify, poll the files themselves */
+	for (;;) {
+		sleep (1);
+		ch = watch_scan (NULL, NULL);
+		if (ch != 0)
+			return ch;
+	}
+}
 
-			if (ec != 0) {
-				free (scoped_rule);
-				return ec;
-			}
+/* start over, because a makefile changed */
+void
+watch_restart ()
+{
+	extern void serve_close ();
+
+	if (verbose >= 0)
+		fprintf (stderr, "%s: a makefile changed, restarting\n", m_make.value);
+	if (watch_fd >= 0)
+		close (watch_fd);
+	serve_close ();
+	if (chdir (watch_cwd) != 0)
+		err (1, "chdir('%s')", watch_cwd);
+	execvp (watch_argv[0], watch_argv);
+	err (1, "execvp('%s')", watch_argv[0]);
+}
 
-			ectx_init (
-				/* ctx    */ &ctx,
-				/* sc     */ sc,
-				/* target */ strdup (name != NULL ? name : ""),
-				/* deps   */ TAILQ_FIRST (&f->deps),
-				/* infdeps*/ NULL
-			);
+/* forget what was built, for the next round */
+void
+watch_reset (sc)
+struct scope *sc;
+{
+	struct scope *sub;
+	struct cbuilt *cb;
+	struct file *f;
+	size_t i;
 
-			needs_update = 0;
-			for (s = f->rule->code; *s != NULL; ++s) {
-				if (runcom (sc->parent, new_prefix, *s, &ctx, scoped_rule) != 0) {
-					needs_update = 1;
-					break;
-				}
-			}
-		} else {
-			needs_update = 1;
+	switch (sc->type) {
+	case SC_DIR:
+		if (sc_dir (sc) == NULL)
+			break;
+
+		for (i = 0; i < sc_dir (sc)->nfiles; ++i) {
+			f = sc_dir (sc)->files[i];
+			f->state = FILE_PENDING;
+			f->err = false;
 		}
 
-		if (!needs_update) {
-			if (name != NULL && get_mtime (&ft, sc, prefix, name) == 0) {
-				build_init (out, ft.t, NULL, ft.obj);
-			} else {
-				build_init (out, time_zero, NULL, false);
-			}
-			foreign_remember (sc, name, out->t, out->obj);
-			free (scoped_rule);
-			return 0;
+		SLIST_FOREACH (sub, &sc_dir (sc)->subdirs, next)
+			watch_reset (sub);
+		break;
+	case SC_FOREIGN:
+		while ((cb = SLIST_FIRST (&sc_foreign (sc)->built)) != NULL) {
+			SLIST_REMOVE_HEAD (&sc_foreign (sc)->built, next);
+			free (cb->name);
+			free (cb);
 		}
+		break;
+	}
+}
 
-		/* run the "subdir!" rule */
-		f = sc_foreign (sc)->exec;
-		if (f == NULL)
-			errx (1, "%s: missing '%s!' rule", sc_path_str (sc->parent), sc->name);
-		assert (f->inf == NULL);
+/*
+ * Watch mode: keep the parsed tree around, and rebuild the goals
+ * whenever one of the files that were looked at changes.
+ * If a makefile changes, start over.
+ */
+void
+watch (sc, argc, argv)
+struct scope *sc;
+int argc;
+char **argv;
+{
+	struct scope *root;
 
-		ectx_init (
-			/* ctx    */ &ctx,
-			/* sc     */ sc,
-			/* target */ strdup (name != NULL ? name : ""),
-			/* deps   */ TAILQ_FIRST (&f->deps),
-			/* infdeps*/ NULL
-		);
+#if USE_INOTIFY
+	watch_fd = inotify_init ();
+	if (watch_fd < 0)
+		warn ("inotify_init()");
+#endif
 
-		ec = 0;
-		TAILQ_FOREACH (dep, &f->deps, link) {
-			if (build_dir (&b, sc->parent, dep->path, new_prefix) != 0) {
-				ec = 1;
-				if (!conterr) {
-					free (scoped_rule);
-					return ec;
-				}
-			}
-		}
-		if (ec != 0) {
-			free (scoped_rule);
-			return ec;
-		}
+	for (root = sc; root->parent != NULL; root = root->parent);
 
-		for (s = f->rule->code; *s != NULL; ++s) {
-			if ((rc = runcom (sc->parent, new_prefix, *s, &ctx, scoped_rule)) != 0) {
-				fprintf (stderr, "%s: command failed with %d: %s\n", sc_path_str (sc->parent), rc, *s);
-				free (scoped_rule);
-				return 1;
-			}
-		}
+	for (;;) {
+		fflush (stdout);
+		if (verbose >= 0)
+			fprintf (stderr, "%s: watching for changes...\n", m_make.value);
 
-		free (new_prefix);
-		if (name != NULL && get_mtime (&ft, sc, prefix, name) == 0) {
-			build_init (out, ft.t, NULL, ft.obj);
-		} else {
-			build_init (out, now (), NULL, false);
-		}
-		foreign_remember (sc, name, out->t, out->obj);
-		free (scoped_rule);
-		return 0;
+		if (watch_wait () == 2)
+			watch_restart ();
+
+		watch_reset (root);
+		build_goals (sc, argc, argv);
+		state_save ();
+		pcache_save ();
 	}
-	
-	abort ();
 }
 
+/* DAEMON */
+
+#if HAVE_SYS_SOCKET_H && HAVE_SYS_UN_H && HAVE_SOCKET && HAVE_SENDMSG
+# define USE_DAEMON 1
+#endif
+
+#define DAEMON_SOCKET	".mk.sock"
+#define DAEMON_MAGIC	"mk-daemon-1"
+
+static int serve_fd = -1;
+static char *serve_cwd;
+static pid_t client_pid = -1;
+
+/* close and remove the socket of the daemon, if this is one */
+void
+serve_close ()
+{
+	if (serve_fd < 0)
+		return;
+	close (serve_fd);
+	unlink (DAEMON_SOCKET);
+	serve_fd = -1;
+}
+
+#if USE_DAEMON
 int
-build_dir (out, sc, path, prefix)
-struct build *out;
-struct scope *sc;
-const struct path *path, *prefix;
+get_u32 (file, x)
+FILE *file;
+unsigned long *x;
 {
-	struct path *new_prefix, *full_path, *tmp;
-	struct scope *sub;
-	struct stat st;
-	struct timespec mt, pmt, pmaxt;
-	const struct path *p;
-	struct file *pf;
-	int ec, pnu;
+	unsigned char b[4];
 
-	switch (path[0].type) {
-	case PATH_SUPER:
-		new_prefix = path_cat (prefix, &path[0]);
-		ec = build_dir (out, sc->parent, path + 1, new_prefix);
-		free (new_prefix);
-		return ec;
-	case PATH_NULL:
-		return build_file (out, sc, NULL, prefix);
-	case PATH_NAME:
-		if (path[1].type == PATH_NULL)
-			return build_file (out, sc, path[0].name, prefix);
+	if (fread (b, 1, 4, file) != 4)
+		return -1;
 
-		if (sc->type != SC_DIR)
-			errx (1, "%s: invalid path", sc_path_str (sc));
+	*x = (unsigned long)b[0]
+		| ((unsigned long)b[1] << 8)
+		| ((unsigned long)b[2] << 16)
+		| ((unsigned long)b[3] << 24);
+	return 0;
+}
 
-		if (sc_dir (sc) == NULL)
-			parse_dir (sc, prefix);
+char *
+get_str (file)
+FILE *file;
+{
+	unsigned long len;
+	char *s;
 
-		pf = find_file (sc_dir (sc), path_to_str (path));
-		if (pf != NULL && !TAILQ_EMPTY (&pf->deps)) {
-			pmt = pf->mtime;
-			pmaxt = pf->mtime;
-			pnu = 0;
-			if (build_deps (sc, &pf->deps, prefix, &pmt, &pmaxt, &pnu) != 0)
-				return 1;
-		}
+	if (get_u32 (file, &len) != 0 || len > 0x100000)
+		return NULL;
+
+	s = newa (len + 1, char);
+	if (fread (s, 1, len, file) != len) {
+		free (s);
+		return NULL;
+	}
+	s[len] = '\0';
+	return s;
+}
+
+/* read `n` strings into a new NULL-terminated array */
+char **
+get_strs (file, n)
+FILE *file;
+unsigned long n;
+{
+	unsigned long i;
+	char **v;
+
+	if (n > 0x10000)
+		return NULL;
+
+	v = newa (n + 1, char *);
+	for (i = 0; i < n; ++i) {
+		if ((v[i] = get_str (file)) == NULL)
+			return NULL;
+	}
+	v[n] = NULL;
+	return v;
+}
 
-		new_prefix = path_cat (prefix, &path[0]);
+void
+free_strs (v)
+char **v;
+{
+	char **s;
 
-		sub = find_subdir (sc, path[0].name);
-		if (sub == NULL) {
-			/*
-			 * Undeclared subdirectory: treat the dependency as a
-			 * plain source file.  Assemble the full path, stat it,
-			 * and return its mtime.  No Mkfile is read and no rules
-			 * are applied.
-			 */
-			if (access (path_to_str (new_prefix), F_OK) != 0)
-				errx (1, "%s: invalid subdir: %s",
-				    sc_path_str (sc), path[0].name);
+	if (v == NULL)
+		return;
+	for (s = v; *s != NULL; ++s)
+		free (*s);
+	free (v);
+}
 
-			full_path = new_prefix;
-			for (p = path + 1; p->type != PATH_NULL; ++p) {
-				tmp = path_cat (full_path, p);
-				if (full_path != new_prefix)
-					free (full_path);
-				full_path = tmp;
+/* does the environment `env` of a client agree with what the parses read? */
+bool
+serve_env_ok (env)
+char **env;
+{
+	const struct pcdep *d;
+	const char *v;
+	size_t len;
+	int i;
+
+	for (d = serve_env; d != NULL; d = d->next) {
+		len = strlen (d->name);
+		v = NULL;
+		for (i = 0; env[i] != NULL; ++i) {
+			if (strncmp (env[i], d->name, len) == 0 && env[i][len] == '=') {
+				v = env[i] + len + 1;
+				break;
 			}
-
-			if (lstat (path_to_str (full_path), &st) != 0)
-				errx (1, "%s: no such file: %s",
-				    sc_path_str (sc), path[0].name);
-			stat_get_mtime (mt, st);
-			build_init (out, mt, NULL, false);
-
-			if (full_path != new_prefix)
-				free (full_path);
-			free (new_prefix);
-			return 0;
 		}
 
-		ec = build_dir (out, sub, path + 1, new_prefix);
-		free (new_prefix);
-		return ec;
+		if (v == NULL ? d->value != NULL : d->value == NULL || strcmp (v, d->value) != 0) {
+			if (verbose >= 1)
+				printf ("daemon: declined a client with a different %s\n", d->name);
+			return false;
+		}
 	}
 
-	abort ();
+	return true;
 }
 
-int
-build (out, sc, path)
-struct build *out;
-struct scope *sc;
-const struct path *path;
+/*
+ * The part of MAKEFLAGS a daemon and its clients must agree on: the macros
+ * from the command line.  The leading -s and -v only change what is
+ * printed, and the verbosity is sent apart.
+ */
+const char *
+serve_flags (flags)
+const char *flags;
 {
-	return build_dir (out, sc, path, &path_null);
+	while (flags[0] == '-' && flags[1] != '\0' && (flags[2] == ' ' || flags[2] == '\0')) {
+		for (flags += 2; *flags == ' '; ++flags);
+	}
+	return flags;
 }
 
-/* HELP */
-
+/* the daemon's child: build the goals of a client on its terminal */
 void
-help_macros (sc)
+serve_child (sc, conn, fds, ck, v, flags, goals, env)
 struct scope *sc;
+int conn, *fds;
+unsigned long ck, v;
+char *flags, **goals, **env;
 {
-	struct macro *m;
-
-	assert (sc_dir (sc) != NULL);
-
-	SLIST_FOREACH (m, &sc_dir (sc)->macros, next) {
-		if (m->help == NULL)
-			continue;
-
-		printf ("  %-28s- %s\n", m->name, m->help);
-	}
+	extern char **environ;
+	unsigned char reply[5];
+	unsigned long n;
+	int i, ec;
+
+	for (i = 0; goals[i] != NULL; ++i);
+
+	close (serve_fd);
+	if (watch_fd >= 0)
+		close (watch_fd);
+	setpgid (0, 0);
+
+	/* adopt the terminal and environment of the client */
+	dup2 (fds[0], STDIN_FILENO);
+	dup2 (fds[1], STDOUT_FILENO);
+	dup2 (fds[2], STDERR_FILENO);
+	close (fds[0]);
+	close (fds[1]);
+	close (fds[2]);
+	environ = env;
+	conterr = ck != 0;
+	verbose = (int)v - 1;
+	m_dmakeflags.value = m_makeflags.value = flags;
+
+	n = (unsigned long)getpid ();
+	reply[0] = 'Y';
+	reply[1] = n & 0xff;
+	reply[2] = (n >> 8) & 0xff;
+	reply[3] = (n >> 16) & 0xff;
+	reply[4] = (n >> 24) & 0xff;
+	if (write (conn, reply, 5) != 5)
+		exit (1);
+
+	ec = build_goals (sc, i, goals);
+	state_save ();
+	fflush (stdout);
+	fflush (stderr);
+
+	reply[0] = (unsigned char)ec;
+	write (conn, reply, 1);
+	exit (ec);
 }
 
+/* handle a connection to the daemon */
 void
-help_files (prefix, sc)
-const struct path *prefix;
+serve_one (sc, conn)
 struct scope *sc;
+int conn;
 {
-	struct path *new_prefix;
-	struct scope *sub;
-	struct file *f;
-	const char *p;
-	int n;
+	union {
+		struct cmsghdr	hdr;
+		char		buf[CMSG_SPACE (3 * sizeof (int))];
+	} cbuf;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	unsigned long n, ck, v;
+	char c, *s[5], **goals = NULL, **env = NULL;
+	int i, ch, fds[3] = { -1, -1, -1 };
+	FILE *req;
+
+	memset (&msg, 0, sizeof (msg));
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.buf;
+	msg.msg_controllen = sizeof (cbuf.buf);
+
+	if (recvmsg (conn, &msg, 0) != 1)
+		goto decline;
+
+	cmsg = CMSG_FIRSTHDR (&msg);
+	if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN (3 * sizeof (int)))
+		goto decline;
+	memcpy (fds, CMSG_DATA (cmsg), sizeof (fds));
+
+	req = fdopen (dup (conn), "r");
+	if (req == NULL)
+		goto decline;
+
+	/* the key: magic, cwd, makefile, objdir, MAKEFLAGS (see serve_flags()) */
+	for (i = 0; i < 5; ++i)
+		s[i] = get_str (req);
+
+	if (s[0] == NULL || strcmp (s[0], DAEMON_MAGIC) != 0
+	    || s[1] == NULL || strcmp (s[1], serve_cwd) != 0
+	    || s[2] == NULL || strcmp (s[2], sc->makefile) != 0
+	    || s[3] == NULL || strcmp (s[3], objdir != NULL ? objdir : "") != 0
+	    || s[4] == NULL || strcmp (serve_flags (s[4]), serve_flags (m_makeflags.value)) != 0) {
+		if (verbose >= 1)
+			printf ("daemon: declined a client with a different configuration\n");
+		fclose (req);
+		goto decline_key;
+	}
 
-	p = path_to_str (prefix);
-	if (strcmp (p, ".") == 0)
-		p = NULL;
+	/* the rest: -k, -v, the goals and the environment */
+	if (get_u32 (req, &ck) != 0 || get_u32 (req, &v) != 0
+	    || get_u32 (req, &n) != 0 || (goals = get_strs (req, n)) == NULL
+	    || get_u32 (req, &n) != 0 || (env = get_strs (req, n)) == NULL) {
+		fclose (req);
+		goto decline_key;
+	}
+	fclose (req);
 
-	TAILQ_FOREACH (f, &sc_dir (sc)->files, link) {
-		if (f->help == NULL)
-			continue;
+	/* the values of ??= were taken from the environment of the daemon */
+	if (!serve_env_ok (env))
+		goto decline_key;
 
-		n = 0;
-		printf ("  ");
-		if (p != NULL) {
-			printf ("%s/", p);
-			n += strlen (p) + 1;
-		}
-		printf ("%s", f->name);
-		n += strlen (f->name);
-		printf ("%-*s- %s\n", n < 28 ? 28 - n : 0, "", f->help);
+	/* catch up with the changes that happened before the client started */
+#if USE_INOTIFY
+	for (ch = 0; watch_fd >= 0; ) {
+		struct pollfd pfd;
+
+		pfd.fd = watch_fd;
+		pfd.events = POLLIN;
+		if (poll (&pfd, 1, 0) <= 0)
+			break;
+		i = watch_read ();
+		if (i > ch)
+			ch = i;
+	}
+#else
+	ch = 0;
+#endif
+	i = watch_scan (NULL, NULL);
+	if (i > ch)
+		ch = i;
+	if (ch == 2) {
+		c = 'N';
+		write (conn, &c, 1);
+		watch_restart ();
 	}
 
-	if (!verbose)
-		return;
+	fflush (stdout);
+	switch (fork ()) {
+	case -1:
+		warn ("fork()");
+		break;
+	case 0:
+		serve_child (sc, conn, fds, ck, v, s[4], goals, env);
+		break;
+	default:
+		break;
+	}
 
-	SLIST_FOREACH (sub, &sc_dir (sc)->subdirs, next) {
-		if (sub->type != SC_DIR)
-			continue;
+	for (i = 0; i < 5; ++i)
+		free (s[i]);
+	free_strs (goals);
+	free_strs (env);
+	for (i = 0; i < 3; ++i)
+		close (fds[i]);
+	close (conn);
+	return;
 
-		new_prefix = parse_subdir (prefix, sub);
-		help_files (new_prefix, sub);
-		free (new_prefix);
+decline_key:
+	for (i = 0; i < 5; ++i)
+		free (s[i]);
+	free_strs (goals);
+	free_strs (env);
+decline:
+	c = 'N';
+	write (conn, &c, 1);
+	for (i = 0; i < 3; ++i) {
+		if (fds[i] >= 0)
+			close (fds[i]);
 	}
+	close (conn);
 }
 
-int
-help (prefix, sc)
-const struct path *prefix;
+/* parse all subdirectories of `sc`, for the daemon to keep them */
+void
+parse_all (sc, prefix)
 struct scope *sc;
+const struct path *prefix;
 {
-	extern int usage ();
-	usage (1);
+	struct scope *sub;
+	struct path *np;
 
-	fputs ("\nOptions:\n", stderr);
-	fputs ("  -C dir                      - chdir(dir)\n", stderr);
-	fprintf (stderr, "  -f file                     - read `file` instead of \"%s\"\n", MAKEFILE);
-	fputs ("  -o objdir                   - put build artifacts into objdir\n", stderr);
-	fputs ("  -V var                      - print expanded version of var\n", stderr);
-	fputs ("  -h                          - print help page\n", stderr);
-	fputs ("  -hv                         - print help page, recursively\n", stderr);
-	fputs ("  -p                          - dump tree\n", stderr);
-	fputs ("  -pv                         - dump tree, recursively\n", stderr);
-	fputs ("  -s                          - do not echo commands\n", stderr);
-	fputs ("  -k                          - continue processing after errors are encountered\n", stderr);
-	fputs ("  -S                          - stop processing when errors are encountered (default)\n", stderr);
-	fputs ("  -t file                     - write build timings to file (- for stdout)\n", stderr);
-	fputs ("  -v                          - verbose output\n", stderr);
+	SLIST_FOREACH (sub, &sc_dir (sc)->subdirs, next) {
+		if (sub->type != SC_DIR)
+			continue;
 
-	if (sc != NULL) {
-		fputs ("\nMacros:\n", stderr);
-		help_macros (sc);
+		if (sc_dir (sub) == NULL) {
+			np = parse_subdir (prefix, sub);
+		} else {
+			np = path_cat_name (prefix, sub->name);
+		}
 
-		fputs ("\nTargets:\n", stderr);
-		help_files (prefix, sc);
+		parse_all (sub, np);
 	}
-
-	fprintf (stderr, "\nbmk v%s, send bug reports to <%s>.\n", BMK_VERSION, BMK_EMAIL);
-	return 1;
 }
 
-/* DUMP */
+void
+serve_signal (sig)
+int sig;
+{
+	serve_close ();
+	signal (sig, SIG_DFL);
+	raise (sig);
+}
 
+/*
+ * Daemon mode: keep the parsed tree and the stat cache in memory, and
+ * build the goals of each client in a child process.  The cache is
+ * updated by watching the files, like in watch mode.
+ */
 void
-print_sc (prefix, sc)
-const struct path *prefix;
+serve (sc)
 struct scope *sc;
 {
-	struct path *new_prefix;
-	struct inference *inf;
-	struct scope *sub;
-	struct macro *m;
-	struct dep *dep;
-	struct file *f;
-	struct rule *r;
-	char **s;
+	struct sockaddr_un addr;
+	struct pollfd pfd[2];
+	int conn, n, ch;
+
+	parse_all (sc, path_dot ());
+
+	serve_cwd = getcwd (newa (PATH_MAX, char), PATH_MAX);
+	if (serve_cwd == NULL)
+		err (1, "getcwd()");
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strcpy (addr.sun_path, DAEMON_SOCKET);
+
+	/* replace a stale socket, but not a running daemon */
+	serve_fd = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (serve_fd < 0)
+		err (1, "socket()");
+	if (connect (serve_fd, (struct sockaddr *)&addr, sizeof (addr)) == 0)
+		errx (1, "a daemon is already running in this directory");
+	close (serve_fd);
+	unlink (DAEMON_SOCKET);
+
+	serve_fd = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (serve_fd < 0)
+		err (1, "socket()");
+
+	if (bind (serve_fd, (struct sockaddr *)&addr, sizeof (addr)) != 0)
+		err (1, "bind('%s')", DAEMON_SOCKET);
+	chmod (DAEMON_SOCKET, 0600);
+	if (listen (serve_fd, 16) != 0)
+		err (1, "listen()");
+
+	signal (SIGINT, serve_signal);
+	signal (SIGTERM, serve_signal);
+	signal (SIGHUP, serve_signal);
+	signal (SIGPIPE, SIG_IGN);
+
+#if USE_INOTIFY
+	watch_fd = inotify_init ();
+	if (watch_fd < 0)
+		warn ("inotify_init()");
+#endif
 
-	if (verbose)
-		printf ("=== %s\n", sc_path_str (sc));
+	if (verbose >= 0)
+		fprintf (stderr, "%s: serving %s/%s\n", m_make.value, serve_cwd, DAEMON_SOCKET);
 
-	if (sc->type != SC_DIR || sc_dir (sc) == NULL)
-		errx (1, "%s: print_sc(): must be of type SC_DIR", sc_path_str (sc));
+	for (;;) {
+		while (waitpid (-1, NULL, WNOHANG) > 0);
 
-	printf (".SUBDIRS:");
-	SLIST_FOREACH (sub, &sc_dir (sc)->subdirs, next) {
-		if (sub->type == SC_DIR)
-			printf (" %s", sub->name);
-	}
-	printf ("\n");
-	printf (".FOREIGN:");
-	SLIST_FOREACH (sub, &sc_dir (sc)->subdirs, next) {
-		if (sub->type == SC_FOREIGN)
-			printf (" %s", sub->name);
+		watch_dirs ();
+		pfd[0].fd = serve_fd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = watch_fd;
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+
+		n = poll (pfd, watch_fd >= 0 ? 2 : 1, 1000);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			err (1, "poll()");
+		}
+
+		ch = n == 0 ? watch_scan (NULL, NULL) : 0;
+#if USE_INOTIFY
+		if (pfd[1].revents & POLLIN)
+			ch = watch_read ();
+#endif
+		if (ch == 2)
+			watch_restart ();
+
+		if (pfd[0].revents & POLLIN) {
+			conn = accept (serve_fd, NULL, NULL);
+			if (conn >= 0)
+				serve_one (sc, conn);
+		}
 	}
-	printf ("\n");
+}
 
-	if (sc_dir (sc)->default_file != NULL)
-		printf (".DEFAULT: %s\n", sc_dir (sc)->default_file);
+void
+client_signal (sig)
+int sig;
+{
+	if (client_pid > 0)
+		kill (-client_pid, sig);
+}
 
-	SLIST_FOREACH (m, &sc_dir (sc)->macros, next) {
-		if (m->help != NULL)
-			printf ("\n## %s\n", m->help);
-		printf ("%s %s= %s\n", m->name, m->prepend != NULL ? "+" : "", m->value);
+/*
+ * Try to let a daemon running in the current directory do the build.
+ * Returns the exit status, or -1 if there is no (suitable) daemon.
+ */
+int
+client (makefile, argc, argv)
+const char *makefile;
+int argc;
+char **argv;
+{
+	extern char **environ;
+	union {
+		struct cmsghdr	hdr;
+		char		buf[CMSG_SPACE (3 * sizeof (int))];
+	} cbuf;
+	struct sockaddr_un addr;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	unsigned char reply[5];
+	char cwd[PATH_MAX], c = 'R';
+	int i, n, sock, fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	FILE *req;
+
+	if (access (DAEMON_SOCKET, F_OK) != 0 || getcwd (cwd, sizeof (cwd)) == NULL)
+		return -1;
+
+	sock = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0)
+		return -1;
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strcpy (addr.sun_path, DAEMON_SOCKET);
+	if (connect (sock, (struct sockaddr *)&addr, sizeof (addr)) != 0)
+		goto fail;
+
+	/* pass our terminal to the daemon */
+	memset (&msg, 0, sizeof (msg));
+	memset (&cbuf, 0, sizeof (cbuf));
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.buf;
+	msg.msg_controllen = sizeof (cbuf.buf);
+	cmsg = CMSG_FIRSTHDR (&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN (sizeof (fds));
+	memcpy (CMSG_DATA (cmsg), fds, sizeof (fds));
+
+	signal (SIGPIPE, SIG_IGN);
+	if (sendmsg (sock, &msg, 0) != 1)
+		goto fail;
+
+	req = fdopen (dup (sock), "w");
+	if (req == NULL)
+		goto fail;
+
+	put_str (req, DAEMON_MAGIC);
+	put_str (req, cwd);
+	put_str (req, makefile);
+	put_str (req, objdir != NULL ? objdir : "");
+	put_str (req, m_makeflags.value);
+	put_u32 (req, conterr);
+	put_u32 (req, (unsigned long)(verbose + 1));
+
+	for (i = n = 0; i < argc; ++i)
+		n += argv[i] != NULL;
+	put_u32 (req, (unsigned long)n);
+	for (i = 0; i < argc; ++i) {
+		if (argv[i] != NULL)
+			put_str (req, argv[i]);
 	}
 
-	printf ("\n");
+	for (n = 0; environ[n] != NULL; ++n);
+	put_u32 (req, (unsigned long)n);
+	for (i = 0; i < n; ++i)
+		put_str (req, environ[i]);
 
-	TAILQ_FOREACH (f, &sc_dir (sc)->files, link) {
-		if (f->help != NULL)
-			printf ("## %s\n", f->help);
-		printf ("%s:", f->name);
+	if (ferror (req) | fclose (req))
+		goto fail;
 
-		TAILQ_FOREACH (dep, &f->deps, link)
-			printf (" %s", path_to_str (dep->path));
-		if (f->inf != NULL) {
-			TAILQ_FOREACH (dep, &f->inf->deps, link)
-				printf (" %s", path_to_str (dep->path));
-		}
-		printf ("\n");
+	if (read (sock, reply, 5) != 5 || reply[0] != 'Y')
+		goto fail;
 
-		r = f->rule;
-		if (r != NULL && r->code != NULL) {
-			for (s = r->code; *s != NULL; ++s)
-				printf ("\t%s\n", *s);
-		}
-		printf ("\n");
-	}
+	if (verbose >= 2)
+		printf ("using the daemon\n");
+
+	client_pid = (pid_t)(reply[1] | (reply[2] << 8) | (reply[3] << 16) | ((unsigned long)reply[4] << 24));
+	signal (SIGINT, client_signal);
+	signal (SIGTERM, client_signal);
+	signal (SIGHUP, client_signal);
+
+	/* the daemon builds on our terminal, wait for its exit status */
+	do {
+		n = read (sock, reply, 1);
+	} while (n < 0 && errno == EINTR);
+	close (sock);
+	return n == 1 ? reply[0] : 1;
+
+fail:
+	close (sock);
+	return -1;
+}
+#else
+void
+serve (sc)
+struct scope *sc;
+{
+	errx (1, "-D is not supported on this system");
+}
 
-	SLIST_FOREACH (inf, &sc_dir (sc)->infs, next) {
-		printf ("%s%s:", inf->from, inf->to);
-		TAILQ_FOREACH (dep, &inf->deps, link)
-			printf (" %s", path_to_str (dep->path));
-		printf ("\n");
-		if (inf->rule->code != NULL) {
-			for (s = inf->rule->code; *s != NULL; ++s)
-				printf ("\t%s\n", *s);
-			printf ("\n");
-		}
-	}
+int
+client (makefile, argc, argv)
+const char *makefile;
+int argc;
+char **argv;
+{
+	return -1;
+}
+#endif
 
-	if (verbose) {
-		SLIST_FOREACH (sub, &sc_dir (sc)->subdirs, next) {
-			if (sub->type != SC_DIR)
-				continue;
+/* MAIN */
 
-			printf ("\n");
+/* the build state lives at the top of the tree, or in the objdir */
+char *
+state_file (sc)
+const struct scope *sc;
+{
+	str_t path;
 
-			new_prefix = parse_subdir (prefix, sub);
-			print_sc (new_prefix, sub);
-			free (new_prefix);
-		}
+	str_new (&path);
+	if (objdir != NULL) {
+		str_puts (&path, objdir);
+		str_putc (&path, '/');
+	} else {
+		for (sc = sc->parent; sc != NULL; sc = sc->parent)
+			str_puts (&path, "../");
 	}
+	str_puts (&path, ".mkstate");
+	return str_release (&path);
 }
 
-/* MAIN */
-
 int
 usage (uc)
 {
-	fprintf (stderr, "%s: %s [-hkpsSv] [-C dir] [-f makefile] [-o objdir] [-t file] [-V var] [target...]\n", uc ? "USAGE" : "usage", m_make.value);
+	fprintf (stderr, "%s: %s [-cDhkpsSvw] [-C dir] [-f makefile] [-o objdir] [-t file] [-V var] [target...]\n", uc ? "USAGE" : "usage", m_make.value);
 	return 1;
 }
 
@@ -3838,7 +9378,7 @@ const char *V;
 		s[len + 3] = '\0';
 	}
 
-	puts (expand (sc, &path_null, s, NULL));
+	puts (expand (sc, path_dot (), s, NULL));
 	free (s);
 }
 
@@ -3852,15 +9392,24 @@ char **argv;
 	struct scope *sc;
 	struct path *path;
 	struct macro *m;
-	struct build b;
 	char *s, *cd = NULL, *makefile = MAKEFILE, *V = NULL, *odir = NULL, *tfile = NULL;
-	int i, option, pr = 0, n = 0, dohelp = 0;
+	int i, ec, option, pr = 0, dohelp = 0;
 
 	m_dmake.value = m_make.value = argv[0];
+	for (m = globals; m != NULL; m = SLIST_NEXT (m, next))
+		m->name = intern (m->name);
+
+	/* getopt() may permute argv, so keep a copy for watch mode to re-exec */
+	watch_argv = newa (argc + 1, char *);
+	for (i = 0; i < argc; ++i)
+		watch_argv[i] = strdup (argv[i]);
 
 	str_new (&cmdline);
-	while ((option = getopt (argc, argv, "hpsvkSC:f:V:o:t:")) != -1) {
+	while ((option = getopt (argc, argv, "chpsvkSwDC:f:V:o:t:")) != -1) {
 		switch (option) {
+		case 'c':
+			pc_on = true;
+			break;
 		case 'h':
 			dohelp = 1;
 			break;
@@ -3897,6 +9446,12 @@ char **argv;
 		case 't':
 			tfile = optarg;
 			break;
+		case 'w':
+			watching = true;
+			break;
+		case 'D':
+			serve_mode = watching = true;
+			break;
 		case '?':
 			return usage (0);
 		default:
@@ -3925,6 +9480,12 @@ char **argv;
 		}
 	}
 
+	if (watching) {
+		watch_cwd = getcwd (newa (PATH_MAX, char), PATH_MAX);
+		if (watch_cwd == NULL)
+			err (1, "getcwd()");
+	}
+
 	if (cd != NULL && chdir (cd) != 0)
 		err (1, "chdir()");
 
@@ -3957,8 +9518,16 @@ char **argv;
 	str_trim (&cmdline);
 	m_dmakeflags.value = m_makeflags.value = str_release (&cmdline);
 
+	/* let a daemon do the work, if one is running here */
+	if (!watching && !pr && !dohelp && V == NULL && tfile == NULL) {
+		ec = client (makefile, argc, argv);
+		if (ec >= 0)
+			return ec;
+	}
+
 	path = parse_path (".");
 	sc = parse_recursive (path, makefile);
+	pcache_save ();
 
 	if (dohelp)
 		return help (path, sc);
@@ -3977,19 +9546,18 @@ char **argv;
 		return 0;
 	}
 
-	free (path);
+	state_path = state_file (sc);
 
-	for (i = 0; i < argc; ++i) {
-		if (argv[i] == NULL)
-			continue;
+	if (serve_mode)
+		serve (sc);
 
-		path = parse_path (argv[i]);
-		if (build (&b, sc, path) != 0)
-			return 1;
-		free (path);
-		++n;
-	}
+	ec = build_goals (sc, argc, argv);
+	state_save ();
+	pcache_save ();
 
-	return n == 0 ? build (&b, sc, &path_null) : 0;
+	if (watching)
+		watch (sc, argc, argv);
+
+	return ec;
 }
 
@@ -11,10 +11,22 @@ struct path {
 	char			*name;
 };
 
+/* makefile text, split into lines and classified, to be parsed many times */
+struct plines {
+	char			*buf;
+	size_t			 len;
+	size_t			*offs;		/* where each line starts */
+	int			*nls;		/* newlines in each line */
+	unsigned char		*kinds;		/* enum line_kind of each line */
+	int			*args;		/* argument of each line, or -1 */
+	size_t			 n;
+};
+
 struct template {
 	SLIST_ENTRY(template)	 next;
 	char			*name;
 	char			*text;
+	struct plines		*pl;		/* compiled on the first .expand */
 };
 SLIST_HEAD(template_list, template);
 
@@ -38,15 +50,28 @@ struct scope {
 SLIST_HEAD(scope_list, scope);
 
 /*
- * struct dep: doubly-linked, always owned by exactly one struct file or
- * struct foreign (via dhead/dtail).  Ownership is expressed as a TAILQ.
+ * struct dep_list: the prerequisites of a target (or inference rule, or
+ * foreign scope), in one array.  The targets of a rule line share the
+ * array of that line; it is copied before one of them changes it.  The
+ * paths are interned (see path_intern()), so that equal paths are shared.
  */
 struct dep {
-	TAILQ_ENTRY(dep)	 link;
 	struct path		*path;
 	bool			 obj;
 };
-TAILQ_HEAD(dep_list, dep);
+struct dep_array {
+	unsigned		 refs;		/* dep_lists pointing here */
+	size_t			 n, cap;
+	struct dep		 v[1];
+};
+struct dep_list {
+	struct dep_array	*a;		/* NULL if there are no deps */
+};
+
+#define dl_len(dl) ((dl)->a != NULL ? (dl)->a->n : 0)
+#define dl_get(dl, i) (&(dl)->a->v[i])
+#define DL_FOREACH(var, i, dl) \
+	for ((i) = 0; (i) < dl_len (dl) && ((var) = dl_get ((dl), (i))) != NULL; ++(i))
 
 enum file_state {
 	FILE_PENDING,	/* not yet started */
@@ -55,21 +80,36 @@ enum file_state {
 };
 
 /*
- * struct file: doubly-linked, owned by struct directory (fhead/ftail).
+ * struct file: owned by struct directory.  The fields that a build looks
+ * at on every visit come first, next to each other; the rest is only
+ * needed for -h, -p and the parse cache.
  */
 struct file {
-	TAILQ_ENTRY(file)	 link;
-	char			*name;
-	struct rule		*rule;	/* optional */
+	struct timespec		 mtime;
+	struct timespec		 ltime;	/* logical mtime seen by dependents */
 	struct dep_list		 deps;
 	struct inference	*inf;	/* optional */
-	struct timespec		 mtime;
-	char			*help;	/* optional */
+	struct rule		*rule;	/* optional */
+	char			*name;
+	enum file_state		 state;
 	bool			 obj;
 	bool			 err;
-	enum file_state		 state;
+	struct lazydeps		*lazy;	/* prerequisites not parsed yet */
+
+	char			*help;	/* optional */
+};
+
+/* the prerequisites of one rule line, kept as text, see lazy_rule() */
+struct lazydeps {
+	struct lazydeps		*next;
+	char			*text;
+};
+
+/* a slot in the index of files by name */
+struct fslot {
+	char			*name;
+	struct file		*file;
 };
-TAILQ_HEAD(file_list, file);
 
 struct inference {
 	SLIST_ENTRY(inference)	 next;
@@ -95,18 +135,73 @@ struct macro {
 	char			*value;		/* required */
 	char			*help;		/* optional */
 	bool			 lazy;		/* the value is not yet expanded */
+	struct eprog		*prog;		/* the compiled value, if lazy */
 };
 SLIST_HEAD(macro_list, macro);
 
+/*
+ * struct mtab: an open-addressing table of macros, keyed by interned name.
+ * It indexes the macros of a directory, and caches what find_macro()
+ * resolved a name to; `gen` tells whether such a cached entry is current.
+ */
+struct mslot {
+	const char		*name;
+	struct macro		*m;
+	unsigned long		 gen;
+};
+struct mtab {
+	struct mslot		*tab;
+	size_t			 cap, n;
+};
+
+/*
+ * struct mval: what a lazy macro, that does not depend on the target being
+ * built, expanded to in a directory; `gen` works like in struct mslot.
+ */
+struct mval {
+	const struct macro	*m;
+	char			*value;
+	size_t			 len;
+	unsigned long		 gen;
+};
+
+/*
+ * struct attr: a target (or inference rule, eg. `.c.o`) named by one of the
+ * attribute special targets, like `.RESTAT:`.
+ */
+enum attr_flag {
+	ATTR_RESTAT	= 0x01,	/* compare content hashes after the recipe ran */
+	ATTR_DEPFILE	= 0x02,	/* the recipe writes a depfile (cc -MD) */
+	ATTR_NOFOLLOW	= 0x04,	/* use the mtime of a symlink, not of its target */
+};
+struct attr {
+	SLIST_ENTRY(attr)	 next;
+	char			*name;
+	int			 flags;
+};
+SLIST_HEAD(attr_list, attr);
+
 struct directory {
 	struct scope_list	 subdirs;	/* sub directories list */
-	struct file_list	 files;		/* file list */
+	struct file		**files;	/* files, in order of definition */
+	size_t			 nfiles, cfiles;
+	struct fslot		*ftab;		/* index of `files` by name */
+	size_t			 fcap, nnames;
 	struct macro_list	 macros;	/* macro list */
 	struct macro_list	 emacros;	/* exported macros list */
+	struct mtab		 mtab;		/* index of `macros` */
+	struct mtab		 etab;		/* index of `emacros` */
+	struct mtab		 mcache;	/* find_macro() results */
+	struct mval		*vtab;		/* expansions of macros */
+	size_t			 vcap, nvals;
+	unsigned long		 mgen;		/* bumped when a macro is added */
 	struct inference_list	 infs;		/* inference rules */
 	struct template_list	 templates;	/* list of templates */
+	struct attr_list	 attrs;		/* target attributes */
 	char			*default_file;	/* default makefile name */
 	bool			 done;		/* directory makefile is parsed */
+	int			 ahead;		/* subdirs parsed, up to the read-ahead */
+	unsigned long		 fp;		/* parse cache fingerprint */
 };
 
 struct cbuilt {
@@ -124,8 +219,26 @@ struct foreign {
 	struct cbuilt_list	 built;	/* targets already built this run */
 };
 
+/*
+ * struct sentry: a record in the persistent build state,
+ * keyed by the scope path of a target (eg. `./lib/foo.o`).
+ */
+struct sentry {
+	struct sentry		*next;		/* hash chain */
+	char			*key;
+	bool			 restat;	/* the fields below are valid */
+	unsigned long		 hash;		/* content hash of the output */
+	unsigned long		 size;		/* size of the output */
+	struct timespec		 mt;		/* mtime when the hash was taken */
+	struct timespec		 lt;		/* logical mtime (early cutoff) */
+	bool			 depfile;	/* deps, ndeps are valid */
+	char			**deps;		/* deps read from the depfile */
+	size_t			 ndeps;
+};
+
 struct rule {
 	char **code; /* optional */
+	struct eprog **progs; /* the compiled `code`, see rule_prog() */
 };
 
 #endif /* FILE_MAKE_H */
@@ -28,6 +28,11 @@ if [ -z "${MK:-}" ]; then
 	fi
 fi
 
+# The tests run in temporary directories, so a relative path must be resolved.
+case "$MK" in
+*/*)	case "$MK" in /*) ;; *) MK="$(pwd)/$MK" ;; esac ;;
+esac
+
 export MK TESTDIR
 
 echo "bmk test suite"
@@ -148,4 +148,26 @@ EOF
 mkrun
 eq "$OUT" "ab" "names allow _ and ."
 
+begin "a lazy macro sees macros redefined after it was expanded"
+setup
+mkdir sub
+cat > Mkfile <<'EOF'
+OPT = -O1
+CFLAGS = ${OPT} -g
+A := ${CFLAGS}
+OPT = -O2
+B := ${CFLAGS}
+.EXPORTS: CFLAGS
+.SUBDIRS: sub
+all: sub/all
+	@echo "${A}|${B}|${CFLAGS}"
+EOF
+cat > sub/Mkfile <<'EOF'
+OPT = -Os
+all:
+	@echo "sub ${CFLAGS}"
+EOF
+mkrun
+eq "$OUT" "$(printf 'sub -Os -g\n-O1 -g|-O2 -g|-O2 -g')" "each expansion used the current definitions"
+
 finish
@@ -129,4 +129,204 @@ EOF
 mkrun top
 eq "$(grep -c mark run.log 2>/dev/null)" "1" "duplicate prerequisite built once"
 
+begin "an up-to-date shared prerequisite is visited only once"
+setup
+touch src
+cat > Mkfile <<'EOF'
+top: a b
+a: mid
+	@echo a >> run.log
+b: mid
+	@echo b >> run.log
+mid: src
+	touch mid
+EOF
+mkrun top
+mkrun top
+rc_ok "second build of the diamond succeeded"
+absent "$ERR" "Circular" "the shared prerequisite was not mistaken for a cycle"
+
+begin "a shared prerequisite rebuilt during the run is new to both dependents"
+setup
+printf 'v1\n' > gen.in
+cat > Mkfile <<'EOF'
+top: a.o b.o
+a.o: gen.h
+	cat gen.h > a.o
+	echo a >> build.log
+b.o: gen.h
+	cat gen.h > b.o
+	echo b >> build.log
+gen.h: gen.in
+	cp gen.in gen.h
+EOF
+mkrun top
+printf 'v2\n' > gen.in
+touch -d '2020-01-01 00:00:00' gen.h
+touch -d '2020-01-01 00:00:01' a.o b.o
+touch -d '2020-01-01 00:00:02' gen.in
+mkrun top
+eq "$(cat a.o b.o | tr '\n' ' ')" "v2 v2 " "both dependents saw the rebuilt prerequisite"
+mkrun top
+eq "$(wc -l < build.log | tr -d ' ')" "4" "and nothing was rebuilt once up to date"
+
+begin ".RESTAT: stops the rebuild when an output did not change"
+setup
+printf 'v1\n' > gen.in
+cat > Mkfile <<'EOF'
+.RESTAT: gen.h
+gen.h: gen.in
+	cp gen.in gen.h
+	echo gen >> build.log
+out: gen.h
+	cat gen.h > out
+	echo out >> build.log
+EOF
+mkrun out
+sleep 1
+touch gen.in
+mkrun out
+eq "$(grep -c gen build.log)" "2" "the generator ran again"
+eq "$(grep -c out build.log)" "1" "the dependent was not rebuilt"
+file_exists ".mkstate" "the hashes were persisted"
+mkrun out
+eq "$(wc -l < build.log | tr -d ' ')" "3" "nothing ran on the next invocation"
+sleep 1
+printf 'v2\n' > gen.in
+mkrun out
+eq "$(grep -c out build.log)" "2" "a changed output still propagates"
+eq "$(cat out)" "v2" "the dependent saw the new content"
+
+begin ".RESTAT: applies to inference rules"
+setup
+printf 'x\n' > a.in
+cat > Mkfile <<'EOF'
+.RESTAT: .in.gen
+.in.gen:
+	cp $< $@
+final: a.gen
+	cat a.gen > final
+	echo final >> build.log
+EOF
+mkrun final
+sleep 1
+touch a.in
+mkrun final
+eq "$(wc -l < build.log | tr -d ' ')" "1" "an identical inferred output did not rebuild final"
+
+begin ".DEPFILE: deps written by the recipe trigger rebuilds"
+setup
+printf 'int x;\n' > prog.c
+touch hdr.h
+printf 'prog.o: prog.c \\\n  hdr.h\nhdr.h:\n' > dep.fixture
+cat > Mkfile <<'EOF'
+.DEPFILE: .c.o
+.c.o:
+	cat $< > $@
+	cp dep.fixture ${.TARGET:R}.d
+	echo cc >> build.log
+EOF
+mkrun prog.o
+rc_ok "the object was built"
+mkrun prog.o
+eq "$(wc -l < build.log | tr -d ' ')" "1" "an up-to-date object is not rebuilt"
+sleep 1
+touch hdr.h
+rm -f prog.d
+mkrun prog.o
+eq "$(wc -l < build.log | tr -d ' ')" "2" "a newer header from the depfile forced a rebuild, without the .d file"
+rm -f hdr.h
+mkrun prog.o
+eq "$(wc -l < build.log | tr -d ' ')" "3" "a vanished header forces a rebuild"
+
+begin ".DEPFILE: deps are built first, and .RESTAT: applies to them"
+setup
+printf 'int a;\n' > a.c
+printf 'v1\n' > gen.in
+cat > Mkfile <<'EOF'
+.RESTAT: gen.h
+.DEPFILE: a.o
+a.o: a.c
+	cat a.c gen.h > $@
+	printf 'a.o: a.c gen.h\n' > a.d
+	echo cc >> build.log
+gen.h: gen.in
+	sed 's/^v/#define V /' gen.in > $@
+EOF
+mkrun gen.h
+mkrun a.o
+rc_ok "the object was built"
+eq "$(wc -l < build.log | tr -d ' ')" "1" "the object was compiled once"
+sleep 1
+touch gen.in
+mkrun a.o
+eq "$(wc -l < build.log | tr -d ' ')" "1" "an identical generated header from the depfile did not force a rebuild"
+sleep 1
+printf 'v2\n' > gen.in
+mkrun a.o
+eq "$(wc -l < build.log | tr -d ' ')" "2" "a changed generated header from the depfile forced a rebuild"
+contains "$(cat a.o)" "#define V 2" "the header was regenerated before the object"
+
+begin "sub-second differences in timestamps decide rebuilds"
+setup
+printf 'x\n' > data.in
+cat > Mkfile <<'EOF'
+data.out: data.in
+	cp data.in data.out
+	echo built >> build.log
+EOF
+mkrun data.out
+touch -d '2020-01-01 00:00:00.200000000' data.in
+touch -d '2020-01-01 00:00:00.500000000' data.out
+mkrun data.out
+eq "$(wc -l < build.log | tr -d ' ')" "1" "an output 0.3s newer than its source is up to date"
+touch -d '2020-01-01 00:00:00.700000000' data.in
+mkrun data.out
+eq "$(wc -l < build.log | tr -d ' ')" "2" "a source 0.2s newer than the output forces a rebuild"
+
+begin "symlinked sources are followed unless listed in .NOFOLLOW:"
+setup
+printf 'x\n' > real.src
+ln -s real.src link.src
+cat > Mkfile <<'EOF'
+out: link.src
+	cat link.src > out
+	echo built >> build.log
+EOF
+mkrun out
+touch -h -d '2020-01-01 00:00:00' link.src
+touch -d '2020-01-01 00:00:01' out
+touch -d '2020-01-01 00:00:02' real.src
+mkrun out
+eq "$(wc -l < build.log | tr -d ' ')" "2" "the newer target of the symlink forced a rebuild"
+printf '.NOFOLLOW: link.src\n' > Mkfile.tmp
+cat Mkfile >> Mkfile.tmp
+mv Mkfile.tmp Mkfile
+touch -h -d '2020-01-01 00:00:00' link.src
+touch -d '2020-01-01 00:00:01' out
+touch -d '2020-01-01 00:00:02' real.src
+mkrun out
+eq "$(wc -l < build.log | tr -d ' ')" "2" "with .NOFOLLOW:, the mtime of the link itself is used"
+
+begin "prerequisites keep their order across plain and expanded rule lines"
+setup
+touch x y z w
+cat > Mkfile <<'EOF'
+all: a b
+a: x
+	@echo a: $^
+Y = y
+a: ${Y}
+a: z
+b c: w
+	@echo $@: $^
+b: x
+EOF
+mkrun
+rc_ok "the default goal was built"
+contains "$OUT" "a: x y z" "a keeps the order of its rule lines"
+contains "$OUT" "b: w x" "b keeps the order of its rule lines"
+mkrun -p
+contains "$OUT" "x y z" "-p shows the prerequisites of a"
+
 finish
@@ -40,6 +40,13 @@ printf 'all:\n\t@echo two\n' > b.mk
 OUT=$("$MK" -f a.mk -f b.mk 2>"$WORK/.err"); RC=$?
 eq "$OUT" "two" "only the last -f is honored"
 
+begin "CLI: -f accepts an absolute path"
+setup
+mkdir sub
+printf 'all:\n\t@echo from-abs\n' > sub/abs.mk
+OUT=$("$MK" -f "$PWD/sub/abs.mk" 2>"$WORK/.err"); RC=$?
+eq "$OUT" "from-abs" "-f /abs/path"
+
 begin "CLI: -C changes the working directory"
 setup
 mkdir sub
@@ -145,6 +152,184 @@ EOF
 mkrun -S all
 absent "$OUT" "ok-built" "-S: stops, ok not reached"
 
+begin "CLI: -w rebuilds when a source changes"
+setup
+printf 'v1\n' > data.in
+cat > Mkfile <<'EOF'
+data.out: data.in
+	cp data.in data.out
+	echo built >> build.log
+EOF
+"$MK" -w data.out >watch.log 2>&1 &
+pid=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	[ -s build.log ] && break
+	sleep 1
+done
+eq "$(cat data.out)" "v1" "-w: the initial build ran"
+printf 'v2\n' > data.in
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	[ "$(wc -l < build.log | tr -d ' ')" -ge 2 ] && break
+	sleep 1
+done
+eq "$(cat data.out)" "v2" "-w: the change was picked up"
+eq "$(wc -l < build.log | tr -d ' ')" "2" "-w: the recipe ran once per change"
+printf 'e\n' > extra.in
+cat > Mkfile <<'EOF'
+data.out: data.in extra.in
+	cat data.in extra.in > data.out
+EOF
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	[ "$(tr -d '\n' < data.out)" = "v2e" ] && break
+	sleep 1
+done
+eq "$(tr -d '\n' < data.out)" "v2e" "-w: a changed Mkfile is re-read"
+kill "$pid" 2>/dev/null
+wait "$pid" 2>/dev/null
+
+begin "CLI: -D serves builds from the parsed tree"
+setup
+printf 'v1\n' > data.in
+cat > Mkfile <<'EOF'
+PARSED != echo parsed >> parse.log; echo yes
+data.out: data.in
+	cp data.in data.out
+EOF
+"$MK" -D >daemon.log 2>&1 &
+pid=$!
+for i in 1 2 3 4 5; do
+	[ -S .mk.sock ] && break
+	sleep 1
+done
+mkrun data.out
+rc_ok "-D: the client succeeded"
+eq "$(cat data.out)" "v1" "-D: the daemon built the target"
+eq "$(wc -l < parse.log | tr -d ' ')" "1" "-D: the client did not parse the Mkfile"
+sleep 1
+printf 'v2\n' > data.in
+mkrun data.out
+eq "$(cat data.out)" "v2" "-D: the daemon noticed the changed source"
+mkrun no-such-target
+rc_fail "-D: a failed build is reported to the client"
+printf 'late:\n\t@echo late-built\n' >> Mkfile
+mkrun late
+contains "$OUT" "late-built" "-D: a changed Mkfile is picked up"
+kill "$pid" 2>/dev/null
+wait "$pid" 2>/dev/null
+eq "$(ls -A | grep -c '^\.mk\.sock$')" "0" "-D: the socket is removed on exit"
+
+begin "CLI: -D declines a client whose environment changes a ??= macro"
+setup
+cat > Mkfile <<'EOF'
+PARSED != echo parsed >> parse.log; echo yes
+MODE ??= debug
+all:
+	@echo mode=${MODE}
+EOF
+env -u MODE "$MK" -D >daemon.log 2>&1 &
+pid=$!
+for i in 1 2 3 4 5; do
+	[ -S .mk.sock ] && break
+	sleep 1
+done
+OUT=$(env -u MODE "$MK" all 2>"$WORK/.err")
+eq "$OUT" "mode=debug" "-D: the daemon used the default"
+eq "$(wc -l < parse.log | tr -d ' ')" "1" "-D: a client with the same environment was served"
+OUT=$(MODE=release "$MK" all 2>"$WORK/.err")
+eq "$OUT" "mode=release" "-D: a client with another MODE saw its own value"
+eq "$(wc -l < parse.log | tr -d ' ')" "2" "-D: that client was declined and parsed by itself"
+kill "$pid" 2>/dev/null
+wait "$pid" 2>/dev/null
+
+begin "CLI: -D serves a client with other -s and -v options"
+setup
+cat > Mkfile <<'EOF'
+PARSED != echo parsed >> parse.log; echo yes
+all:
+	echo hi
+EOF
+"$MK" -D >daemon.log 2>&1 &
+pid=$!
+for i in 1 2 3 4 5; do
+	[ -S .mk.sock ] && break
+	sleep 1
+done
+OUT=$("$MK" -s all 2>"$WORK/.err")
+eq "$OUT" "hi" "-D: the recipe was not echoed for -s"
+OUT=$("$MK" -v all 2>"$WORK/.err")
+contains "$OUT" "echo hi" "-D: the recipe was echoed without -s"
+eq "$(wc -l < parse.log | tr -d ' ')" "1" "-D: both clients were served by the daemon"
+kill "$pid" 2>/dev/null
+wait "$pid" 2>/dev/null
+
+# A parse writes .mkcache, a cache hit leaves it alone.
+cache_hit() {
+	touch -d '2000-01-01 00:00:00' .mkcache
+	touch -d '2000-01-01 00:00:01' new.ref
+	mkrun -c all
+	eq "$(find .mkcache -newer new.ref)" "" "$1"
+}
+
+begin "CLI: -c reuses the parse of an unchanged Mkfile"
+setup
+mkdir sub
+cat > Mkfile <<'EOF'
+X != echo x
+CFLAGS = -O
+.EXPORTS: CFLAGS
+.SUBDIRS: sub
+all: sub/all
+	@echo top $X
+EOF
+cat > sub/Mkfile <<'EOF'
+all:
+	@echo sub ${CFLAGS}
+EOF
+mkrun -c all
+file_exists ".mkcache" "-c: the cache was written"
+cache_hit "-c: the Mkfile was parsed only once"
+rc_ok "-c: the cached build succeeded"
+contains "$OUT" "sub -O" "-c: the subdirectory saw the exported macro"
+contains "$OUT" "top x" "-c: the macro from the cached parse was used"
+sed 's/^X != echo x/X != echo y/' Mkfile > Mkfile.tmp
+mv Mkfile.tmp Mkfile
+mkrun -c all
+contains "$OUT" "top y" "-c: a changed Mkfile is parsed again"
+cache_hit "-c: and cached again"
+
+begin "CLI: -c parses again when the output of a != command changed"
+setup
+echo 1 > version
+cat > Mkfile <<'EOF'
+V != cat version
+all:
+	@echo v$V
+EOF
+mkrun -c all
+cache_hit "-c: an unchanged output keeps the cached parse"
+contains "$OUT" "v1" "-c: the cached value was used"
+echo 2 > version
+mkrun -c all
+contains "$OUT" "v2" "-c: a changed output is seen"
+cache_hit "-c: and cached again"
+
+begin "CLI: -c parses again when a cache entry is corrupt"
+setup
+cat > Mkfile <<'EOF'
+X != echo x
+all:
+	@echo top $X
+EOF
+mkrun -c all
+size=$(wc -c < .mkcache | tr -d ' ')
+printf '\377' | dd of=.mkcache bs=1 seek=$((size - 1)) conv=notrunc 2>/dev/null
+mkrun -c all
+rc_ok "-c: the build still succeeded"
+contains "$OUT" "top x" "-c: the Mkfile was parsed instead"
+contains "$ERR" "corrupt parse cache entry" "-c: the corrupt entry was reported"
+cache_hit "-c: the fresh parse was cached again"
+absent "$ERR" "corrupt" "-c: the cache was rewritten"
+
 begin "CLI: unknown option exits non-zero"
 setup
 cat > Mkfile <<'EOF'
@@ -89,4 +89,50 @@ EOF
 mkrun
 eq "$OUT" "a,b,c" "backslash-newline produces three separate words"
 
+begin "an escaped backslash at the end of a line does not continue it"
+setup
+# no newline after the last line, either
+printf 'A = x\\\\\nB = y\nall:\n\t@echo "${A}|${B}"' > Mkfile
+mkrun
+eq "$OUT" 'x\|y' "the line after A = x\\\\ is a separate assignment"
+
+begin "a recipe line may refer to a macro any number of times"
+setup
+{
+	printf 'X = x\nall:\n\t@echo '
+	i=0
+	while [ $i -lt 100 ]; do
+		printf '${X}'
+		i=$((i + 1))
+	done
+	printf '\n'
+} > Mkfile
+mkrun
+rc_ok "100 references are not mistaken for a recursion"
+eq "${#OUT}" "100" "every reference was expanded"
+
+begin "a recursive macro is reported"
+setup
+cat > Mkfile <<'EOF'
+A = ${B:U}
+B = ${A}
+all:
+	@echo ${A}
+EOF
+mkrun
+rc_fail "the expansion failed"
+contains "$ERR" "maximum expansion depth" "the recursion was detected"
+
+begin "a recipe line is expanded anew for each target"
+setup
+cat > Mkfile <<'EOF'
+SUF = .out
+.in.x:
+	@echo ${.TARGET:R}${SUF} $<
+all: a.x b.x
+EOF
+touch a.in b.in
+mkrun
+eq "$OUT" "$(printf 'a.out a.in\nb.out b.in')" "the same compiled line saw each target"
+
 finish
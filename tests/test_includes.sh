@@ -90,4 +90,23 @@ EOF
 mkrun
 eq "$OUT" "nested-value" "include depth chains correctly"
 
+begin "an include shared by several subdirs is read again when it changes"
+setup
+mkdir a b c
+printf 'V = old\n.if "${V}" == "old"\nW = cond\n.endif\n' > common.mk
+for d in a b c; do
+	printf 'include ${.TOPDIR}/common.mk\nall:\n\t@echo %s-${V}-${W}\n' $d > $d/Mkfile
+done
+cat > Mkfile <<'EOF'
+.SUBDIRS: a b c
+all: a/all b/all gen c/all
+gen:
+	@printf 'V = new-value\n' > common.mk
+EOF
+mkrun all
+rc_ok "all subdirs were built"
+contains "$OUT" "a-old-cond" "the first includer parsed the include"
+contains "$OUT" "b-old-cond" "the second includer saw the same lines"
+contains "$OUT" "c-new-value-" "the rewritten include was read again"
+
 finish
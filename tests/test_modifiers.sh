@@ -85,6 +85,26 @@ eq "$OUT" "main.o" ":M*.c then :.c=.o"
 probe ":T:U"
 eq "$OUT" "MAIN.C LEX.L PARSE.Y" ":T (no dir parts) then :U uppercases"
 
+begin "modifiers :M and :N with several wildcards"
+setup
+SAMPLE="a.tar.gz a.gz lib/t_x.c t_y.c"
+probe ":M*.tar.*"
+eq "$OUT" "a.tar.gz" ":M with * in the middle and at the end"
+probe ":M*t_*.c"
+eq "$OUT" "lib/t_x.c t_y.c" ":M with * in front, in the middle, and a suffix"
+probe ":Nt_*"
+eq "$OUT" "a.tar.gz a.gz lib/t_x.c" ":N with a prefix"
+probe ":M?.gz"
+eq "$OUT" "a.gz" ":M with ?"
+
+begin "a chain of modifiers behaves like separate passes"
+setup
+SAMPLE=".c src/a.c b.h"
+probe ":R:T:J,"
+eq "$OUT" "a,b" "a word emptied by :R is dropped by the next modifier"
+probe ":M*.c:R:T:U:=.o"
+eq "$OUT" "A.o" "a longer chain"
+
 begin ":F returns the word unchanged when no file is found"
 setup
 mkdir src
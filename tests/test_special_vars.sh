@@ -157,4 +157,44 @@ EOF
 mkrun prog
 eq "$OUT" "STAR=main.c" ".IMPSRC:T strips the directory"
 
+begin "\$* and \$& agree with the spelled-out modifiers in a subdirectory"
+setup
+mkdir -p sub/src
+: > sub/src/util.c
+cat > sub/Mkfile <<'EOF'
+all: src/util.c none
+	@echo "$* ${.IMPSRC:T} $& ${.SCOPE:T}"
+none:
+	@echo "[$*]"
+EOF
+cat > Mkfile <<'EOF'
+.SUBDIRS: sub
+EOF
+mkrun sub/all
+eq "$OUT" "$(printf '[]\nutil.c util.c sub sub')" "the tails match, and are empty without a source"
+
+begin "a macro referring to \$@ through another macro is expanded per target"
+setup
+cat > Mkfile <<'EOF'
+OUT = ${NAME}.out
+NAME = ${.TARGET:R}
+all: a.x b.x
+a.x b.x:
+	@echo ${OUT}
+EOF
+mkrun
+eq "$OUT" "$(printf 'a.out\nb.out')" "each target saw its own name"
+
+begin ".ALLSRC of targets sharing a rule line, after one of them gains a prerequisite"
+setup
+touch x y
+cat > Mkfile <<'EOF'
+all: a b
+a b: x
+	@echo $@: $^
+a: y
+EOF
+mkrun
+eq "$OUT" "$(printf 'a: x y\nb: x')" "the new prerequisite was added only to its own target"
+
 finish
@@ -117,4 +117,62 @@ mkrun sub/install
 contains "$OUT" "sub-all" "sub/all was built as a prerequisite of sub/install"
 contains "$OUT" "sub-install" "sub/install was then built"
 
+begin "a sibling Mkfile written by an earlier recipe is the one parsed"
+setup
+mkdir a b c
+printf 'all:\n\t@echo a-all\n' > a/Mkfile
+printf 'all:\n\t@echo b-old\n' > b/Mkfile
+printf 'all:\n\t@echo c-all\n' > c/Mkfile
+cat > Mkfile <<'EOF'
+.SUBDIRS: a b c
+all: a/all gen b/all c/all
+gen:
+	@printf 'all:\n\t@echo b-new\n' > b/Mkfile
+EOF
+mkrun all
+contains "$OUT" "b-new" "b/Mkfile was parsed after the recipe rewrote it"
+absent "$OUT" "b-old" "the old contents were not used"
+contains "$OUT" "c-all" "the other siblings were parsed as usual"
+
+# The read-ahead reads and splits these on helper threads; under `make
+# check-tsan`, this also checks it for races.  Parsing stays on one thread.
+begin "many sibling Mkfiles with includes are read ahead correctly"
+setup
+dirs=
+i=0
+while [ $i -lt 40 ]; do
+	mkdir d$i
+	printf 'N%d = %d\n' $i $i > d$i/inc.mk
+	printf 'include inc.mk\nV = ${N%d}\nall:\n\t@echo d%d=${V}\n' $i $i > d$i/Mkfile
+	dirs="$dirs d$i"
+	i=$((i + 1))
+done
+printf '.SUBDIRS:%s\nall: ${.SUBDIRS:=/all}\n' "$dirs" > Mkfile
+mkrun all
+rc_ok "all subdirs were built"
+contains "$OUT" "d0=0" "the first subdir saw its include"
+contains "$OUT" "d39=39" "the last subdir saw its include"
+eq "$(printf '%s\n' "$OUT" | grep -c '^d[0-9]*=')" "40" "every subdir ran once"
+absent "$ERR" "ThreadSanitizer" "no data races were reported"
+
+begin "a subdir macro hides an exported one, even after it was referenced"
+setup
+mkdir sub
+cat > sub/Mkfile <<'EOF'
+A := ${V}-${W}
+V = local
+W = now
+B := ${V}-${W}
+all:
+	@echo ${A} ${B}
+EOF
+cat > Mkfile <<'EOF'
+V = top
+.EXPORTS: V
+.SUBDIRS: sub
+all: sub/all
+EOF
+mkrun
+eq "$OUT" "top- local-now" "later definitions were seen by later references"
+
 finish
@@ -95,4 +95,34 @@ contains "$OUT" "built=unit-one" "first expansion produced unit-one"
 mkrun unit-two
 contains "$OUT" "built=unit-two" "second expansion produced unit-two"
 
+begin "repeated expansions evaluate each line again and report template lines"
+setup
+cat > Mkfile <<'EOF'
+LIST = first
+.template unit
+LIST := ${LIST} ${N}
+.if "${N}" == "two"
+TWO = seen
+.endif
+.endt
+.template bad
+OK = 1
+.endif
+.endt
+N = one
+.expand unit
+N = two
+.expand unit
+N = three
+.expand unit
+all:
+	@echo "${LIST}/${TWO}"
+EOF
+mkrun
+eq "$OUT" "first one two three/seen" "each expansion saw its own value of N"
+printf '.expand bad\n' >> Mkfile
+mkrun
+rc_fail "a broken template is an error"
+contains "$ERR" "template:3: not in .if" "the error names the line in the template"
+
 finish